@@ -68,22 +68,18 @@
  *       this[1]="fruit" (argument to -b)
  */
 
-// Linked list of all known options (get_opt string is parsed into this).
-struct opts {
-	struct opts *next;
-	long *arg;         // Pointer into union "this" to store arguments at.
-	uint32_t edx[3];   // Flag mask to enable/disable/exclude.
-	int c;             // Short argument character
-	int flags;         // |=1, ^=2
-	char type;         // Type of arguments to store
-};
+// scripts/mkopts.c parses each command's option string at build time, into
+// toy_opts[] (one struct optstring per toy_list[] entry), so all that's left
+// to do here is look up each option character in its table.
+
+#include "generated/opts.h"
 
 // State during argument parsing.
 struct getoptflagstate
 {
 	int argc;
 	char *arg;
-	struct opts *opts, *this;
+	struct opts *this;
 	int noerror, nodash_now, stopearly;
 	uint32_t excludes;
 };
@@ -109,6 +105,7 @@ static int gotflag(struct getoptflagstate *gof)
 	gof->arg++;
 	type = opt->type;
 	if (type) {
+		long *arg = (long *)&this + opt->slot;
 
 		// Handle "-xblah" and "-x blah", but also a third case: "abxc blah"
 		// to make "tar xCjfv blah1 blah2 thingy" work like
@@ -122,16 +119,16 @@ static int gotflag(struct getoptflagstate *gof)
 		// Grab argument.
 		if (!gof->arg && !(gof->arg = toys.argv[++(gof->argc)]))
 			error_exit("Missing argument");
-		if (type == ':') *(opt->arg) = (long)gof->arg;
+		if (type == ':') *arg = (long)gof->arg;
 		else if (type == '*') {
 			struct arg_list **list;
 
-			list = (struct arg_list **)opt->arg;
+			list = (struct arg_list **)arg;
 			while (*list) list=&((*list)->next);
 			*list = xzalloc(sizeof(struct arg_list));
 			(*list)->arg = gof->arg;
-		} else if (type == '#') *(opt->arg) = atolx((char *)gof->arg);
-		else if (type == '@') ++*(opt->arg);
+		} else if (type == '#') *arg = atolx((char *)gof->arg);
+		else if (type == '@') ++*arg;
 
 		gof->arg = "";
 	}
@@ -142,19 +139,12 @@ static int gotflag(struct getoptflagstate *gof)
 
 // Fill out toys.optflags and toys.optargs.
 
-static char *plustildenot = "+~!";
 void get_optflags(void)
 {
-	int nodash = 0, minargs = 0, maxargs;
-	struct longopts {
-		struct longopts *next;
-		struct opts *opt;
-		char *str;
-		int len;
-	} *longopts = NULL;
+	struct optstring *table = toy_opts + (toys.which - toy_list);
+	int nodash = table->nodash, minargs = table->minargs, maxargs;
 	struct getoptflagstate gof;
-	long *nextarg = (long *)&this, saveflags;
-	char *options = toys.which->options;
+	long saveflags;
 	char *letters[]={"s",""};
 
 	if (CFG_HELP) toys.exithelp++;
@@ -162,109 +152,13 @@ void get_optflags(void)
 	maxargs = 0;
 	while (toys.argv[maxargs++]);
 	toys.optargs = xzalloc(sizeof(char *)*maxargs);
-	maxargs = INT_MAX;
+	maxargs = table->maxargs < 0 ? INT_MAX : table->maxargs;
 	bzero(&gof, sizeof(struct getoptflagstate));
+	gof.stopearly = table->stopearly;
+	gof.noerror = table->noerror;
 
-	// Parse option format
-	if (options) {
-
-		// Parse leading special behavior indicators
-		for (;;) {
-			if (*options == '^') gof.stopearly++;
-			else if (*options == '<') minargs=*(++options)-'0';
-			else if (*options == '>') maxargs=*(++options)-'0';
-			else if (*options == '?') gof.noerror++;
-			else if (*options == '&') nodash++;
-			else break;
-			options++;
-		}
-
-		if (!*options) gof.stopearly++;
-		// Parse rest of opts into array
-		while (*options) {
-			char *temp;
-
-			// Allocate a new option entry when necessary
-			if (!gof.this) {
-				gof.this = xzalloc(sizeof(struct opts));
-				gof.this->next = gof.opts;
-				gof.opts = gof.this;
-				++*(gof.this->edx);
-			}
-			// Each option must start with "(" or an option character.  (Bare
-			// longopts only come at the start of the string.)
-			if (*options == '(') {
-				char *end;
-				struct longopts *lo = xmalloc(sizeof(struct longopts));
-
-				// Find the end of the longopt
-				for (end = ++options; *end && *end != ')'; end++);
-				if (CFG_TOYBOX_DEBUG && !*end)
-					error_exit("Bug1 in get_opt");
-
-				// Allocate and init a new struct longopts
-				lo = xmalloc(sizeof(struct longopts));
-				lo->next = longopts;
-				lo->opt = gof.this;
-				lo->str = options;
-				lo->len = end-options;
-				longopts = lo;
-				options = end;
-
-				// Mark this as struct opt as used, even when no short opt.
-				if (!gof.this->c) gof.this->c = -1;
-
-			// If this is the start of a new option that wasn't a longopt,
-
-			} else if (strchr(":*#@", *options)) {
-				gof.this->type = *options;
-			} else if (0 != (temp = strchr(plustildenot, *options))) {
-				int i=0, idx = temp - plustildenot;
-				struct opts *opt;
-
-				if (!*++options && CFG_TOYBOX_DEBUG)
-					error_exit("Bug2 in get_opt");
-				// Find this option flag (in previously parsed struct opt)
-				for (opt = gof.this; ; opt = opt->next) {
-					if (CFG_TOYBOX_DEBUG && !opt) error_exit("Bug3 in get_opt");
-					if (opt->c == *options) break;
-					i++;
-				}
-				gof.this->edx[idx] |= 1<<i;
-
-			} else if (*options == '[') {
-			} else if (*options == '|') gof.this->flags |= 1;
-			else if (*options == '^') gof.this->flags |= 2;
-
-			// At this point, we've hit the end of the previous option.  The
-			// current character is the start of a new option.  If we've already
-			// assigned an option to this struct, loop to allocate a new one.
-			// (It'll get back here afterwards and fall through to next else.)
-			else if(gof.this->c) {
-				gof.this = NULL;
-				continue;
-
-			// Claim this option, loop to see what's after it.
-			} else gof.this->c = *options;
-
-			options++;
-		}
-	}
-
-	// Initialize enable/disable/exclude masks and pointers to store arguments.
-	// (We have to calculate all this ahead of time because longopts jump into
-	// the middle of the list.)
-	gof.argc = 0;
-	for (gof.this = gof.opts; gof.this; gof.this = gof.this->next) {
-		int i;
-
-		for (i=0;i<3;i++) gof.this->edx[i] <<= gof.argc;
-		gof.argc++;
-		if (gof.this->type) {
-			gof.this->arg = (void *)nextarg;
-			*(nextarg++) = 0;
-		}
-	}
+	// Clear the slots in union "this" that options store arguments in.
+	memset(&this, 0, table->nargs*sizeof(long));
 
 	// Iterate through command line arguments, skipping argv[0]
 	for (gof.argc=1; toys.argv[gof.argc]; gof.argc++) {
@@ -293,22 +187,24 @@ void get_optflags(void)
 				}
 				// Handle --longopt
 
-				for (lo = longopts; lo; lo = lo->next) {
+				for (lo = table->longopts; lo && lo->str; lo++) {
 					if (!strncmp(gof.arg, lo->str, lo->len)) {
+						// It's a match.  Leave gof.arg one before any argument,
+						// since gotflag() skips the option character.
 						if (gof.arg[lo->len]) {
-							if (gof.arg[lo->len]=='=' && lo->opt->type)
+							if (gof.arg[lo->len]=='='
+								&& table->opts[lo->opt].type)
+							{
 								gof.arg += lo->len;
-							else continue;
-						}
-						// It's a match.
-						gof.arg = "";
-						gof.this = lo->opt;
+							} else continue;
+						} else gof.arg += lo->len-1;
+						gof.this = table->opts + lo->opt;
 						break;
 					}
 				}
 
 				// Should we handle this --longopt as a non-option argument?
-				if (!lo && gof.noerror) {
+				if (!gof.this && gof.noerror) {
 					gof.arg-=2;
 					goto notflag;
 				}
@@ -328,10 +224,12 @@ void get_optflags(void)
 		// each entry (could be -abc meaning -a -b -c)
 		saveflags = toys.optflags;
 		while (*gof.arg) {
+			unsigned c = *(unsigned char *)gof.arg - table->first;
 
 			// Identify next option char.
-			for (gof.this = gof.opts; gof.this; gof.this = gof.this->next)
-				if (*gof.arg == gof.this->c) break;
+			gof.this = NULL;
+			if (c < table->len && table->map[c])
+				gof.this = table->opts + table->map[c]-1;
 
 			// Handle option char (advancing past what was used)
 			if (gotflag(&gof) ) {
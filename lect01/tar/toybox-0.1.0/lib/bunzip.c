@@ -12,18 +12,12 @@
 
 #include "toys.h"
 
-#define THREADS 1
-
-// Constants for huffman coding
-#define MAX_GROUPS               6
-#define GROUP_SIZE               50     /* 64 would have been more efficient */
-#define MAX_HUFCODE_BITS         20     /* Longest huffman code allowed */
-#define MAX_SYMBOLS              258    /* 256 literals + RUNA + RUNB */
-#define SYMBOL_RUNA              0
-#define SYMBOL_RUNB              1
+// Constants for huffman decoding (the format constants are in lib.h)
+#define HUFF_TABLE_BITS          10     /* Codes this long decode in one step */
 
 // Other housekeeping constants
 #define IOBUF_SIZE               4096
+#define OUTBUF_SIZE              65536
 
 // Status return values
 #define RETVAL_LAST_BLOCK        (-100)
@@ -38,9 +32,12 @@ char *bunzip_errors[]={
 	"Obsolete (pre 0.9.5) bzip format not supported."
 };
 
-// This is what we know about each huffman coding group
+// This is what we know about each huffman coding group.  table[] maps the
+// next HUFF_TABLE_BITS bits of input to (length<<9)|symbol, or 0 if the code
+// is longer than that (walk limit[] from there), or 0xffff if it's invalid.
 struct group_data {
 	int limit[MAX_HUFCODE_BITS+1], base[MAX_HUFCODE_BITS], permute[MAX_SYMBOLS];
+	unsigned short table[1<<HUFF_TABLE_BITS];
 	char minLen, maxLen;
 };
 
@@ -49,24 +46,29 @@ struct group_data {
 struct bwdata {
 	unsigned int origPtr;
 	int byteCount[256];
-	// State saved when interrupting output
-	int writePos, writeRun, writeCount, writeCurrent;
+	int writeCount;
 	unsigned int dataCRC, headerCRC;
-	unsigned int *dbuf;
+	// dbuf[] holds the forward (T) vector, lf[] its inverse, text[] the result
+	unsigned int *dbuf, *lf;
+	unsigned char *text;
 };
 
 // Structure holding all the housekeeping data, including IO buffers and
-// memory that persists between calls to bunzip
+// memory that persists between calls to bunzip.  The parallel decoder gives
+// each worker thread its own copy, reading from memory (in_fd -1).
 struct bunzip_data {
 
 	// Input stream, input buffer, input bit buffer
-	int in_fd, inbufCount, inbufPos;
+	int in_fd, inbufCount, inbufPos, overrun;
 	char *inbuf;
-	unsigned int inbufBitCount, inbufBits;
+	unsigned int inbufBitCount;
+	unsigned long long inbufBits;
 
-	// Output buffer
-	char outbuf[IOBUF_SIZE];
+	// Output buffer, and where to flush it when there's no out_fd.
+	char outbuf[OUTBUF_SIZE];
 	int outbufPos;
+	char *outmem;
+	long outmemLen, outmemSize;
 
 	unsigned int totalCRC;
 
@@ -77,48 +79,62 @@ struct bunzip_data {
 	unsigned char symToByte[256], mtfSymbol[256];
 
 	// The CRC values stored in the block header and calculated from the data
-	unsigned int crc32Table[256];
+	// (crc32Table[n] is the crc of a byte followed by n zero bytes, to do
+	// 8 bytes at a time)
+	unsigned int crc32Table[8][256];
 
 	// Second pass decompression data (burrows-wheeler transform)
 	unsigned int dbufSize;
-	struct bwdata bwdata[THREADS];
+	struct bwdata bwdata;
 };
 
-// Return the next nnn bits of input.  All reads from the compressed input
-// are done through this function.  All reads are big endian.
-static unsigned int get_bits(struct bunzip_data *bd, char bits_wanted)
+// Top up the bit buffer until it holds at least "want" bits (at most 56).
+// Only read() when we're actually short, so prefetching can't block or hit
+// EOF, then grab whatever whole bytes are already buffered.  Running off the
+// end of in-memory data feeds zeroes and counts them in overrun.
+static void fill_bits(struct bunzip_data *bd, unsigned want)
 {
-	unsigned int bits = 0;
-
-	// If we need to get more data from the byte buffer, do so.  (Loop getting
-	// one byte at a time to enforce endianness and avoid unaligned access.)
-	while (bd->inbufBitCount < bits_wanted) {
+	while (bd->inbufBitCount < want) {
+		unsigned char c;
 
 		// If we need to read more data from file into byte buffer, do so
-		if (bd->inbufPos == bd->inbufCount) {
+		if (bd->inbufPos == bd->inbufCount && bd->in_fd != -1) {
 			if (0 >= (bd->inbufCount = read(bd->in_fd, bd->inbuf, IOBUF_SIZE)))
 				error_exit("Unexpected input EOF");
 			bd->inbufPos = 0;
 		}
 
-		// Avoid 32-bit overflow (dump bit buffer to top of output)
-		if (bd->inbufBitCount>=24) {
-			bits = bd->inbufBits&((1<<bd->inbufBitCount)-1);
-			bits_wanted -= bd->inbufBitCount;
-			bits <<= bits_wanted;
-			bd->inbufBitCount = 0;
+		while (bd->inbufBitCount <= 56) {
+			if (bd->inbufPos < bd->inbufCount) c = bd->inbuf[bd->inbufPos++];
+			else if (bd->in_fd == -1) {
+				c = 0;
+				bd->overrun++;
+			} else break;
+			bd->inbufBits = (bd->inbufBits << 8) | c;
+			bd->inbufBitCount += 8;
 		}
-
-		// Grab next 8 bits of input from buffer.
-		bd->inbufBits = (bd->inbufBits<<8) | bd->inbuf[bd->inbufPos++];
-		bd->inbufBitCount += 8;
 	}
+}
 
-	// Calculate result
+// Return the next nnn bits of input (up to 32).  All reads are big endian.
+static unsigned int get_bits(struct bunzip_data *bd, char bits_wanted)
+{
+	if (bd->inbufBitCount < bits_wanted) fill_bits(bd, bits_wanted);
 	bd->inbufBitCount -= bits_wanted;
-	bits |= (bd->inbufBits>>bd->inbufBitCount) & ((1<<bits_wanted)-1);
 
-	return bits;
+	return (bd->inbufBits >> bd->inbufBitCount) & ((1ULL<<bits_wanted)-1);
+}
+
+// Bits consumed from in-memory input so far, and whether that ran past the
+// end of the data (meaning we decoded padding).
+static long bunzip_bitpos(struct bunzip_data *bd)
+{
+	return 8L*(bd->inbufPos+bd->overrun) - bd->inbufBitCount;
+}
+
+static int bunzip_overran(struct bunzip_data *bd)
+{
+	return bunzip_bitpos(bd) > 8L*bd->inbufCount;
 }
 
 /* Read block header at start of a new compressed data block.  Consists of:
@@ -286,6 +302,20 @@ static int read_block_header(struct bunzip_data *bd, struct bwdata *bw)
 		limit[maxLen] = pp+temp[maxLen]-1;
 		limit[maxLen+1] = INT_MAX;
 		base[minLen] = 0;
+
+		// Fill out table[]: for each HUFF_TABLE_BITS bit value, the shortest
+		// length at which its prefix is <= limit[] is the code it starts with.
+		for (ii = 0; ii < (1<<HUFF_TABLE_BITS); ii++) {
+			hufGroup->table[ii] = maxLen > HUFF_TABLE_BITS ? 0 : 0xffff;
+			for (hh = minLen; hh <= maxLen && hh <= HUFF_TABLE_BITS; hh++) {
+				kk = ii >> (HUFF_TABLE_BITS-hh);
+				if (kk > limit[hh]) continue;
+				kk -= base[hh];
+				if (kk >= 0 && kk < symCount)
+					hufGroup->table[ii] = (hh<<9) | hufGroup->permute[kk];
+				break;
+			}
+		}
 	}
 
 	return 0;
@@ -338,26 +368,30 @@ static int read_huffman_data(struct bunzip_data *bd, struct bwdata *bw)
 			limit = hufGroup->limit-1;
 		}
 
-		// Read next huffman-coded symbol (into jj).
-		ii = hufGroup->minLen;
-		jj = get_bits(bd, ii);
-		while (jj > limit[ii]) {
-			// if (ii > hufGroup->maxLen) return RETVAL_DATA_ERROR;
-			ii++;
-
-			// Unroll get_bits() to avoid a function call when the data's in
-			// the buffer already.
-			kk = bd->inbufBitCount
-			   	? (bd->inbufBits >> --(bd->inbufBitCount)) & 1
-				: get_bits(bd, 1);
-			jj = (jj << 1) | kk;
+		// Read next huffman-coded symbol (into nextSym).  Look the next
+		// HUFF_TABLE_BITS bits up in table[], and only walk limit[] a bit at a
+		// time for the rare longer codes.
+		if (bd->inbufBitCount <= MAX_HUFCODE_BITS)
+			fill_bits(bd, MAX_HUFCODE_BITS+1);
+		jj = (bd->inbufBits >> (bd->inbufBitCount-HUFF_TABLE_BITS))
+			& ((1<<HUFF_TABLE_BITS)-1);
+		kk = hufGroup->table[jj];
+		if (kk == 0xffff) return RETVAL_DATA_ERROR;
+		if (kk) {
+			bd->inbufBitCount -= kk>>9;
+			nextSym = kk & 511;
+		} else {
+			bd->inbufBitCount -= ii = HUFF_TABLE_BITS;
+			while (jj > limit[ii]) {
+				ii++;
+				jj = (jj << 1) | ((bd->inbufBits >> --(bd->inbufBitCount)) & 1);
+			}
+			// Huffman decode jj into nextSym (with bounds checking)
+			jj-=base[ii];
+			if (ii > hufGroup->maxLen || (unsigned)jj >= MAX_SYMBOLS)
+				return RETVAL_DATA_ERROR;
+			nextSym = hufGroup->permute[jj];
 		}
-		// Huffman decode jj into nextSym (with bounds checking)
-		jj-=base[ii];
-
-		if (ii > hufGroup->maxLen || (unsigned)jj >= MAX_SYMBOLS)
-			return RETVAL_DATA_ERROR;
-		nextSym = hufGroup->permute[jj];
 
 		// If this is a repeated run, loop collecting data
 		if ((unsigned)nextSym <= SYMBOL_RUNB) {
@@ -422,17 +456,45 @@ static int read_huffman_data(struct bunzip_data *bd, struct bwdata *bw)
 	return 0;
 }
 
-// Flush output buffer to disk
-void flush_bunzip_outbuf(struct bunzip_data *bd, int out_fd)
+// Add len bytes of output to the block's CRC, 8 bytes at a time.
+static unsigned int bunzip_crc(struct bunzip_data *bd, unsigned int crc,
+	unsigned char *buf, int len)
 {
-	if (bd->outbufPos) {
-		if (write(out_fd, bd->outbuf, bd->outbufPos) != bd->outbufPos)
-			error_exit("Unexpected output EOF");
-		bd->outbufPos = 0;
+	unsigned int (*table)[256] = bd->crc32Table;
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		unsigned int hi = crc ^ ((unsigned)buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3]);
+
+		crc = table[7][hi>>24] ^ table[6][(hi>>16)&255]
+			^ table[5][(hi>>8)&255] ^ table[4][hi&255]
+			^ table[3][buf[4]] ^ table[2][buf[5]]
+			^ table[1][buf[6]] ^ table[0][buf[7]];
 	}
+	while (len--) crc = (crc << 8) ^ table[0][(crc >> 24) ^ *buf++];
+
+	return crc;
+}
+
+// Flush output buffer to disk, or append it to outmem if out_fd is -1,
+// adding it to the block's CRC on the way.
+static void flush_bunzip_outbuf(struct bunzip_data *bd, int out_fd)
+{
+	if (!bd->outbufPos) return;
+	bd->bwdata.dataCRC = bunzip_crc(bd, bd->bwdata.dataCRC,
+		(unsigned char *)bd->outbuf, bd->outbufPos);
+	if (out_fd == -1) {
+		if (bd->outmemLen+bd->outbufPos > bd->outmemSize) {
+			bd->outmemSize = 2*bd->outmemSize + OUTBUF_SIZE;
+			bd->outmem = xrealloc(bd->outmem, bd->outmemSize);
+		}
+		memcpy(bd->outmem+bd->outmemLen, bd->outbuf, bd->outbufPos);
+		bd->outmemLen += bd->outbufPos;
+	} else if (write(out_fd, bd->outbuf, bd->outbufPos) != bd->outbufPos)
+		error_exit("Unexpected output EOF");
+	bd->outbufPos = 0;
 }
 
-void burrows_wheeler_prep(struct bunzip_data *bd, struct bwdata *bw)
+static void burrows_wheeler_prep(struct bunzip_data *bd, struct bwdata *bw)
 {
 	int ii, jj;
 	unsigned int *dbuf = bw->dbuf;
@@ -450,166 +512,168 @@ void burrows_wheeler_prep(struct bunzip_data *bd, struct bwdata *bw)
 	}
 
 	// Use occurrence counts to quickly figure out what order dbuf would be in
-	// if we sorted it.
+	// if we sorted it.  Entry ii moves to sorted position jj, so record
+	// the link both ways: dbuf[jj] points forward to ii, and lf[ii] points
+	// back to jj (with the byte at ii in the top 8 bits, since 20 bits is
+	// plenty for a position).
 	for (ii=0; ii < bw->writeCount; ii++) {
 		unsigned char uc = dbuf[ii];
-		dbuf[byteCount[uc]] |= (ii << 8);
-		byteCount[uc]++;
+		jj = byteCount[uc]++;
+		dbuf[jj] |= (ii << 8);
+		bw->lf[ii] = jj | ((unsigned)uc << 24);
 	}
 
 	// blockRandomised support would go here.
-
-	// Using ii as position, jj as previous character, hh as current character,
-	// and uc as run count.
-	bw->dataCRC = 0xffffffffL;
-
-	/* Decode first byte by hand to initialize "previous" byte.  Note that it
-	   doesn't get output, and if the first three characters are identical
-	   it doesn't qualify as a run (hence uc=255, which will either wrap
-	   to 1 or get reset). */
-	if (bw->writeCount) {
-		bw->writePos = dbuf[bw->origPtr];
-	    bw->writeCurrent = (unsigned char)bw->writePos;
-		bw->writePos >>= 8;
-		bw->writeRun = -1;
-	}
 }
 
 // Decompress a block of text to intermediate buffer
-int read_bunzip_data(struct bunzip_data *bd)
+static int read_bunzip_data(struct bunzip_data *bd)
 {
-	int rc = read_block_header(bd, bd->bwdata);
-	if (!rc) rc=read_huffman_data(bd, bd->bwdata);
+	int rc = read_block_header(bd, &bd->bwdata);
+	if (!rc) rc=read_huffman_data(bd, &bd->bwdata);
 
 	// First thing that can be done by a background thread.
-	burrows_wheeler_prep(bd, bd->bwdata);
+	if (!rc) burrows_wheeler_prep(bd, &bd->bwdata);
 
 	return rc;
 }
 
-// Undo burrows-wheeler transform on intermediate buffer to produce output.
-// If !len, write up to len bytes of data to buf.  Otherwise write to out_fd.
-// Returns len ? bytes written : 0.  Notice all errors are negative #'s.
+// Undo burrows-wheeler transform on intermediate buffer, into bw->text.
+//
+// Following the forward vector in dbuf from origPtr produces the block front
+// to back, and following lf from origPtr produces it back to front.  Each
+// step is a cache miss whose result is the next step's address, so walk both
+// ends at once (meeting in the middle) to keep two misses in flight.  (There's
+// nothing to prefetch: neither chain knows its address more than a step early.)
 //
 // Burrows-wheeler transform is described at:
 // http://dogma.net/markn/articles/bwt/bwt.htm
 // http://marknelson.us/1996/09/01/bwt/
 
-int write_bunzip_data(struct bunzip_data *bd, struct bwdata *bw, int out_fd, char *outbuf, int len)
+static void unbwt(struct bwdata *bw)
 {
-	unsigned int *dbuf = bw->dbuf;
-	int count, pos, current, run, copies, outbyte, previous, gotcount = 0;
+	unsigned int *dbuf = bw->dbuf, *lf = bw->lf, fwd, back;
+	unsigned char *text = bw->text;
+	int count = bw->writeCount, head = 0, tail = count;
+
+	if (!count) return;
+	fwd = dbuf[bw->origPtr] >> 8;
+	back = bw->origPtr;
+	while (tail-head > 1) {
+		unsigned int f = dbuf[fwd], b = lf[back];
+
+		fwd = f >> 8;
+		back = b & 0xffffff;
+		text[head++] = f;
+		text[--tail] = b >> 24;
+	}
+	if (head != tail) text[head] = dbuf[fwd];
+}
 
-	for (;;) {
+// Write a block out to out_fd (see flush_bunzip_outbuf()).  Returns 0, or
+// RETVAL_DATA_ERROR if the block's CRC doesn't match.
 
-		// If last read was short due to end of file, return last block now
-		if (bw->writeCount < 0) return bw->writeCount;
-
-		// If we need to refill dbuf, do it.
-		if (!bw->writeCount) {
-			int i = read_bunzip_data(bd);
-			if (i) {
-				if (i == RETVAL_LAST_BLOCK) {
-					bw->writeCount = i;
-					return gotcount;
-				} else return i;
-			}
+static int write_bunzip_data(struct bunzip_data *bd, struct bwdata *bw,
+	int out_fd)
+{
+	unsigned char *text = bw->text;
+	int ii, copies, run = 0, previous = -1;
+
+	unbwt(bw);
+	bw->dataCRC = 0xffffffff;
+
+	// Undo the initial run length encoding: whenever we see 4 consecutive
+	// copies of the same byte, the next byte is a repeat count.
+	for (ii = 0; ii < bw->writeCount; ii++) {
+		int current = text[ii];
+
+		if (run == 4) {
+			copies = current;
+			current = previous;
+			previous = -1;
+			run = 0;
+		} else {
+			copies = 1;
+			if (current != previous) run = 0;
+			previous = current;
+			run++;
 		}
 
-		// loop generating output
-		count = bw->writeCount;
-		pos = bw->writePos;
-		current = bw->writeCurrent;
-		run = bw->writeRun;
-		while (count) {
-
-			// If somebody (like tar) wants a certain number of bytes of
-			// data from memory instead of written to a file, humor them.
-			if (len && bd->outbufPos>=len) goto dataus_interruptus;
-			count--;
-
-			// Follow sequence vector to undo Burrows-Wheeler transform.
-			previous = current;
-			pos = dbuf[pos];
-			current = pos&0xff;
-			pos >>= 8;
-
-			// Whenever we see 3 consecutive copies of the same byte,
-			// the 4th is a repeat count
-			if (run++ == 3) {
-				copies = current;
-				outbyte = previous;
-				current = -1;
-			} else {
-				copies = 1;
-				outbyte = current;
-			}
+		// Output bytes to buffer, flushing to file if necessary
+		if (copies == 1 && bd->outbufPos < OUTBUF_SIZE) {
+			bd->outbuf[bd->outbufPos++] = current;
+			continue;
+		}
+		while (copies) {
+			int len = OUTBUF_SIZE - bd->outbufPos;
 
-			// Output bytes to buffer, flushing to file if necessary
-			while (copies--) {
-				if (bd->outbufPos == IOBUF_SIZE) flush_bunzip_outbuf(bd,out_fd);
-				bd->outbuf[bd->outbufPos++] = outbyte;
-				bw->dataCRC = (bw->dataCRC << 8)
-								^ bd->crc32Table[(bw->dataCRC >> 24) ^ outbyte];
+			if (!len) {
+				flush_bunzip_outbuf(bd, out_fd);
+				len = OUTBUF_SIZE;
 			}
-			if (current!=previous) run=0;
+			if (len > copies) len = copies;
+			memset(bd->outbuf + bd->outbufPos, current, len);
+			bd->outbufPos += len;
+			copies -= len;
 		}
+	}
+	flush_bunzip_outbuf(bd, out_fd);
+	bw->writeCount = 0;
 
-		// decompression of this block completed successfully
-		bw->dataCRC = ~(bw->dataCRC);
-		bd->totalCRC = ((bd->totalCRC << 1) | (bd->totalCRC >> 31))
-			^ bw->dataCRC;
+	// decompression of this block completed successfully?
+	bw->dataCRC = ~bw->dataCRC;
+	if (bw->dataCRC != bw->headerCRC) return RETVAL_DATA_ERROR;
+	bd->totalCRC = ((bd->totalCRC << 1) | (bd->totalCRC >> 31))
+		^ bw->dataCRC;
 
-		// if this block had a crc error, force file level crc error.
-		if (bw->dataCRC != bw->headerCRC) {
-			bd->totalCRC = bw->headerCRC+1;
+	return 0;
+}
 
-			return RETVAL_LAST_BLOCK;
-		}
-dataus_interruptus:
-		bw->writeCount = count;
-		if (len) {
-			gotcount += bd->outbufPos;
-			memcpy(outbuf, bd->outbuf, len);
-
-			// If we got enough data, checkpoint loop state and return
-			if ((len-=bd->outbufPos)<1) {
-				bd->outbufPos -= len;
-				if (bd->outbufPos)
-					memmove(bd->outbuf, bd->outbuf+len, bd->outbufPos);
-				bw->writePos = pos;
-				bw->writeCurrent = current;
-				bw->writeRun = run;
-
-				return gotcount;
-			}
-		}
-	}
+// Allocate the per-block buffers: dbuf and lf entries, plus the output text.
+static void alloc_dbuf(struct bunzip_data *bd, unsigned dbufSize)
+{
+	struct bwdata *bw = &bd->bwdata;
+
+	bd->dbufSize = dbufSize;
+	bw->dbuf = xmalloc(dbufSize * (2*sizeof(int)+1));
+	bw->lf = bw->dbuf + dbufSize;
+	bw->text = (unsigned char *)(bw->lf + dbufSize);
 }
 
-// Allocate the structure, read file header.  If !len, src_fd contains
-// filehandle to read from.  Else inbuf contains data.
-int start_bunzip(struct bunzip_data **bdp, int src_fd, char *inbuf, int len)
+// Allocate a bunzip_data with room for a dbuf of dbufSize entries.  If
+// src_fd is -1 the caller points inbuf at the data.
+static struct bunzip_data *alloc_bunzip(int src_fd, unsigned dbufSize)
 {
 	struct bunzip_data *bd;
-	unsigned int i;
-
-	// Figure out how much data to allocate.
-	i = sizeof(struct bunzip_data);
-	if (!len) i += IOBUF_SIZE;
+	int i, j;
 
 	// Allocate bunzip_data.  Most fields initialize to zero.
-	bd = *bdp = xzalloc(i);
-	if (len) {
-		bd->inbuf = inbuf;
-		bd->inbufCount = len;
-		bd->in_fd = -1;
-	} else {
-		bd->inbuf = (char *)(bd+1);
-		bd->in_fd = src_fd;
-	}
+	bd = xzalloc(sizeof(struct bunzip_data) + (src_fd==-1 ? 0 : IOBUF_SIZE));
+	bd->in_fd = src_fd;
+	if (src_fd != -1) bd->inbuf = (char *)(bd+1);
+	crc_init(bd->crc32Table[0], 0);
+	for (i=1; i<8; i++) for (j=0; j<256; j++)
+		bd->crc32Table[i][j] = (bd->crc32Table[i-1][j] << 8)
+			^ bd->crc32Table[0][bd->crc32Table[i-1][j] >> 24];
+	if (dbufSize) alloc_dbuf(bd, dbufSize);
+
+	return bd;
+}
 
-	crc_init(bd->crc32Table, 0);
+static void free_bunzip(struct bunzip_data *bd)
+{
+	free(bd->bwdata.dbuf);
+	free(bd->outmem);
+	free(bd);
+}
+
+// Allocate the structure, read file header.
+static int start_bunzip(struct bunzip_data **bdp, int src_fd)
+{
+	struct bunzip_data *bd;
+	unsigned int i;
+
+	bd = *bdp = alloc_bunzip(src_fd, 0);
 
 	// Ensure that file starts with "BZh".
     for (i=0;i<3;i++)
@@ -619,27 +683,271 @@ int start_bunzip(struct bunzip_data **bdp, int src_fd, char *inbuf, int len)
 	// uncompressed data.  Allocate intermediate buffer for block.
 	i = get_bits(bd, 8);
 	if (i<'1' || i>'9') return RETVAL_NOT_BZIP_DATA;
-	bd->dbufSize = 100000*(i-'0')*THREADS;
-	for (i=0; i<THREADS; i++)
-		bd->bwdata[i].dbuf = xmalloc(bd->dbufSize * sizeof(int));
+	alloc_dbuf(bd, 100000*(i-'0'));
 
 	return 0;
 }
 
-// Example usage: decompress src_fd to dst_fd.  (Stops at end of bzip data,
-// not end of file.)
-void bunzipStream(int src_fd, int dst_fd)
+// Parallel decoder.  Compressed blocks aren't byte aligned and don't record
+// their length, but each starts with the 48 bit magic number 0x314159265359
+// (the stream ends with 0x177245385090).  So read a batch of input, split it
+// at each magic number we find, decode the pieces on thread_loop() workers,
+// and write the results out in order.  Each worker reads past the end of its
+// piece if it has to, and records where its block really ended: a piece
+// starting before that was a chance match inside compressed data, so it's
+// discarded.  A block that ran off the end of what we've read gets decoded
+// again next batch with more input.
+
+struct bunzip_piece {
+	long start, end;      // bit offsets into bp->buf
+	long endbit;          // where this block's data really ended
+	char *out;            // decompressed data
+	long outlen;
+	unsigned dataCRC;
+	int rc, overrun;
+};
+
+struct bunzip_par {
+	pthread_mutex_t lock;
+	struct bunzip_data **free;   // per-thread decoder state not in use
+	int nfree, out_fd, rc;
+	char *buf;
+	long len, size;
+	unsigned totalCRC;
+	struct bunzip_piece *pieces;
+	long expect, resume;  // end of last good block, block to redo
+};
+
+// Find the first magic number starting at or after bit offset "from" that
+// lies entirely within the first len bytes of buf.  Returns bit offset or -1,
+// and sets *eos if it's the end of stream marker.
+static long find_bunzip_magic(char *buf, long len, long from, int *eos)
 {
+	unsigned long long reg = 0, mask = (1ULL<<48)-1, m;
+	long b, start = from>>3;
+	int k;
+
+	for (b = start; b<len; b++) {
+		reg = (reg<<8) | (unsigned char)buf[b];
+		if ((b-start+1)*8 < 48) continue;
+		for (k=7; k>=0; k--) {
+			long off = (b+1)*8-48-k;
+
+			if (off<from || (b-start+1)*8 < 48+k) continue;
+			m = (reg>>k) & mask;
+			if (m == BUNZIP_MAGIC || m == BUNZIP_EOS) {
+				*eos = m == BUNZIP_EOS;
+				return off;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static void bunzip_piece_work(void *arg, long i)
+{
+	struct bunzip_par *bp = arg;
+	struct bunzip_piece *piece = bp->pieces+i;
 	struct bunzip_data *bd;
-	int i, j;
+	int rc;
+
+	pthread_mutex_lock(&bp->lock);
+	bd = bp->free[--bp->nfree];
+	pthread_mutex_unlock(&bp->lock);
+
+	// Read from memory, starting at this piece's magic number.
+	bd->inbuf = bp->buf + (piece->start>>3);
+	bd->inbufCount = bp->len - (piece->start>>3);
+	bd->inbufPos = bd->inbufBitCount = bd->overrun = 0;
+	get_bits(bd, piece->start&7);
+
+	rc = read_block_header(bd, &bd->bwdata);
+	if (!rc) rc = read_huffman_data(bd, &bd->bwdata);
+	piece->endbit = (piece->start&~7L) + bunzip_bitpos(bd);
+	if (!(piece->overrun = bunzip_overran(bd)) && !rc) {
+		burrows_wheeler_prep(bd, &bd->bwdata);
+		bd->outmemLen = 0;
+		rc = write_bunzip_data(bd, &bd->bwdata, -1);
+		piece->dataCRC = bd->bwdata.dataCRC;
+		piece->out = bd->outmem;
+		piece->outlen = bd->outmemLen;
+		bd->outmem = 0;
+		bd->outmemSize = 0;
+	}
+	if (rc == RETVAL_LAST_BLOCK) rc = RETVAL_DATA_ERROR;
+	piece->rc = rc;
+	bd->bwdata.writeCount = 0;
 
-	if (!(i = start_bunzip(&bd,src_fd,0,0))) {
-		i = write_bunzip_data(bd,bd->bwdata,dst_fd,0,0);
-		if (i==RETVAL_LAST_BLOCK && bd->bwdata[0].headerCRC==bd->totalCRC)
-			i = 0;
+	pthread_mutex_lock(&bp->lock);
+	bp->free[bp->nfree++] = bd;
+	pthread_mutex_unlock(&bp->lock);
+}
+
+// Called in order for each piece: write out the real blocks.
+static void bunzip_piece_done(void *arg, long i)
+{
+	struct bunzip_par *bp = arg;
+	struct bunzip_piece *piece = bp->pieces+i;
+
+	if (bp->rc || bp->resume != -1 || piece->start < bp->expect) ;
+	else if (piece->start > bp->expect) bp->rc = RETVAL_DATA_ERROR;
+	else if (piece->overrun) bp->resume = piece->start;
+	else if (piece->rc) bp->rc = piece->rc;
+	else {
+		xwrite(bp->out_fd, piece->out, piece->outlen);
+		bp->totalCRC = ((bp->totalCRC << 1) | (bp->totalCRC >> 31))
+			^ piece->dataCRC;
+		bp->expect = piece->endbit;
 	}
-	flush_bunzip_outbuf(bd,dst_fd);
-	for (j=0; j<THREADS; j++) free(bd->bwdata[j].dbuf);
-	free(bd);
+	free(piece->out);
+	piece->out = 0;
+}
+
+// Read more input into bp->buf, returning 0 at EOF.
+static int bunzip_fill(struct bunzip_par *bp, int fd)
+{
+	long len;
+
+	if (bp->len == bp->size) bp->buf = xrealloc(bp->buf, bp->size *= 2);
+	len = read(fd, bp->buf+bp->len, bp->size-bp->len);
+	if (len<1) return 0;
+	bp->len += len;
+
+	return 1;
+}
+
+// Decompress the rest of the stream after the header start_bunzip() read.
+static int bunzip_parallel(struct bunzip_data *bd, int dst_fd, int threads)
+{
+	struct bunzip_par bp;
+	unsigned long long magic;
+	long npieces, pos = 0, i;
+	int eos, rc;
+
+	memset(&bp, 0, sizeof(bp));
+	pthread_mutex_init(&bp.lock, NULL);
+	bp.out_fd = dst_fd;
+	bp.free = xmalloc(threads*sizeof(struct bunzip_data *));
+	for (i=0; i<threads; i++) bp.free[i] = alloc_bunzip(-1, bd->dbufSize);
+	bp.nfree = threads;
+	npieces = 4*threads;
+	bp.pieces = xmalloc(npieces*sizeof(struct bunzip_piece));
+
+	// Start with whatever start_bunzip() already read, including the whole
+	// bytes still sitting in the bit buffer.
+	bp.buf = xmalloc(bp.size = 1<<20);
+	for (i = bd->inbufBitCount>>3; i--;)
+		bp.buf[bp.len++] = bd->inbufBits >> (8*i);
+	memcpy(bp.buf+bp.len, bd->inbuf + bd->inbufPos,
+		bd->inbufCount - bd->inbufPos);
+	bp.len += bd->inbufCount - bd->inbufPos;
+	bp.resume = -1;
+
+	for (;;) {
+		long n = 0, start = pos, from = pos+48;
+
+		// A block that ran off the end of our data last time needs more.
+		if (bp.resume != -1 && !bunzip_fill(&bp, bd->in_fd)) {
+			rc = RETVAL_DATA_ERROR;
+			goto done;
+		}
+
+		// Is the next thing another block or the end of the stream?
+		while (bp.len < (pos>>3)+7) {
+			if (!bunzip_fill(&bp, bd->in_fd)) {
+				rc = RETVAL_DATA_ERROR;
+				goto done;
+			}
+		}
+		for (magic = i = 0; i<7; i++)
+			magic = (magic<<8) | (unsigned char)bp.buf[(pos>>3)+i];
+		magic = (magic >> (8-(pos&7))) & ((1ULL<<48)-1);
+		if (magic == BUNZIP_EOS) break;
+		if (magic != BUNZIP_MAGIC) {
+			rc = RETVAL_NOT_BZIP_DATA;
+			goto done;
+		}
+
+		// Split off up to npieces blocks, reading more input as needed.
+		while (n < npieces) {
+			long m = find_bunzip_magic(bp.buf, bp.len, from, &eos);
+
+			if (m == -1) {
+				long old = bp.len*8-47;
+
+				if (bunzip_fill(&bp, bd->in_fd)) {
+					if (from < old) from = old;
+					continue;
+				}
+				// Truncated input: let the decoder complain about it.
+				if (!n) {
+					bp.pieces[n].start = start;
+					bp.pieces[n++].end = bp.len*8;
+				}
+				break;
+			}
+			bp.pieces[n].start = start;
+			bp.pieces[n++].end = m;
+			start = m;
+			from = m+48;
+			if (eos) break;
+		}
+		for (i=0; i<n; i++) bp.pieces[i].out = 0;
+
+		// Decode this batch.
+		bp.expect = pos;
+		bp.resume = -1;
+		thread_loop(threads, n, &bp, bunzip_piece_work, bunzip_piece_done);
+		if ((rc = bp.rc)) goto done;
+		pos = bp.resume != -1 ? bp.resume : bp.expect;
+
+		// Discard input we're done with.
+		if (pos>>3) {
+			memmove(bp.buf, bp.buf+(pos>>3), bp.len -= pos>>3);
+			pos &= 7;
+		}
+	}
+
+	// Check the end of stream marker and the CRC of the whole stream.
+	bd->inbuf = bp.buf + (pos>>3);
+	bd->inbufCount = bp.len - (pos>>3);
+	bd->inbufPos = bd->inbufBitCount = bd->overrun = 0;
+	bd->in_fd = -1;
+	get_bits(bd, pos&7);
+	rc = read_block_header(bd, &bd->bwdata);
+	if (rc == RETVAL_LAST_BLOCK && !bunzip_overran(bd)
+		&& bd->bwdata.headerCRC == bp.totalCRC) rc = 0;
+	else rc = RETVAL_DATA_ERROR;
+
+done:
+	for (i=0; i<bp.nfree; i++) free_bunzip(bp.free[i]);
+	free(bp.free);
+	free(bp.pieces);
+	free(bp.buf);
+	pthread_mutex_destroy(&bp.lock);
+
+	return rc;
+}
+
+// Example usage: decompress src_fd to dst_fd using up to "threads" threads.
+// (Stops at end of bzip data, not end of file.)
+void bunzipStream(int src_fd, int dst_fd, int threads)
+{
+	struct bunzip_data *bd;
+	int i;
+
+	if (!(i = start_bunzip(&bd,src_fd))) {
+		if (CFG_TOYBOX_THREADS && threads>1)
+			i = bunzip_parallel(bd, dst_fd, threads);
+		else {
+			while (!(i = read_bunzip_data(bd)))
+				if ((i = write_bunzip_data(bd, &bd->bwdata, dst_fd))) break;
+			if (i==RETVAL_LAST_BLOCK && bd->bwdata.headerCRC==bd->totalCRC)
+				i = 0;
+			else if (i==RETVAL_LAST_BLOCK) i = RETVAL_DATA_ERROR;
+		}
+	}
+	free_bunzip(bd);
 	if (i) error_exit(bunzip_errors[-i]);
 }
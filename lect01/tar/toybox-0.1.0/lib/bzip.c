@@ -0,0 +1,501 @@
+/* vi: set sw=4 ts=4: */
+/* bzip.c - bzip2 compression, producing what bunzip.c reads.
+
+   Each block of input is run length encoded (runs of 4 to 255 identical
+   bytes become 4 bytes and a count), burrows-wheeler transformed, move to
+   front encoded with runs of zeroes turned into RUNA/RUNB, and huffman coded
+   with up to MAX_GROUPS tables, picking the cheapest table for every
+   GROUP_SIZE symbols.  Blocks are independent, so several get compressed at
+   once and written out in order.
+*/
+
+#include "toys.h"
+
+// The original bzip2 never produces codes longer than this, so other
+// decoders may not cope with MAX_HUFCODE_BITS.
+#define MAX_CODE_LEN 17
+
+#define INBUF_SIZE 65536
+
+// Bits written big endian into a growing buffer.
+struct bitbuf {
+	unsigned char *buf;
+	long len, size;
+	unsigned long long bits;
+	int count;
+};
+
+struct bzip_block {
+	unsigned char *data;    // after initial run length encoding
+	int len;
+	unsigned int crc;
+	struct bitbuf out;
+};
+
+struct bzip_data {
+	struct bzip_block *blocks;
+	struct bitbuf out;
+	unsigned int crc32Table[256], totalCRC;
+	int out_fd, max, ch, run;
+};
+
+// Write the bottom n bits of v (n <= 32).
+static void put_bits(struct bitbuf *bb, int n, unsigned int v)
+{
+	if (bb->len+8 > bb->size)
+		bb->buf = xrealloc(bb->buf, bb->size = 2*bb->size + INBUF_SIZE);
+	bb->bits = (bb->bits << n) | v;
+	bb->count += n;
+	while (bb->count >= 8) {
+		bb->count -= 8;
+		bb->buf[bb->len++] = bb->bits >> bb->count;
+	}
+}
+
+/* Suffix array by induced sorting (SA-IS: Nong, Zhang and Chan, "Two
+ * efficient algorithms for linear time suffix array construction").  Sorts
+ * the n suffixes of T into SA in linear time.  T is bytes (cs 1) at the top
+ * level and ints when we recurse, and the end of T acts as a unique smallest
+ * character.  Suffixes are S type if smaller than the suffix after them,
+ * else L type, and the leftmost S of a run of them is an LMS suffix.  Sort
+ * the substrings starting at each LMS suffix, name them, recursively sort the
+ * string of names to get the LMS suffixes in order, then induce everything
+ * else from those.
+ */
+
+#define CHR(i) (cs==1 ? ((unsigned char *)T)[i] : ((int *)T)[i])
+#define ISS(i) (t[(i)>>3] & (1<<((i)&7)))
+#define ISLMS(i) ((i)>0 && ISS(i) && !ISS((i)-1))
+
+// Find the start (or end) of each character's bucket in SA.
+static void get_buckets(void *T, int *bkt, int n, int K, int cs, int end)
+{
+	int i, sum = 0;
+
+	memset(bkt, 0, K*sizeof(int));
+	for (i=0; i<n; i++) bkt[CHR(i)]++;
+	for (i=0; i<K; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum-bkt[i];
+	}
+}
+
+// Given LMS suffixes at the ends of their buckets, fill in the L suffixes
+// scanning left to right, then the S suffixes scanning right to left.
+static void induce(void *T, int *SA, unsigned char *t, int *bkt, int n, int K,
+	int cs)
+{
+	int i, j;
+
+	// The last suffix is L type, and sorts right after the imaginary end.
+	get_buckets(T, bkt, n, K, cs, 0);
+	SA[bkt[CHR(n-1)]++] = n-1;
+	for (i=0; i<n; i++)
+		if ((j = SA[i]-1) >= 0 && !ISS(j)) SA[bkt[CHR(j)]++] = j;
+	get_buckets(T, bkt, n, K, cs, 1);
+	for (i=n; i--;)
+		if ((j = SA[i]-1) >= 0 && ISS(j)) SA[--bkt[CHR(j)]] = j;
+}
+
+static void sais(void *T, int *SA, int n, int K, int cs)
+{
+	unsigned char *t = xzalloc(n/8+1);
+	int *bkt = xmalloc(K*sizeof(int)), *s1, i, j, n1, name, prev;
+
+	// Classify suffixes.
+	for (i=n-1; i--;)
+		if (CHR(i) < CHR(i+1) || (CHR(i) == CHR(i+1) && ISS(i+1)))
+			t[i>>3] |= 1<<(i&7);
+
+	// Sort the LMS substrings.
+	get_buckets(T, bkt, n, K, cs, 1);
+	for (i=0; i<n; i++) SA[i] = -1;
+	for (i=1; i<n; i++) if (ISLMS(i)) SA[--bkt[CHR(i)]] = i;
+	induce(T, SA, t, bkt, n, K, cs);
+
+	// Gather them at the start of SA and name them: equal substrings get
+	// the same name.  (No two LMS suffixes are adjacent, so pos/2 is unique.)
+	for (i=n1=0; i<n; i++) if (ISLMS(SA[i])) SA[n1++] = SA[i];
+	for (i=n1; i<n; i++) SA[i] = -1;
+	for (i=name=0, prev=-1; i<n1; i++) {
+		int pos = SA[i], d;
+
+		for (d=0; prev!=-1; d++) {
+			if (pos+d == n || prev+d == n || CHR(pos+d) != CHR(prev+d)
+				|| !ISS(pos+d) != !ISS(prev+d)) break;
+			if (d && (ISLMS(pos+d) || ISLMS(prev+d))) {
+				d = -1;
+				break;
+			}
+		}
+		if (d != -1) {
+			name++;
+			prev = pos;
+		}
+		SA[n1+(pos>>1)] = name-1;
+	}
+	for (i=j=n; i-->n1;) if (SA[i] >= 0) SA[--j] = SA[i];
+
+	// Sort the string of names: recurse if there are duplicates.
+	s1 = SA+n-n1;
+	if (name < n1) sais(s1, SA, n1, name, sizeof(int));
+	else for (i=0; i<n1; i++) SA[s1[i]] = i;
+
+	// Put the sorted LMS suffixes at the ends of their buckets, and induce.
+	get_buckets(T, bkt, n, K, cs, 1);
+	for (i=1, j=0; i<n; i++) if (ISLMS(i)) s1[j++] = i;
+	for (i=0; i<n1; i++) SA[i] = s1[SA[i]];
+	for (i=n1; i<n; i++) SA[i] = -1;
+	for (i=n1; i--;) {
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[CHR(j)]] = j;
+	}
+	induce(T, SA, t, bkt, n, K, cs);
+
+	free(t);
+	free(bkt);
+}
+
+// Find the lexicographically smallest rotation of data.
+static int min_rotation(unsigned char *data, int n)
+{
+	int i = 0, j = 1, k = 0;
+
+	while (i<n && j<n && k<n) {
+		int a = data[i+k < n ? i+k : i+k-n], b = data[j+k < n ? j+k : j+k-n];
+
+		if (a == b) k++;
+		else {
+			if (a > b) i += k+1;
+			else j += k+1;
+			if (i == j) j++;
+			k = 0;
+		}
+	}
+
+	return i<j ? i : j;
+}
+
+// Build huffman code lengths from symbol frequencies, no longer than
+// MAX_CODE_LEN.  Every symbol gets a code.  If the tree comes out too deep,
+// flatten the frequencies and try again.
+static void make_lengths(unsigned char *len, int *freq, int alphaSize)
+{
+	int weight[2*MAX_SYMBOLS], parent[2*MAX_SYMBOLS], node[MAX_SYMBOLS];
+	int i, j, a, b, n, nodes, maxlen;
+
+	for (i=0; i<alphaSize; i++) weight[i] = (freq[i] ? freq[i] : 1) << 8;
+	for (;;) {
+
+		// Merge the two lightest nodes until one's left.  The bottom 8 bits
+		// of each weight are the depth of that subtree, so ties go to the
+		// shallower one.
+		for (i=0; i<alphaSize; i++) node[i] = i;
+		for (n = nodes = alphaSize; n>1; nodes++) {
+			a = 0;
+			b = 1;
+			if (weight[node[b]] < weight[node[a]]) a = 1, b = 0;
+			for (i=2; i<n; i++) {
+				if (weight[node[i]] < weight[node[a]]) b = a, a = i;
+				else if (weight[node[i]] < weight[node[b]]) b = i;
+			}
+			parent[node[a]] = parent[node[b]] = nodes;
+			weight[nodes] = ((weight[node[a]]&~255) + (weight[node[b]]&~255))
+				| (1 + ((weight[node[a]]&255) > (weight[node[b]]&255)
+					? weight[node[a]]&255 : weight[node[b]]&255));
+			node[a] = nodes;
+			node[b] = node[--n];
+		}
+
+		// Length of each code is its leaf's depth.
+		for (i=maxlen=0; i<alphaSize; i++) {
+			for (j=i, len[i]=0; j != nodes-1; j = parent[j]) len[i]++;
+			if (len[i] > maxlen) maxlen = len[i];
+		}
+		if (maxlen <= MAX_CODE_LEN) break;
+		for (i=0; i<alphaSize; i++)
+			weight[i] = (1 + (weight[i]>>9)) << 8;
+	}
+}
+
+// Compress one block into b->out.  Runs on thread_loop() workers.
+static void bzip_block_work(void *arg, long which)
+{
+	struct bzip_data *bd = arg;
+	struct bzip_block *b = bd->blocks+which;
+	struct bitbuf *out = &b->out;
+	unsigned char *data = b->data, *last, *selectors, used[256],
+		unseqToSeq[256], yy[256], len[MAX_GROUPS][MAX_SYMBOLS];
+	unsigned short *mtfv;
+	unsigned int code[MAX_GROUPS][MAX_SYMBOLS], crc = 0xffffffff;
+	int i, j, t, n = b->len, *sa, rot, origPtr = 0, run = 0, previous = -1,
+		nInUse, alphaSize, nMTF, zPend, nGroups, nSelectors, gs, ge,
+		mtfFreq[MAX_SYMBOLS];
+
+	// CRC is of the data before the initial run length encoding.
+	for (i=0; i<n; i++) {
+		int current = data[i], copies = 1;
+
+		if (run == 4) {
+			copies = current;
+			current = previous;
+			previous = -1;
+			run = 0;
+		} else {
+			if (current != previous) run = 0;
+			previous = current;
+			run++;
+		}
+		while (copies--)
+			crc = (crc << 8) ^ bd->crc32Table[(crc >> 24) ^ current];
+	}
+	b->crc = ~crc;
+
+	// Burrows-wheeler transform sorts rotations of the block.  Start from
+	// the smallest rotation (making it a Lyndon word, or a repeat of one),
+	// and its rotations sort the same as its suffixes: a suffix that's a
+	// prefix of another sorts first either way, because what follows it
+	// (the whole word) is smaller than any suffix.  (Identical rotations of
+	// a repeating block produce the same output in either order.)
+	rot = min_rotation(data, n);
+	last = xmalloc(n);
+	memcpy(last, data+rot, n-rot);
+	memcpy(last+n-rot, data, rot);
+	sa = xmalloc(n*sizeof(int));
+	sais(last, sa, n, 256, 1);
+	for (i=0; i<n; i++) {
+		if ((j = sa[i]+rot) >= n) j -= n;
+		if (!j) origPtr = i;
+		last[i] = data[j ? j-1 : n-1];
+	}
+	free(sa);
+
+	// Move to front encoding, of the byte values actually used.  Runs of
+	// zeroes become RUNA/RUNB digits in bijective base 2, the others move
+	// up one to make room, and a last symbol marks the end of the block.
+	memset(used, 0, 256);
+	for (i=0; i<n; i++) used[data[i]] = 1;
+	for (i=nInUse=0; i<256; i++) if (used[i]) unseqToSeq[i] = nInUse++;
+	alphaSize = nInUse+2;
+	for (i=0; i<nInUse; i++) yy[i] = i;
+	memset(mtfFreq, 0, sizeof(mtfFreq));
+	mtfv = xmalloc((n+1)*sizeof(short));
+	for (i=nMTF=zPend=0; i<=n; i++) {
+		int ll = i<n ? unseqToSeq[last[i]] : -1;
+
+		if (ll == yy[0]) {
+			zPend++;
+			continue;
+		}
+		if (zPend) {
+			for (zPend--;; zPend = (zPend-2)/2) {
+				mtfFreq[mtfv[nMTF++] = (zPend&1) ? SYMBOL_RUNB : SYMBOL_RUNA]++;
+				if (zPend<2) break;
+			}
+			zPend = 0;
+		}
+		if (ll == -1) break;
+		for (j=1; yy[j] != ll; j++);
+		memmove(yy+1, yy, j);
+		yy[0] = ll;
+		mtfFreq[mtfv[nMTF++] = j+1]++;
+	}
+	mtfFreq[mtfv[nMTF++] = nInUse+1]++;
+	free(last);
+
+	// Start with tables that each cover a range of symbols of about equal
+	// total frequency (the way bzip2 does), then repeatedly pick the cheapest
+	// table for each group of symbols and rebuild the tables to fit.
+	nGroups = nMTF<200 ? 2 : nMTF<600 ? 3 : nMTF<1200 ? 4 : nMTF<2400 ? 5 : 6;
+	for (t = nGroups, gs = 0, j = nMTF; t; t--) {
+		int target = j/t, sum = 0;
+
+		for (ge = gs-1; sum < target && ge < alphaSize-1;) sum += mtfFreq[++ge];
+		if (ge > gs && t != nGroups && t != 1 && (nGroups-t)%2) {
+			sum -= mtfFreq[ge--];
+		}
+		for (i=0; i<alphaSize; i++) len[t-1][i] = (i>=gs && i<=ge) ? 0 : 15;
+		gs = ge+1;
+		j -= sum;
+	}
+	nSelectors = (nMTF+GROUP_SIZE-1)/GROUP_SIZE;
+	selectors = xmalloc(nSelectors);
+	for (i=0; i<4; i++) {
+		int rfreq[MAX_GROUPS][MAX_SYMBOLS];
+
+		memset(rfreq, 0, sizeof(rfreq));
+		for (gs=0; gs<nMTF; gs+=GROUP_SIZE) {
+			int cost[MAX_GROUPS], best = 0;
+
+			ge = gs+GROUP_SIZE < nMTF ? gs+GROUP_SIZE : nMTF;
+			for (t=0; t<nGroups; t++) {
+				for (cost[t]=0, j=gs; j<ge; j++) cost[t] += len[t][mtfv[j]];
+				if (cost[t] < cost[best]) best = t;
+			}
+			selectors[gs/GROUP_SIZE] = best;
+			for (j=gs; j<ge; j++) rfreq[best][mtfv[j]]++;
+		}
+		for (t=0; t<nGroups; t++) make_lengths(len[t], rfreq[t], alphaSize);
+	}
+
+	// Canonical codes, assigned in order of length then symbol, which is
+	// the order bunzip.c's permute[] expects.
+	for (t=0; t<nGroups; t++) {
+		unsigned int vec = 0;
+
+		for (i=1; i<=MAX_CODE_LEN; i++, vec <<= 1)
+			for (j=0; j<alphaSize; j++) if (len[t][j] == i) code[t][j] = vec++;
+	}
+
+	// Block header: see read_block_header() in bunzip.c.
+	out->len = out->count = 0;
+	put_bits(out, 24, BUNZIP_MAGIC>>24);
+	put_bits(out, 24, BUNZIP_MAGIC&0xffffff);
+	put_bits(out, 32, b->crc);
+	put_bits(out, 1, 0);
+	put_bits(out, 24, origPtr);
+	for (i=j=0; i<16; i++) {
+		for (t=0; t<16; t++) if (used[16*i+t]) j |= 0x8000>>i;
+	}
+	put_bits(out, 16, j);
+	for (i=0; i<16; i++) {
+		if (!(j & (0x8000>>i))) continue;
+		for (gs=t=0; t<16; t++) if (used[16*i+t]) gs |= 0x8000>>t;
+		put_bits(out, 16, gs);
+	}
+	put_bits(out, 3, nGroups);
+	put_bits(out, 15, nSelectors);
+	for (i=0; i<nGroups; i++) yy[i] = i;
+	for (i=0; i<nSelectors; i++) {
+		for (j=0; yy[j] != selectors[i]; j++);
+		memmove(yy+1, yy, j);
+		yy[0] = selectors[i];
+		put_bits(out, j+1, (1<<(j+1))-2);
+	}
+	for (t=0; t<nGroups; t++) {
+		int curr = len[t][0];
+
+		put_bits(out, 5, curr);
+		for (i=0; i<alphaSize; i++) {
+			for (; curr < len[t][i]; curr++) put_bits(out, 2, 2);
+			for (; curr > len[t][i]; curr--) put_bits(out, 2, 3);
+			put_bits(out, 1, 0);
+		}
+	}
+
+	// And the data.
+	for (i=0; i<nMTF; i++) {
+		t = selectors[i/GROUP_SIZE];
+		put_bits(out, len[t][mtfv[i]], code[t][mtfv[i]]);
+	}
+
+	free(selectors);
+	free(mtfv);
+}
+
+// Append a finished block to the stream and write out the whole bytes.
+static void bzip_block_done(void *arg, long which)
+{
+	struct bzip_data *bd = arg;
+	struct bzip_block *b = bd->blocks+which;
+	long i;
+
+	bd->totalCRC = ((bd->totalCRC << 1) | (bd->totalCRC >> 31)) ^ b->crc;
+	for (i=0; i<b->out.len; i++) put_bits(&bd->out, 8, b->out.buf[i]);
+	if (b->out.count)
+		put_bits(&bd->out, b->out.count, b->out.bits & ((1<<b->out.count)-1));
+	xwrite(bd->out_fd, bd->out.buf, bd->out.len);
+	bd->out.len = 0;
+}
+
+// Do the initial run length encoding of a run we've finished counting.
+static void bzip_flush_run(struct bzip_data *bd, struct bzip_block *b)
+{
+	int i;
+
+	for (i=0; i<bd->run && i<4; i++) b->data[b->len++] = bd->ch;
+	if (bd->run >= 4) b->data[b->len++] = bd->run-4;
+	bd->run = 0;
+}
+
+// Add input to a block.  Returns how much was used, which is less than len
+// if the block filled up.
+static long bzip_fill(struct bzip_data *bd, struct bzip_block *b,
+	unsigned char *in, long len)
+{
+	long i;
+
+	for (i=0; i<len; i++) {
+		if (bd->run && in[i] == bd->ch && bd->run < 255) {
+			bd->run++;
+			continue;
+		}
+		bzip_flush_run(bd, b);
+		if (b->len >= bd->max) break;
+		bd->ch = in[i];
+		bd->run = 1;
+	}
+
+	return i;
+}
+
+// Compress src_fd to dst_fd with blocks of level*100k, using up to "threads"
+// threads.
+void bzipStream(int src_fd, int dst_fd, int level, int threads)
+{
+	struct bzip_data bd;
+	unsigned char *in = xmalloc(INBUF_SIZE);
+	long inlen = 0, inpos = 0, nblocks, i, n;
+	int eof = 0;
+
+	memset(&bd, 0, sizeof(bd));
+	crc_init(bd.crc32Table, 0);
+	bd.out_fd = dst_fd;
+	bd.max = 100000*level - 19;
+	nblocks = CFG_TOYBOX_THREADS && threads > 1 ? 2*threads : 1;
+	bd.blocks = xzalloc(nblocks*sizeof(struct bzip_block));
+	for (i=0; i<nblocks; i++) bd.blocks[i].data = xmalloc(bd.max+5);
+
+	put_bits(&bd.out, 24, 0x425a68);  // "BZh"
+	put_bits(&bd.out, 8, '0'+level);
+
+	// Read a batch of blocks, compress them all at once, repeat.
+	while (!eof) {
+		for (n=0; n<nblocks && !eof; n++) {
+			struct bzip_block *b = bd.blocks+n;
+
+			for (b->len = 0;;) {
+				if (inpos == inlen) {
+					inpos = 0;
+					if (0 > (inlen = read(src_fd, in, INBUF_SIZE)))
+						perror_exit("read");
+					if (!inlen) {
+						bzip_flush_run(&bd, b);
+						eof++;
+						break;
+					}
+				}
+				inpos += bzip_fill(&bd, b, in+inpos, inlen-inpos);
+				if (inpos < inlen) break;
+			}
+			if (!b->len) break;
+		}
+		thread_loop(threads, n, &bd, bzip_block_work, bzip_block_done);
+	}
+
+	// End of stream marker, CRC of the whole stream, pad to a byte.
+	put_bits(&bd.out, 24, BUNZIP_EOS>>24);
+	put_bits(&bd.out, 24, BUNZIP_EOS&0xffffff);
+	put_bits(&bd.out, 32, bd.totalCRC);
+	if (bd.out.count) put_bits(&bd.out, 8-bd.out.count, 0);
+	xwrite(dst_fd, bd.out.buf, bd.out.len);
+
+	for (i=0; i<nblocks; i++) {
+		free(bd.blocks[i].data);
+		free(bd.blocks[i].out.buf);
+	}
+	free(bd.blocks);
+	free(bd.out.buf);
+	free(in);
+}
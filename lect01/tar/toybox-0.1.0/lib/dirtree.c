@@ -6,11 +6,46 @@
 
 #include "toys.h"
 
-// NOTE: This uses toybuf.  Possibly it shouldn't do that.
+// NOTE: This assumes path buffers are the size of toybuf.
+
+// Allocate a node from an arena, zeroed and with room for stat info (unless
+// DIRTREE_NOSTAT).
+
+struct dirtree *dirtree_new(struct dirtree_arena *arena, char *name, int flags)
+{
+	struct dirtree *dt = arena_alloc(&arena->nodes, sizeof(struct dirtree));
+	int len = strlen(name)+1;
+	char *data;
+
+	memset(dt, 0, sizeof(struct dirtree));
+	if (flags & DIRTREE_NOSTAT) data = arena_alloc(&arena->data, len);
+	else {
+		data = arena_alloc(&arena->data, sizeof(struct stat)+len);
+		memset(dt->st = (struct stat *)data, 0, sizeof(struct stat));
+		data += sizeof(struct stat);
+	}
+	dt->name = memcpy(data, name, len);
+
+	return dt;
+}
+
+// Free a tree (everything allocated from its arena).
+void dirtree_free(struct dirtree_arena *arena)
+{
+	arena_free(&arena->nodes, 0);
+	arena_free(&arena->data, 0);
+}
+
+// Free a node, and anything allocated after it.
+static void dirtree_release(struct dirtree_arena *arena, struct dirtree *dt)
+{
+	arena_free(&arena->data, dt->st ? (void *)dt->st : dt->name);
+	arena_free(&arena->nodes, dt);
+}
 
 // Create a dirtree node from a path.
 
-struct dirtree *dirtree_add_node(char *path)
+struct dirtree *dirtree_add_node(struct dirtree_arena *arena, char *path)
 {
 	struct dirtree *dt;
 	char *name;
@@ -31,60 +66,452 @@ struct dirtree *dirtree_add_node(char *path)
 		break;
 	}
 
-   	dt = xzalloc(sizeof(struct dirtree)+strlen(name)+1);
-	if (lstat(path, &(dt->st))) {
+	dt = dirtree_new(arena, name, 0);
+	if (lstat(path, dt->st)) {
 		error_msg("Skipped '%s'",name);
-		free(dt);
+		dirtree_release(arena, dt);
 		return 0;
 	}
-	strcpy(dt->name, name);
+	dt->mode = dt->st->st_mode;
 
 	return dt;
 }
 
-// Given a directory (in a writeable PATH_MAX buffer), recursively read in a
-// directory tree.
+// One directory being read by dirtree_walk(), and where its entries go.
+struct dirtree_dir {
+	struct dirtree *dir, **tail;
+	int fd, len, pos, end;
+	char *buf;
+};
+
+// Entries returned by getdents64()
+struct dirtree_dent {
+	uint64_t ino;
+	int64_t off;
+	unsigned short reclen;
+	unsigned char type;
+	char name[];
+};
+
+#define DIRTREE_BUF 32768
+
+// Cut path back to len, if it got that far.
+static void dirtree_trim(char *path, int len)
+{
+	if (len < sizeof(toybuf)) path[len] = 0;
+}
+
+// Make a node for an entry of the open directory dirfd, or return NULL to
+// skip it.
+
+static struct dirtree *dirtree_entry(struct dirtree_arena *arena, int dirfd,
+	struct dirtree_dent *entry, int flags)
+{
+	struct dirtree *this;
+	struct stat st;
+
+	// Skip "." and ".."
+	if (entry->name[0]=='.') {
+		if (!entry->name[1]) return 0;
+		if (entry->name[1]=='.' && !entry->name[2]) return 0;
+	}
+
+	this = dirtree_new(arena, entry->name, flags);
+	if ((flags & DIRTREE_NOSTAT) && entry->type != DT_UNKNOWN)
+		this->mode = DTTOIF(entry->type);
+	else if (fstatat(dirfd, this->name, this->st ? this->st : &st,
+		AT_SYMLINK_NOFOLLOW))
+	{
+		error_msg("Skipped '%s'", this->name);
+		dirtree_release(arena, this);
+		return 0;
+	} else this->mode = this->st ? this->st->st_mode : st.st_mode;
+	this->dirfd = dirfd;
+
+	return this;
+}
+
+// Given a directory (in a writeable PATH_MAX buffer), read in a directory
+// tree.
+//
+// If callback==NULL, allocate tree of struct dirtree (from arena, if not NULL)
+// and return root of tree.  Otherwise call callback(node) on each hit, free
+// structures after use, and return NULL.  If callback returns nonzero,
+// don't descend into that directory.
 //
-// If callback==NULL, allocate tree of struct dirtree and
-// return root of tree.  Otherwise call callback(node) on each hit, free
-// structures after use, and return NULL.
+// This doesn't recurse: it keeps a stack of open directories and looks
+// up each entry relative to its directory's fd (also in node->dirfd during
+// the callback), so it neither resolves the whole path again for each
+// entry nor cares how long the path gets.  (Callbacks get the path, so
+// entries with paths that won't fit in the buffer are skipped.)  With
+// DIRTREE_NOSTAT, there's no node->st, only node->mode: skip the stat() when
+// the directory entry says what type it is.
 
-struct dirtree *dirtree_read(char *path, struct dirtree *parent,
-					int (*callback)(char *path, struct dirtree *node))
+struct dirtree *dirtree_walk(char *path, struct dirtree *parent,
+	struct dirtree_arena *arena, int flags,
+	int (*callback)(char *path, struct dirtree *node))
+{
+	struct dirtree *dtroot = NULL, *this;
+	struct dirtree_dir *stack, *dd;
+	struct dirtree_arena scratch;
+	int depth = 0, max = 16, fd;
+
+	if (-1 == (fd = open(path, O_RDONLY|O_DIRECTORY))) {
+		perror_msg("No %s", path);
+		return 0;
+	}
+
+	// Nodes handed to callbacks come and go in stack order, so they can
+	// share an arena that's freed back to each one when we're done with it.
+	// (And a tree with nowhere to go stays allocated until we exit.)
+	if (callback) {
+		memset(&scratch, 0, sizeof(scratch));
+		arena = &scratch;
+	} else if (!arena) arena = xzalloc(sizeof(struct dirtree_arena));
+	stack = xmalloc(max*sizeof(struct dirtree_dir));
+	stack->dir = parent;
+	stack->tail = &dtroot;
+	stack->fd = fd;
+	stack->len = strlen(path);
+	stack->pos = stack->end = 0;
+	stack->buf = xmalloc(DIRTREE_BUF);
+
+	while (depth >= 0) {
+		struct dirtree_dent *entry;
+		int norecurse = 0, len;
+
+		// Refill the buffer, and when the directory runs out go back up.
+		dd = stack+depth;
+		if (dd->pos >= dd->end) {
+			dd->pos = 0;
+			dd->end = syscall(SYS_getdents64, dd->fd, dd->buf, DIRTREE_BUF);
+			if (dd->end > 0) continue;
+			if (dd->end < 0) perror_msg("%s", path);
+			close(dd->fd);
+			free(dd->buf);
+			dirtree_trim(path, dd->len);
+			if (callback && depth) dirtree_release(arena, dd->dir);
+			depth--;
+			continue;
+		}
+		entry = (struct dirtree_dent *)(dd->buf+dd->pos);
+		dd->pos += entry->reclen;
+		if (!(this = dirtree_entry(arena, dd->fd, entry, flags))) continue;
+
+		len = strlen(this->name);
+		if (dd->len+len+2 > sizeof(toybuf)) {
+			if (callback) {
+				error_msg("Skipped '%s': path too long", this->name);
+				dirtree_release(arena, this);
+				continue;
+			}
+		} else {
+			path[dd->len] = '/';
+			strcpy(path+dd->len+1, this->name);
+		}
+		this->parent = dd->dir;
+		this->depth = dd->dir ? dd->dir->depth + 1 : 1;
+		if (callback) norecurse = callback(path, this);
+		else {
+			*(dd->tail) = this;
+			dd->tail = &(this->next);
+		}
+
+		// Descend into directories, freeing them once they're done.
+		if (!norecurse && S_ISDIR(this->mode)) {
+			fd = openat(dd->fd, this->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if (fd != -1) {
+				if (++depth == max)
+					stack = xrealloc(stack, (max *= 2)*sizeof(struct dirtree_dir));
+				dd = stack+depth;
+				dd->dir = this;
+				dd->tail = &(this->child);
+				dd->fd = fd;
+				dd->len = stack[depth-1].len + len + 1;
+				dd->pos = dd->end = 0;
+				dd->buf = xmalloc(DIRTREE_BUF);
+				continue;
+			}
+			perror_msg("No %s", path);
+		}
+		if (callback) dirtree_release(arena, this);
+		dirtree_trim(path, dd->len);
+	}
+	free(stack);
+	if (callback) dirtree_free(arena);
+
+	return dtroot;
+}
+
+// Shared state for dirtree_parallel()
+struct dirtree_pwalk {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	long pending;          // Directories queued or being read
+	long gen;              // Bumped whenever there's new work
+	int threads, idle, flags;
+	char *root;            // Path of the top directory
+	struct dirtree *top, *list;
+	struct dirtree_thread *th;
+	int (*callback)(char *path, struct dirtree *node);
+};
+
+// Each thread's deque of directories to read.  The owner works from the
+// tail (depth first, staying near what it just read), and idle threads
+// steal from the head (the oldest, so generally the biggest, subtrees).
+struct dirtree_thread {
+	struct dirtree_pwalk *pw;
+	pthread_mutex_t lock;
+	struct dirtree **deque;
+	long head, tail, size;
+	struct dirtree_arena arena;
+	char *buf, path[sizeof(toybuf)];
+};
+
+// Write the path of a directory being walked into buf, returning its length,
+// or -1 if it won't fit.
+static int dirtree_path(struct dirtree_pwalk *pw, struct dirtree *dir,
+	char *buf)
+{
+	int len;
+
+	if (dir == pw->top) return strlen(strcpy(buf, pw->root));
+	len = dirtree_path(pw, dir->parent, buf);
+	if (len < 0 || len+strlen(dir->name)+2 > sizeof(toybuf)) return -1;
+	buf[len++] = '/';
+
+	return len + strlen(strcpy(buf+len, dir->name));
+}
+
+// Open a directory whose path is too long, one level at a time.
+static int dirtree_openat(struct dirtree_pwalk *pw, struct dirtree *dir)
+{
+	int fd, dirfd;
+
+	if (dir == pw->top) return open(pw->root, O_RDONLY|O_DIRECTORY);
+	if (-1 == (dirfd = dirtree_openat(pw, dir->parent))) return -1;
+	fd = openat(dirfd, dir->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	close(dirfd);
+
+	return fd;
+}
+
+// Queue up directories to read.  They count as pending before anyone can
+// steal them, so pending can't hit zero while there's still work.
+static void dirtree_push(struct dirtree_thread *th, struct dirtree **dirs,
+	long count)
+{
+	struct dirtree_pwalk *pw = th->pw;
+
+	if (!count) return;
+	pthread_mutex_lock(&pw->lock);
+	pw->pending += count;
+	pthread_mutex_unlock(&pw->lock);
+
+	pthread_mutex_lock(&th->lock);
+	if (th->tail+count > th->size) {
+		th->tail -= th->head;
+		if (th->tail)
+			memmove(th->deque, th->deque+th->head, th->tail*sizeof(*dirs));
+		th->head = 0;
+		if (th->tail+count > th->size) {
+			th->size = 2*(th->tail+count);
+			th->deque = xrealloc(th->deque, th->size*sizeof(*dirs));
+		}
+	}
+	memcpy(th->deque+th->tail, dirs, count*sizeof(*dirs));
+	th->tail += count;
+	pthread_mutex_unlock(&th->lock);
+
+	pthread_mutex_lock(&pw->lock);
+	pw->gen++;
+	if (pw->idle) pthread_cond_broadcast(&pw->wake);
+	pthread_mutex_unlock(&pw->lock);
+}
+
+// Take a directory off the tail of our deque, or the head of someone else's.
+static int dirtree_pop(struct dirtree_thread *th, struct dirtree **dir)
 {
-	struct dirtree *dtroot = NULL, *this, **ddt = &dtroot;
-	DIR *dir;
-	int len = strlen(path);
+	struct dirtree_pwalk *pw = th->pw;
+	int i, got = 0;
+
+	for (i = 0; !got && i < pw->threads; i++) {
+		struct dirtree_thread *from = pw->th + (th-pw->th+i)%pw->threads;
+
+		pthread_mutex_lock(&from->lock);
+		if (from->head != from->tail) {
+			got++;
+			*dir = from == th ? from->deque[--from->tail]
+				: from->deque[from->head++];
+		}
+		pthread_mutex_unlock(&from->lock);
+	}
+
+	return got;
+}
 
-	if (!(dir = opendir(path))) perror_msg("No %s", path);
+// Read one directory, calling the callback on (or collecting) each entry and
+// queueing up the directories under it.
+static void dirtree_readdir(struct dirtree_thread *th, struct dirtree *dir)
+{
+	struct dirtree_pwalk *pw = th->pw;
+	struct dirtree *this, **tail = dir == pw->top ? &pw->list : &dir->child,
+		**subdirs = 0;
+	long count = 0, max = 0;
+	int len = dirtree_path(pw, dir, th->path), fd, pos, end;
+
+	fd = len < 0 ? dirtree_openat(pw, dir)
+		: open(th->path, O_RDONLY|O_DIRECTORY|(dir == pw->top ? 0 : O_NOFOLLOW));
+	if (fd == -1) perror_msg("No %s", len < 0 ? dir->name : th->path);
 	else for (;;) {
-		int norecurse = 0;
-		struct dirent *entry = readdir(dir);
-		if (!entry) {
-			closedir(dir);
+		if (1 > (end = syscall(SYS_getdents64, fd, th->buf, DIRTREE_BUF))) {
+			if (end) perror_msg("%s", len < 0 ? dir->name : th->path);
 			break;
 		}
+		for (pos = 0; pos < end;) {
+			struct dirtree_dent *entry = (void *)(th->buf+pos);
+			int norecurse = 0;
+
+			pos += entry->reclen;
+			if (!(this = dirtree_entry(&th->arena, fd, entry, pw->flags)))
+				continue;
+			if (len >= 0 && len+strlen(this->name)+2 <= sizeof(toybuf)) {
+				th->path[len] = '/';
+				strcpy(th->path+len+1, this->name);
+			} else if (pw->callback) {
+				error_msg("Skipped '%s': path too long", this->name);
+				dirtree_release(&th->arena, this);
+				continue;
+			}
+			this->parent = dir;
+			this->depth = dir ? dir->depth + 1 : 1;
+			if (pw->callback) norecurse = pw->callback(th->path, this);
+			else {
+				*tail = this;
+				tail = &(this->next);
+			}
+			if (len >= 0) th->path[len] = 0;
+
+			// Callbacks can look at the parents of what they're handed, so
+			// directories stay until the end.  Anything else can go now.
+			if (!norecurse && S_ISDIR(this->mode)) {
+				if (count == max)
+					subdirs = xrealloc(subdirs, (max += 64)*sizeof(*subdirs));
+				subdirs[count++] = this;
+			} else if (pw->callback) dirtree_release(&th->arena, this);
+		}
+
+		// Let other threads at this batch's subdirectories now, rather than
+		// waiting for the end of a huge directory.
+		dirtree_push(th, subdirs, count);
+		count = 0;
+	}
+	if (fd != -1) close(fd);
+	free(subdirs);
+}
+
+static void *dirtree_worker(void *data)
+{
+	struct dirtree_thread *th = data;
+	struct dirtree_pwalk *pw = th->pw;
+	struct dirtree *dir;
+	long gen = -1;
 
-		// Skip "." and ".."
-		if (entry->d_name[0]=='.') {
-			if (!entry->d_name[1]) continue;
-			if (entry->d_name[1]=='.' && !entry->d_name[2]) continue;
+	th->buf = xmalloc(DIRTREE_BUF);
+	for (;;) {
+		if (dirtree_pop(th, &dir)) {
+			dirtree_readdir(th, dir);
+			pthread_mutex_lock(&pw->lock);
+			if (!--pw->pending) pthread_cond_broadcast(&pw->wake);
+			pthread_mutex_unlock(&pw->lock);
+			continue;
 		}
 
-		snprintf(path+len, sizeof(toybuf)-len, "/%s", entry->d_name);
-		*ddt = this = dirtree_add_node(path);
-		if (!this) continue;
-		this->parent = parent;
-		this->depth = parent ? parent->depth + 1 : 1;
-		if (callback) norecurse = callback(path, this);
-		if (!norecurse && S_ISDIR(this->st.st_mode))
-			this->child = dirtree_read(path, this, callback);
-		if (callback) free(this);
-		else ddt = &(this->next);
-		path[len]=0;
+		// Nothing to steal: wait for more work, or for everyone to finish.
+		// (Unless some showed up since we last looked, then look again.)
+		pthread_mutex_lock(&pw->lock);
+		if (!pw->pending) {
+			pthread_mutex_unlock(&pw->lock);
+			break;
+		}
+		if (gen == pw->gen) {
+			pw->idle++;
+			pthread_cond_wait(&pw->wake, &pw->lock);
+			pw->idle--;
+		}
+		gen = pw->gen;
+		pthread_mutex_unlock(&pw->lock);
 	}
+	free(th->buf);
 
-	return dtroot;
+	return 0;
 }
 
+// Like dirtree_walk(), but reading directories on up to "threads" threads
+// (including this one) at once.  Without a callback the tree comes out the
+// same as dirtree_walk()'s, since each directory's entries are still read
+// in order by one thread.  (Each thread allocates from its own arena, which
+// all go in "arena" at the end.)  Callbacks get called from several threads at
+// once (in no particular order, each with its own path buffer), so they
+// must be thread safe, and mustn't use toybuf.  Directories are handed to
+// the callback before anything in them.  Callbacks that need the order
+// dirtree_walk() calls them in should use that.
+
+struct dirtree *dirtree_parallel(char *path, struct dirtree *parent,
+	struct dirtree_arena *arena, int flags, int threads,
+	int (*callback)(char *path, struct dirtree *node))
+{
+	struct dirtree_pwalk pw;
+	pthread_t *tids;
+	int i;
+
+	if (!CFG_TOYBOX_THREADS || threads < 2)
+		return dirtree_walk(path, parent, arena, flags, callback);
+	if (!callback && !arena) arena = xzalloc(sizeof(struct dirtree_arena));
+
+	memset(&pw, 0, sizeof(pw));
+	pthread_mutex_init(&pw.lock, NULL);
+	pthread_cond_init(&pw.wake, NULL);
+	pw.threads = threads;
+	pw.flags = flags;
+	pw.root = path;
+	pw.top = parent;
+	pw.callback = callback;
+	pw.th = xzalloc(threads*sizeof(struct dirtree_thread));
+	for (i=0; i<threads; i++) {
+		pw.th[i].pw = &pw;
+		pthread_mutex_init(&pw.th[i].lock, NULL);
+	}
+	dirtree_push(pw.th, &parent, 1);
+
+	tids = xmalloc(sizeof(pthread_t)*threads);
+	for (i=1; i<threads; i++)
+		if (pthread_create(tids+i, NULL, dirtree_worker, pw.th+i))
+			perror_exit("pthread_create");
+	dirtree_worker(pw.th);
+	for (i=1; i<threads; i++) pthread_join(tids[i], NULL);
 
+	for (i=0; i<threads; i++) {
+		struct dirtree_thread *th = pw.th+i;
+
+		if (callback) dirtree_free(&th->arena);
+		else {
+			arena_join(&arena->nodes, &th->arena.nodes);
+			arena_join(&arena->data, &th->arena.data);
+		}
+		free(th->deque);
+		pthread_mutex_destroy(&th->lock);
+	}
+	pthread_mutex_destroy(&pw.lock);
+	pthread_cond_destroy(&pw.wake);
+	free(pw.th);
+	free(tids);
+
+	return pw.list;
+}
+
+struct dirtree *dirtree_read(char *path, struct dirtree *parent,
+					int (*callback)(char *path, struct dirtree *node))
+{
+	return dirtree_walk(path, parent, 0, 0, callback);
+}
@@ -105,6 +105,80 @@ void *xrealloc(void *ptr, size_t size)
 	return ptr;
 }
 
+// Allocate len bytes from an arena: a list of big chunks carved up in order,
+// all freed at once.  (Saves the overhead of lots of little mallocs, and
+// keeps things allocated together next to each other.)
+void *arena_alloc(struct arena *arena, size_t len)
+{
+	struct arena_chunk *ac = arena->chunk;
+	char *ret;
+
+	len = (len+sizeof(long long)-1) & ~(sizeof(long long)-1);
+	if (!ac || ac->end - arena->pos < len) {
+		size_t size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+
+		ac = xmalloc(sizeof(struct arena_chunk)+size);
+		ac->next = arena->chunk;
+		ac->end = (char *)ac->data + size;
+		arena->chunk = ac;
+		arena->pos = (char *)ac->data;
+	}
+	ret = arena->pos;
+	arena->pos += len;
+
+	return ret;
+}
+
+// Free everything allocated from the arena since mark (something it returned),
+// or everything if mark is NULL.
+void arena_free(struct arena *arena, void *mark)
+{
+	struct arena_chunk *ac;
+
+	while ((ac = arena->chunk)) {
+		if (mark && (char *)mark >= (char *)ac->data && (char *)mark < ac->end) {
+			arena->pos = mark;
+			return;
+		}
+		arena->chunk = ac->next;
+		free(ac);
+	}
+	arena->pos = 0;
+}
+
+// Free all the arena's chunks except the newest.  With reset, start over at
+// the beginning of that one too, for arenas that get emptied over and over.
+void arena_trim(struct arena *arena, int reset)
+{
+	struct arena_chunk *ac = arena->chunk;
+	char *pos;
+
+	if (!ac) return;
+	pos = reset ? (char *)ac->data : arena->pos;
+	arena->chunk = ac->next;
+	arena_free(arena, 0);
+	ac->next = 0;
+	arena->chunk = ac;
+	arena->pos = pos;
+}
+
+// Move everything in arena "from" to arena "to", leaving "from" empty.
+void arena_join(struct arena *to, struct arena *from)
+{
+	struct arena_chunk *ac = from->chunk;
+
+	if (!ac) return;
+	if (!to->chunk) *to = *from;
+	else {
+		// Goes after the chunk "to" is allocating from, so that can continue.
+		while (ac->next) ac = ac->next;
+		ac->next = to->chunk->next;
+		to->chunk->next = from->chunk;
+	}
+	from->chunk = 0;
+	from->pos = 0;
+}
+
 // Die unless we can allocate a copy of this many bytes of string.
 void *xstrndup(char *s, size_t n)
 {
@@ -266,6 +340,37 @@ void xwrite(int fd, void *buf, size_t len)
 	if (len != writeall(fd, buf, len)) perror_exit("xwrite");
 }
 
+// Write everything in an iovec array, or die.  Updates the array as it goes.
+
+// Keep writing until all of iov is written (which it adjusts as it goes), or
+// there's an error.
+int writevall(int fd, struct iovec *iov, int count)
+{
+	while (count) {
+		ssize_t len = writev(fd, iov, count);
+
+		if (len<1) return -1;
+
+		// Skip what got written, and resume partway through an entry.
+		while (count && len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base += len;
+			iov->iov_len -= len;
+		}
+	}
+
+	return 0;
+}
+
+void xwritev(int fd, struct iovec *iov, int count)
+{
+	if (writevall(fd, iov, count)) perror_exit("xwritev");
+}
+
 // Die if lseek fails, probably due to being called on a pipe.
 
 off_t xlseek(int fd, off_t offset, int whence)
@@ -342,10 +447,10 @@ void xchdir(char *path)
 	if (chdir(path)) error_exit("chdir '%s'", path);
 }
 
-// Ensure entire path exists.
+// Ensure entire path exists, returning nonzero (with errno set) if it can't.
 // If mode != -1 set permissions on newly created dirs.
 // Requires that path string be writable (for temporary null terminators).
-void xmkpath(char *path, int mode)
+int mkpath(char *path, int mode)
 {
 	char *p, old;
 	mode_t mask;
@@ -362,12 +467,24 @@ void xmkpath(char *path, int mode)
 					rc = mkdir(path, mode);
 					umask(mask);
 				} else rc = mkdir(path, 0777);
+				// Somebody else (another thread) may have just made it.
+				if (rc && errno == EEXIST) {
+					if (!stat(path, &st) && S_ISDIR(st.st_mode)) rc = 0;
+					else errno = ENOTDIR;
+				}
 			}
 			*p = old;
-			if(rc) perror_exit("mkpath '%s'", path);
+			if (rc) return rc;
 		}
 		if (!*p) break;
 	}
+
+	return 0;
+}
+
+void xmkpath(char *path, int mode)
+{
+	if (mkpath(path, mode)) perror_exit("mkpath '%s'", path);
 }
 // Find all file in a colon-separated path with access type "type" (generally
 // X_OK or R_OK).  Returns a list of absolute paths to each file found, in
@@ -684,7 +801,76 @@ void xsendfile(int in, int out)
 	}
 }
 
-// Open a temporary file to copy an existing file into.
+// Feed len bytes of fd starting at offset start (or if len is -1, everything
+// from the current position to EOF) to function() in chunks.  Regular files
+// are mmap()ed a window at a time so the data comes straight out of the page
+// cache with no copy and no syscall per chunk.  Anything else gets read() in
+// 64k chunks, as does whatever's left after st_size when reading to EOF
+// (files in /proc and /sys claim to be empty).  Returns number of bytes fed,
+// or -1 (with errno set) on error.
+
+#define MAPFD_WINDOW (32<<20)
+#define MAPFD_ALIGN (2<<20)
+
+off_t loopfd(int fd, off_t start, off_t len, void *arg,
+	void (*function)(void *arg, char *data, size_t len))
+{
+	struct stat st;
+	off_t done = 0, maplen = len;
+	int seek = len < 0;
+	char *buf;
+
+	if (seek) start = lseek(fd, 0, SEEK_CUR);
+	if (start != -1 && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		if (seek) maplen = st.st_size > start ? st.st_size - start : 0;
+
+		// Windows start on a 2 megabyte boundary so the kernel can use huge
+		// pages where it supports them for the page cache.
+		while (done < maplen) {
+			off_t pos = start + done, base = pos & ~(off_t)(MAPFD_ALIGN-1);
+			size_t size = MAPFD_WINDOW;
+			char *map;
+
+			if (size > start + maplen - base) size = start + maplen - base;
+			map = mmap(0, size, PROT_READ, MAP_SHARED, fd, base);
+			if (map == MAP_FAILED) break;
+			madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+			madvise(map, size, MADV_HUGEPAGE);
+#endif
+			function(arg, map + (pos - base), size - (pos - base));
+			munmap(map, size);
+			done += size - (pos - base);
+		}
+		// Reading to EOF continues with read() from wherever the map ended.
+		if (seek) lseek(fd, start + done, SEEK_SET);
+		else if (done == len) return done;
+	}
+
+	// Pipes and such (or a filesystem that can't mmap), read instead.  Reading
+	// to EOF uses read() so the file position follows along, otherwise pread()
+	// leaves it alone.
+	buf = xmalloc(65536);
+	for (;;) {
+		ssize_t l = 65536;
+
+		if (len >= 0) {
+			if (l > len - done) l = len - done;
+			if (!l) break;
+			l = pread(fd, buf, l, start + done);
+		} else l = read(fd, buf, l);
+		if (l < 0) done = -1;
+		if (l < 1) break;
+		function(arg, buf, l);
+		done += l;
+	}
+	free(buf);
+
+	return done;
+}
+
+// Open a temporary file to copy an existing file into.  Returns -1 (with
+// errno set) if it can't.
 int copy_tempfile(int fdin, char *name, char **tempname)
 {
 	struct stat statbuf;
@@ -692,7 +878,12 @@ int copy_tempfile(int fdin, char *name, char **tempname)
 
 	*tempname = xstrndup(name, strlen(name)+6);
 	strcat(*tempname,"XXXXXX");
-	if(-1 == (fd = mkstemp(*tempname))) error_exit("no temp file");
+	if(-1 == (fd = mkstemp(*tempname))) {
+		free(*tempname);
+		*tempname = NULL;
+
+		return -1;
+	}
 
 	// Set permissions of output file
 
@@ -712,21 +903,33 @@ void delete_tempfile(int fdin, int fdout, char **tempname)
 	*tempname = NULL;
 }
 
-// Copy the rest of the data and replace the original with the copy.
-void replace_tempfile(int fdin, int fdout, char **tempname)
+// Copy the rest of the data and replace the original with the copy.  If that
+// fails, deletes the copy and returns nonzero (with errno set).
+int replace_tempfile(int fdin, int fdout, char **tempname)
 {
-	char *temp = xstrdup(*tempname);
+	char *temp = xstrdup(*tempname), buf[4096];
+	int rc = 0, err;
 
 	temp[strlen(temp)-6]=0;
 	if (fdin != -1) {
-		xsendfile(fdin, fdout);
-		xclose(fdin);
+		ssize_t len;
+
+		while ((len = read(fdin, buf, sizeof(buf))) > 0)
+			if (writeall(fdout, buf, len) != len) break;
+		rc = len ? -1 : close(fdin);
+	}
+	if (close(fdout) && !rc) rc = -1;
+	if (!rc) rc = rename(*tempname, temp);
+	if (rc) {
+		err = errno;
+		unlink(*tempname);
+		errno = err;
 	}
-	xclose(fdout);
-	rename(*tempname, temp);
 	free(*tempname);
 	free(temp);
 	*tempname = NULL;
+
+	return rc;
 }
 
 // Create a 256 entry CRC32 lookup table.
@@ -30,17 +30,75 @@ void *llist_pop(void *list);  // actually void **list, but the compiler's dumb
 struct double_list *dlist_add(struct double_list **list, char *data);
 
 // args.c
+
+// Each command's option string, parsed at build time by scripts/mkopts.c
+// into generated/opts.h.
+struct opts {
+	uint32_t edx[3];   // Flag mask to enable/disable/exclude.
+	signed char c;     // Short option character, -1 if only a longopt
+	char type;         // Type of argument to store (":*#@"), 0 for none
+	char flags;        // |=1, ^=2
+	signed char slot;  // Which long of union "this" to store argument in
+};
+
+struct longopts {
+	char *str;
+	int len, opt;      // Length of str, index of its entry in opts[]
+};
+
+struct optstring {
+	struct opts *opts;          // Rightmost option first, so opts[i] is 1<<i
+	struct longopts *longopts;  // Checked in order, ends with NULL str
+	unsigned char *map;         // Short option char -> opts[] index+1, or 0
+	unsigned char first, len;   // map[0] is for char "first", map has len
+	signed char minargs, maxargs;  // maxargs -1 means no limit
+	char nargs, stopearly, noerror, nodash;
+};
+
 void get_optflags(void);
 
+// lib.c (arena_alloc() and friends, used by dirtree.c)
+struct arena_chunk {
+	struct arena_chunk *next;
+	char *end;
+	long long data[];
+};
+
+struct arena {
+	struct arena_chunk *chunk;  // Newest first
+	char *pos;                  // Next free byte in newest chunk
+};
+
+#define ARENA_CHUNK 65536
+
 // dirtree.c
+
+// Nodes only hold what walking the tree needs, the rest is in st.
 struct dirtree {
 	struct dirtree *next, *child, *parent;
-	struct stat st;
+	struct stat *st;   // NULL with DIRTREE_NOSTAT
+	char *name;
+	mode_t mode;
 	int depth;
-	char name[];
+	int dirfd;         // Open directory containing it (during callback)
 };
 
-struct dirtree *dirtree_add_node(char *path);
+// Where a tree lives: nodes in one arena, names and stat info in the other.
+struct dirtree_arena {
+	struct arena nodes, data;
+};
+
+#define DIRTREE_NOSTAT 1
+
+struct dirtree *dirtree_new(struct dirtree_arena *arena, char *name, int flags);
+void dirtree_free(struct dirtree_arena *arena);
+struct dirtree *dirtree_add_node(struct dirtree_arena *arena, char *path);
+struct dirtree *dirtree_walk(char *path, struct dirtree *parent,
+                    struct dirtree_arena *arena, int flags,
+                    int (*callback)(char *path, struct dirtree *node));
+struct dirtree *dirtree_parallel(char *path, struct dirtree *parent,
+                    struct dirtree_arena *arena, int flags, int threads,
+                    int (*callback)(char *path, struct dirtree *node));
 struct dirtree *dirtree_read(char *path, struct dirtree *parent,
                     int (*callback)(char *path, struct dirtree *node));
 
@@ -54,6 +112,10 @@ void perror_exit(char *msg, ...) noreturn;
 void *xmalloc(size_t size);
 void *xzalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
+void *arena_alloc(struct arena *arena, size_t len);
+void arena_free(struct arena *arena, void *mark);
+void arena_trim(struct arena *arena, int reset);
+void arena_join(struct arena *to, struct arena *from);
 void *xstrndup(char *s, size_t n);
 void *xstrdup(char *s);
 char *xmsprintf(char *format, ...);
@@ -73,6 +135,8 @@ ssize_t writeall(int fd, void *buf, size_t len);
 size_t xread(int fd, void *buf, size_t len);
 void xreadall(int fd, void *buf, size_t len);
 void xwrite(int fd, void *buf, size_t len);
+int writevall(int fd, struct iovec *iov, int count);
+void xwritev(int fd, struct iovec *iov, int count);
 off_t xlseek(int fd, off_t offset, int whence);
 char *readfile(char *name);
 char *xreadfile(char *name);
@@ -80,6 +144,7 @@ char *xgetcwd(void);
 void xstat(char *path, struct stat *st);
 char *xabspath(char *path);
 void xchdir(char *path);
+int mkpath(char *path, int mode);
 void xmkpath(char *path, int mode);
 struct string_list *find_in_path(char *path, char *filename);
 void utoa_to_buf(unsigned n, char *buf, unsigned buflen);
@@ -94,11 +159,18 @@ void loopfiles(char **argv, void (*function)(int fd, char *name));
 char *get_rawline(int fd, long *plen, char end);
 char *get_line(int fd);
 void xsendfile(int in, int out);
+off_t loopfd(int fd, off_t start, off_t len, void *arg,
+	void (*function)(void *arg, char *data, size_t len));
 int copy_tempfile(int fdin, char *name, char **tempname);
 void delete_tempfile(int fdin, int fdout, char **tempname);
-void replace_tempfile(int fdin, int fdout, char **tempname);
+int replace_tempfile(int fdin, int fdout, char **tempname);
 void crc_init(unsigned int *crc_table, int little_endian);
 
+// threads.c
+void thread_loop(int threads, long count, void *arg,
+	void (*work)(void *arg, long i), void (*done)(void *arg, long i));
+int thread_count(void);
+
 // getmountlist.c
 struct mtab_list {
 	struct mtab_list *next;
@@ -111,4 +183,17 @@ struct mtab_list {
 
 struct mtab_list *getmountlist(int die);
 
-void bunzipStream(int src_fd, int dst_fd);
+// bunzip.c, bzip.c
+
+// bzip2 format constants
+#define MAX_GROUPS               6
+#define GROUP_SIZE               50     /* 64 would have been more efficient */
+#define MAX_HUFCODE_BITS         20     /* Longest huffman code allowed */
+#define MAX_SYMBOLS              258    /* 256 literals + RUNA + RUNB */
+#define SYMBOL_RUNA              0
+#define SYMBOL_RUNB              1
+#define BUNZIP_MAGIC             0x314159265359ULL  /* Start of each block */
+#define BUNZIP_EOS               0x177245385090ULL  /* End of stream */
+
+void bunzipStream(int src_fd, int dst_fd, int threads);
+void bzipStream(int src_fd, int dst_fd, int level, int threads);
@@ -0,0 +1,95 @@
+/* vi: set sw=4 ts=4 :*/
+/* threads.c - Run independent chunks of work on several threads. */
+
+#include "toys.h"
+
+// Shared state for thread_loop() workers.
+struct thread_loop {
+	pthread_mutex_t lock;
+	long count, next, done_next;
+	char *finished;
+	void *arg;
+	void (*work)(void *arg, long i);
+	void (*done)(void *arg, long i);
+};
+
+static void *thread_loop_worker(void *data)
+{
+	struct thread_loop *tl = data;
+
+	for (;;) {
+		long i;
+
+		pthread_mutex_lock(&tl->lock);
+		i = tl->next++;
+		pthread_mutex_unlock(&tl->lock);
+		if (i >= tl->count) break;
+
+		tl->work(tl->arg, i);
+
+		// Whoever completes the oldest outstanding item reports everything
+		// finished since then, so done() sees items strictly in order.
+		pthread_mutex_lock(&tl->lock);
+		tl->finished[i]++;
+		while (tl->done_next < tl->count && tl->finished[tl->done_next]) {
+			if (tl->done) tl->done(tl->arg, tl->done_next);
+			tl->done_next++;
+		}
+		pthread_mutex_unlock(&tl->lock);
+	}
+
+	return 0;
+}
+
+// Call work(arg, i) for each i from 0 to count-1, spread across up to
+// "threads" threads (including this one).  Each thread grabs the next unclaimed
+// item when it finishes one, and done(arg, i) (if not NULL) is called in order
+// of i, one at a time, as soon as item i and all items before it are finished.
+// Returns when everything's done.  Neither callback may use toybuf.
+
+void thread_loop(int threads, long count, void *arg,
+	void (*work)(void *arg, long i), void (*done)(void *arg, long i))
+{
+	struct thread_loop tl;
+	pthread_t *tids;
+	int i;
+
+	if (!CFG_TOYBOX_THREADS || threads < 2 || count < 2) {
+		long l;
+
+		for (l=0; l<count; l++) {
+			work(arg, l);
+			if (done) done(arg, l);
+		}
+		return;
+	}
+
+	if (threads > count) threads = count;
+	memset(&tl, 0, sizeof(tl));
+	pthread_mutex_init(&tl.lock, NULL);
+	tl.count = count;
+	tl.finished = xzalloc(count);
+	tl.arg = arg;
+	tl.work = work;
+	tl.done = done;
+
+	tids = xmalloc(sizeof(pthread_t)*threads);
+	for (i=1; i<threads; i++)
+		if (pthread_create(tids+i, NULL, thread_loop_worker, &tl))
+			perror_exit("pthread_create");
+	thread_loop_worker(&tl);
+	for (i=1; i<threads; i++) pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&tl.lock);
+	free(tl.finished);
+	free(tids);
+}
+
+// Number of threads to use for "-j 0": one per online processor.
+
+int thread_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n < 1 ? 1 : n;
+}
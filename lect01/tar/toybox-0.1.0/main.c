@@ -19,6 +19,8 @@ struct toy_list toy_list[] = {
 
 #define TOY_LIST_LEN (sizeof(toy_list)/sizeof(struct toy_list))
 
+#include "generated/toyhash.h"
+
 // global context for this applet.
 
 struct toy_context toys;
@@ -27,27 +29,18 @@ char toybuf[4096];
 
 struct toy_list *toy_find(char *name)
 {
-	int top, bottom, middle;
+	int i;
 
-	// If the name starts with "toybox", accept that as a match.  Otherwise
-	// skip the first entry, which is out of order.
+	// If the name starts with "toybox", accept that as a match.
 
 	if (!strncmp(name,"toybox",6)) return toy_list;
-	bottom = 1;
 
-	// Binary search to find this applet.
+	// Any other command is either in the one slot of the hash table its name
+	// hashes to, or nowhere.
 
-	top = TOY_LIST_LEN-1;
-	for (;;) {
-		int result;
+	i = toy_hash[toy_name_hash(name, TOY_HASH_SEED) & (TOY_HASH_SIZE-1)];
 
-		middle = (top+bottom)/2;
-		if (middle<bottom || middle>top) return NULL;
-		result = strcmp(name,toy_list[middle].name);
-		if (!result) return toy_list+middle;
-		if (result<0) top=--middle;
-		else bottom = ++middle;
-	}
+	return (i && !strcmp(name, toy_list[i].name)) ? toy_list+i : NULL;
 }
 
 // Figure out whether or not anything is using the option parsing logic,
@@ -73,14 +66,64 @@ void toy_init(struct toy_list *which, char *argv[])
 	if (which->flags & TOYFLAG_UMASK) toys.old_umask = umask(0);
 }
 
+// With CONFIG_TOYBOX_TIMING, note the CLOCK_MONOTONIC time when we reach
+// toy_exec(), when option parsing is done, and when we exit, and append
+// "name exec parsed exit" (in nanoseconds) to the file $TOYBOX_TIMING names.
+// Monotonic time is system-wide, so scripts/bench.c can subtract the time it
+// called fork() from the first field to get the cost of exec and libc init.
+
+static long long toy_stamp[2];
+static pid_t toy_pid;
+
+static long long toy_nanos(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static void toy_timing(void)
+{
+	char *name = getenv("TOYBOX_TIMING"), buf[128];
+	long long now = toy_nanos();
+	int fd, len;
+
+	// Children the shell forked to run a command in-process didn't toy_exec().
+	if (getpid() != toy_pid) return;
+	if (!name || (fd = open(name, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0)
+		return;
+	// If option parsing failed, it's where the time went.
+	if (!toy_stamp[1]) toy_stamp[1] = now;
+	len = snprintf(buf, sizeof(buf), "%s %lld %lld %lld\n",
+		toys.which->name, toy_stamp[0], toy_stamp[1], now);
+	// One write() so runs sharing the file don't interleave.
+	write(fd, buf, len);
+	close(fd);
+}
+
 // Run a toy.
 void toy_exec(char *argv[])
 {
 	struct toy_list *which;
+	long long start = 0;
 
+	if (CFG_TOYBOX_TIMING) start = toy_nanos();
 	which = toy_find(argv[0]);
 	if (!which) return;
-	toy_init(which, argv);
+
+	// Time the last command this process runs: "toybox CMD" comes back
+	// through here for CMD.  (The atexit() survives fork(), so a forked child
+	// that gets here times itself instead of its parent.)
+	if (CFG_TOYBOX_TIMING && (toy_pid != getpid() || toys.which == toy_list)) {
+		if (!toy_pid) atexit(toy_timing);
+		toy_pid = getpid();
+		toy_stamp[0] = start;
+		toy_stamp[1] = 0;
+		toy_init(which, argv);
+		toy_stamp[1] = toy_nanos();
+	} else toy_init(which, argv);
 	toys.which->toy_main();
 	exit(toys.exitval);
 }
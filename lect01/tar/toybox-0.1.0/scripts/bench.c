@@ -0,0 +1,195 @@
+/* vi: set ts=4 :*/
+/* Measure how long it takes toybox commands to start up and exit.
+ *
+ * usage: bench [-n COUNT] toybox [command...]
+ *
+ * Runs each command (default: all of them) COUNT times (default 200) with
+ * trivial arguments and stdin/stdout/stderr on /dev/null, and reports the
+ * median and 99th percentile of the wall time from fork() to wait(), plus the
+ * median page faults and peak RSS.  If toybox was built with
+ * CONFIG_TOYBOX_TIMING, also splits the median time into exec (fork to
+ * toy_exec), opts (option parsing), and run (the rest, up to exit()).
+ */
+
+#include "toys.h"
+#include <sys/resource.h>
+
+#undef NEWTOY
+#undef OLDTOY
+#define NEWTOY(name, opts, flags) {#name, 0, opts, flags},
+#define OLDTOY(name, oldname, opts, flags) {#name, 0, opts, flags},
+
+// Populate toy_list[].
+
+struct toy_list toy_list[] = {
+#include "generated/newtoys.h"
+};
+
+#define TOY_LIST_LEN (sizeof(toy_list)/sizeof(struct toy_list))
+
+// Arguments that make a command do something cheap and return success.
+// Commands not listed here run with no arguments.  NULL means skip it:
+// it never exits, or talks to the network or hardware.
+
+static struct {
+	char *name, *args[3];
+} trivial[] = {
+	{"basename", {"/a/b", 0}},
+	{"chroot", {"/", "true", 0}},
+	{"dirname", {"/a/b", 0}},
+	{"echo", {"hello", 0}},
+	{"mdev", {0}},
+	{"nc", {0}},
+	{"netcat", {0}},
+	{"oneit", {0}},
+	{"seq", {"1", 0}},
+	{"sleep", {"0", 0}},
+	{"which", {"sh", 0}},
+	{"yes", {0}},
+};
+
+static long long nanos(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+	long long x = *(long long *)a, y = *(long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Sort and return the median, or the 99th percentile if p99 is set.
+static long long percentile(long long *list, int len, int p99)
+{
+	int i = p99 ? (len*99)/100 : len/2;
+
+	qsort(list, len, sizeof(long long), compare);
+
+	return list[i < len ? i : len-1];
+}
+
+int main(int argc, char *argv[])
+{
+	char *toybox, timing[] = "/tmp/toybench.XXXXXX";
+	long long *wall, *minflt, *majflt, *rss, *stage[3];
+	int i, j, count = 200, fd;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		count = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 2 || count < 1) {
+		fprintf(stderr, "usage: bench [-n COUNT] toybox [command...]\n");
+		return 1;
+	}
+	toybox = argv[1];
+
+	wall = malloc(7*count*sizeof(long long));
+	minflt = wall+count;
+	majflt = minflt+count;
+	rss = majflt+count;
+	for (i=0; i<3; i++) stage[i] = rss+(i+1)*count;
+
+	// Commands built with CONFIG_TOYBOX_TIMING append their timestamps here.
+	if ((fd = mkstemp(timing)) < 0) {
+		perror(timing);
+		return 1;
+	}
+	close(fd);
+	setenv("TOYBOX_TIMING", timing, 1);
+
+	printf("%-10s %8s %8s %7s %7s %7s %8s %8s %8s\n", "command", "p50(us)",
+		"p99(us)", "minflt", "majflt", "rss(kb)", "exec", "opts", "run");
+	printf("%-10s %8s %8s %7s %7s %7s %8s %8s %8s\n", "", "", "", "", "", "",
+		"(us)", "(us)", "(us)");
+
+	for (i=1; i<TOY_LIST_LEN; i++) {
+		char *name = toy_list[i].name, *args[5], **arg = 0;
+		long long *start = stage[0];
+		int runs, stamps = 0;
+		FILE *file;
+
+		// Skip commands not asked for, and aliases like sh/toysh.
+		if (argc > 2) {
+			for (j=2; j<argc; j++) if (!strcmp(argv[j], name)) break;
+			if (j == argc) continue;
+		} else if (!(toy_list[i].flags & TOYMASK_LOCATION)) continue;
+
+		for (j=0; j<sizeof(trivial)/sizeof(*trivial); j++)
+			if (!strcmp(trivial[j].name, name)) arg = trivial[j].args;
+		if (arg && !*arg && argc == 2) continue;
+
+		// Run it as toybox does for a symlink: argv[0] is the command name.
+		args[0] = name;
+		for (j=0; arg && arg[j]; j++) args[j+1] = arg[j];
+		args[j+1] = 0;
+
+		truncate(timing, 0);
+		for (runs=0; runs<count; runs++) {
+			struct rusage ru;
+			pid_t pid;
+			int status;
+
+			start[runs] = nanos();
+			if (!(pid = fork())) {
+				int null = open("/dev/null", O_RDWR);
+
+				for (j=0; j<3; j++) dup2(null, j);
+				// The alarm survives exec, and kills anything that hangs.
+				alarm(5);
+				execv(toybox, args);
+				_exit(127);
+			}
+			if (pid < 0 || wait4(pid, &status, 0, &ru) < 0) {
+				perror("fork");
+				return 1;
+			}
+			wall[runs] = nanos()-start[runs];
+			if (WIFSIGNALED(status)) break;
+			minflt[runs] = ru.ru_minflt;
+			majflt[runs] = ru.ru_majflt;
+			rss[runs] = ru.ru_maxrss;
+		}
+		if (runs < count) {
+			printf("%-10s killed by signal\n", name);
+			continue;
+		}
+
+		// Each run appended "name exec parsed exit" nanoseconds, in order.
+		// Turn those into the length of each stage, overwriting start[].
+		if ((file = fopen(timing, "r"))) {
+			long long t[3];
+			char buf[64];
+
+			while (stamps < count && fscanf(file, "%63s %lld %lld %lld",
+				buf, t, t+1, t+2) == 4)
+			{
+				stage[2][stamps] = t[2]-t[1];
+				stage[1][stamps] = t[1]-t[0];
+				stage[0][stamps] = t[0]-start[stamps];
+				stamps++;
+			}
+			fclose(file);
+		}
+
+		printf("%-10s %8lld %8lld %7lld %7lld %7lld", name,
+			percentile(wall, count, 0)/1000, percentile(wall, count, 1)/1000,
+			percentile(minflt, count, 0), percentile(majflt, count, 0),
+			percentile(rss, count, 0));
+		if (stamps == count) {
+			for (j=0; j<3; j++)
+				printf(" %8.1f", percentile(stage[j], count, 0)/1000.0);
+		} else printf(" %8s %8s %8s", "-", "-", "-");
+		putchar('\n');
+	}
+	unlink(timing);
+
+	return 0;
+}
@@ -11,8 +11,9 @@ echo "Generate headers from toys/*.h..."
 
 # Create a list of all the applets toybox can provide.  Note that the first
 # entry is out of order on purpose (the toybox multiplexer applet must be the
-# first element of the array).  The rest must be sorted in alphabetical order
-# for fast binary search.
+# first element of the array).  The rest are sorted in alphabetical order,
+# which is the order "toybox" lists them in.  (Lookup is by the hash table
+# scripts/mkhash.c makes, below.)
 
 function newtoys()
 {
@@ -82,6 +83,16 @@ sed -n \
   -e 's/.*/#define USE_&(...) __VA_ARGS__/p' \
   .config > generated/config.h || exit 1
 
+echo "Generate perfect hash of command names."
+
+$HOSTCC -I . scripts/mkhash.c -o generated/mkhash &&
+generated/mkhash > generated/toyhash.h || exit 1
+
+echo "Parse option strings into tables."
+
+$HOSTCC -I . scripts/mkopts.c -o generated/mkopts &&
+generated/mkopts > generated/opts.h || exit 1
+
 # Extract a list of toys/*.c files to compile from the data in ".config" with
 # sed, sort, and tr:
 
@@ -97,5 +108,5 @@ TOYFILES=$(cat .config | sed -nre 's/^CONFIG_(.*)=y/\1/;t skip;b;:skip;s/_.*//;p
 echo "Compile toybox..."
 
 $DEBUG $CC $CFLAGS -I . -o toybox_unstripped $OPTIMIZE main.c lib/*.c \
-  $TOYFILES -Wl,--as-needed,-lutil,--no-as-needed || exit 1
+  $TOYFILES -Wl,--as-needed,-lutil,-lpthread,--no-as-needed || exit 1
 $DEBUG $STRIP toybox_unstripped -o toybox || exit 1
@@ -0,0 +1,51 @@
+/* vi: set ts=4 :*/
+/* Generate a perfect hash table of command names for toy_find(). */
+
+#include "toys.h"
+
+#undef NEWTOY
+#undef OLDTOY
+#define NEWTOY(name, opts, flags) {#name, 0, opts, flags},
+#define OLDTOY(name, oldname, opts, flags) {#name, 0, opts, flags},
+
+// Populate toy_list[].
+
+struct toy_list toy_list[] = {
+#include "generated/newtoys.h"
+};
+
+#define TOY_LIST_LEN (sizeof(toy_list)/sizeof(struct toy_list))
+
+int main(int argc, char *argv[])
+{
+	unsigned size, seed, i, *table;
+
+	// Try seeds until every name lands in its own slot of a table at least
+	// twice as big as the list, doubling the table when that takes too long.
+	// (Entry 0 is the toybox multiplexer, which toy_find() checks first.)
+	for (size = 2; size < 2*TOY_LIST_LEN; size *= 2);
+	for (;; size *= 2) {
+		table = calloc(size, sizeof(unsigned));
+		for (seed = 1; seed < 100000; seed++) {
+			memset(table, 0, size*sizeof(unsigned));
+			for (i=1; i<TOY_LIST_LEN; i++) {
+				unsigned *slot = table
+					+ (toy_name_hash(toy_list[i].name, seed) & (size-1));
+
+				if (*slot) break;
+				*slot = i;
+			}
+			if (i == TOY_LIST_LEN) break;
+		}
+		if (seed < 100000) break;
+		free(table);
+	}
+
+	printf("// Generated by scripts/mkhash.c\n\n"
+		"#define TOY_HASH_SEED %u\n#define TOY_HASH_SIZE %u\n\n"
+		"static unsigned short toy_hash[] = {", seed, size);
+	for (i=0; i<size; i++) printf("%s%u,", (i&15) ? "" : "\n\t", table[i]);
+	printf("\n};\n");
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/* vi: set ts=4 :*/
+/* Parse each command's option string into the tables get_optflags() uses,
+ * so it doesn't have to redo it every time a command runs.
+ *
+ * The option string format is described in lib/args.c.
+ */
+
+#include "toys.h"
+
+#undef NEWTOY
+#undef OLDTOY
+#define NEWTOY(name, opts, flags) {#name, 0, opts, flags},
+#define OLDTOY(name, oldname, opts, flags) {#name, 0, opts, flags},
+
+// Populate toy_list[].
+
+struct toy_list toy_list[] = {
+#include "generated/newtoys.h"
+};
+
+#define TOY_LIST_LEN (sizeof(toy_list)/sizeof(struct toy_list))
+
+// Linked list of options while parsing, newest (rightmost) first.
+struct opt {
+	struct opt *next;
+	uint32_t edx[3];
+	int c, flags, type;
+};
+
+struct longopt {
+	struct longopt *next;
+	struct opt *opt;
+	char *str;
+	int len;
+};
+
+static void bug(char *name, int which)
+{
+	fprintf(stderr, "Bug%d in option string for %s\n", which, name);
+	exit(1);
+}
+
+// Print an option character as a C constant.
+static void optchar(int c)
+{
+	if (isalnum(c)) printf("'%c'", c);
+	else printf("%d", c);
+}
+
+int main(int argc, char *argv[])
+{
+	char *plustildenot = "+~!";
+	// What to put in each toy_opts[] entry, and which tables it points to.
+	struct {
+		int table, longopts, first, len, nargs, minargs, maxargs, stopearly, noerror, nodash;
+	} row[TOY_LIST_LEN];
+	int i, j;
+
+	printf("// Generated by scripts/mkopts.c\n\n");
+	memset(row, 0, sizeof(row));
+	for (i=1; i<TOY_LIST_LEN; i++) {
+		char *options = toy_list[i].options, *name = toy_list[i].name;
+		struct opt *opts = NULL, *this = NULL, *opt;
+		struct longopt *longopts = NULL, *lo;
+		int count = 0;
+
+		if (!options) continue;
+
+		// Commands with the same option string (aliases) share tables.
+		for (j=1; j<i; j++)
+			if (toy_list[j].options && !strcmp(toy_list[j].options, options))
+				break;
+		if (j<i) {
+			row[i] = row[j];
+			continue;
+		}
+		row[i].table = i;
+		row[i].maxargs = -1;
+
+		// Parse leading special behavior indicators
+		for (;;) {
+			if (*options == '^') row[i].stopearly++;
+			else if (*options == '<') row[i].minargs = *(++options)-'0';
+			else if (*options == '>') row[i].maxargs = *(++options)-'0';
+			else if (*options == '?') row[i].noerror++;
+			else if (*options == '&') row[i].nodash++;
+			else break;
+			options++;
+		}
+		if (!*options) row[i].stopearly++;
+
+		// Parse rest of opts into list
+		while (*options) {
+			char *temp;
+
+			// Allocate a new option entry when necessary
+			if (!this) {
+				this = calloc(1, sizeof(struct opt));
+				this->next = opts;
+				opts = this;
+				++*(this->edx);
+			}
+			// Each option must start with "(" or an option character.  (Bare
+			// longopts only come at the start of the string.)
+			if (*options == '(') {
+				char *end;
+
+				// Find the end of the longopt
+				for (end = ++options; *end && *end != ')'; end++);
+				if (!*end) bug(name, 1);
+
+				lo = malloc(sizeof(struct longopt));
+				lo->next = longopts;
+				lo->opt = this;
+				lo->str = options;
+				lo->len = end-options;
+				longopts = lo;
+				options = end;
+
+				// Mark this as struct opt as used, even when no short opt.
+				if (!this->c) this->c = -1;
+
+			} else if (strchr(":*#@", *options)) this->type = *options;
+			else if (0 != (temp = strchr(plustildenot, *options))) {
+				int bit = 0, idx = temp - plustildenot;
+
+				if (!*++options) bug(name, 2);
+				// Find this option flag (in previously parsed struct opt)
+				for (opt = this; ; opt = opt->next) {
+					if (!opt) bug(name, 3);
+					if (opt->c == *options) break;
+					bit++;
+				}
+				this->edx[idx] |= 1<<bit;
+
+			} else if (*options == '[') {
+			} else if (*options == '|') this->flags |= 1;
+			else if (*options == '^') this->flags |= 2;
+
+			// At this point, we've hit the end of the previous option.  The
+			// current character is the start of a new option.  If we've
+			// already assigned an option to this struct, loop to allocate a
+			// new one.  (It'll get back here afterwards and fall through.)
+			else if (this->c) {
+				this = NULL;
+				continue;
+
+			// Claim this option, loop to see what's after it.
+			} else this->c = *options;
+
+			options++;
+		}
+
+		// Option i of the list is bit 1<<i, and the options with arguments
+		// get consecutive slots of union "this", also counting from the right.
+		if (opts) {
+			printf("static struct opts opts_%d[] = {\n", i);
+			for (opt = opts; opt; opt = opt->next) {
+				printf("\t{{%#x, %#x, %#x}, ", opt->edx[0]<<count,
+					opt->edx[1]<<count, opt->edx[2]<<count);
+				optchar(opt->c);
+				if (opt->type) printf(", '%c'", opt->type);
+				else printf(", 0");
+				printf(", %d, %d},\n", opt->flags,
+					opt->type ? row[i].nargs++ : -1);
+				count++;
+			}
+
+			// The map only covers the range of option characters used.
+			row[i].first = 255;
+			for (opt = opts, j = 0; opt; opt = opt->next) {
+				if (opt->c < 1) continue;
+				if (opt->c < row[i].first) row[i].first = opt->c;
+				if (opt->c > j) j = opt->c;
+			}
+			if (j) row[i].len = j-row[i].first+1;
+			else row[i].first = 0;
+			printf("};\n\nstatic unsigned char optmap_%d[%d] = {", i,
+				row[i].len ? row[i].len : 1);
+			for (j = 0, opt = opts; opt; opt = opt->next) {
+				struct opt *first;
+
+				// The first match wins, as when get_optflags() searched opts.
+				for (first = opts; first->c != opt->c; first = first->next);
+				j++;
+				if (first != opt || opt->c < 1) continue;
+				printf("\n\t[");
+				optchar(opt->c);
+				printf("-");
+				optchar(row[i].first);
+				printf("] = %d,", j);
+			}
+			printf("\n};\n\n");
+		}
+		if (longopts) {
+			printf("static struct longopts longopts_%d[] = {\n", i);
+			for (lo = longopts; lo; lo = lo->next) {
+				for (j = 0, opt = opts; opt != lo->opt; opt = opt->next) j++;
+				printf("\t{\"%.*s\", %d, %d},\n", lo->len, lo->str, lo->len, j);
+			}
+			printf("\t{0}\n};\n\n");
+		}
+		if (!opts) row[i].table = 0;
+		row[i].longopts = !!longopts;
+
+		while (opts) {
+			opt = opts->next;
+			free(opts);
+			opts = opt;
+		}
+		while (longopts) {
+			lo = longopts->next;
+			free(longopts);
+			longopts = lo;
+		}
+	}
+
+	// One entry per toy_list[] entry, so get_optflags() can index it by
+	// toys.which.  (There are no longopts without opts to attach them to.)
+	printf("static struct optstring toy_opts[] = {\n");
+	for (i=0; i<TOY_LIST_LEN; i++) {
+		j = row[i].table;
+		if (!j) printf("\t{0, 0, 0, ");
+		else if (row[i].longopts)
+			printf("\t{opts_%d, longopts_%d, optmap_%d, ", j, j, j);
+		else printf("\t{opts_%d, 0, optmap_%d, ", j, j);
+		printf("%d, %d, %d, %d, %d, %d, %d, %d},  // %s\n", row[i].first,
+			row[i].len, row[i].minargs,
+			row[i].maxargs, row[i].nargs, row[i].stopearly, row[i].noerror,
+			row[i].nodash, toy_list[i].name);
+	}
+	printf("};\n");
+
+	return 0;
+}
@@ -17,9 +17,11 @@
 #include <grp.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pty.h>
 #include <pwd.h>
 #include <setjmp.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -30,7 +32,9 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <utime.h>
@@ -55,6 +59,15 @@ struct toy_list *toy_find(char *name);
 void toy_init(struct toy_list *which, char *argv[]);
 void toy_exec(char *argv[]);
 
+// Hash a command name.  scripts/mkhash.c picks a seed that makes this a
+// perfect hash of the command names, for toy_find().
+static inline unsigned toy_name_hash(char *name, unsigned seed)
+{
+	while (*name) seed = (seed ^ *(unsigned char *)(name++)) * 16777619;
+
+	return seed ^ (seed >> 15);
+}
+
 // Flags describing applet behavior.
 
 #define TOYFLAG_USR      (1<<0)
@@ -6,25 +6,34 @@
  *
  * Not in SUSv3.
 
-USE_BZCAT(NEWTOY(bzcat, NULL, TOYFLAG_USR|TOYFLAG_BIN))
+USE_BZCAT(NEWTOY(bzcat, "" USE_TOYBOX_THREADS("j#"), TOYFLAG_USR|TOYFLAG_BIN))
 
 config BZCAT
 	bool "bzcat"
 	default y
 	help
-	  usage: bzcat [filename...]
+	  usage: bzcat [-j N] [filename...]
 
 	  Decompress listed files to stdout.  Use stdin if no files listed.
+
+	  -j	Decompress N blocks at once (default one per processor)
 */
 
 #include "toys.h"
 
+DEFINE_GLOBALS(
+	long jobs;
+)
+
+#define TT this.bzcat
+
 static void do_bzcat(int fd, char *name)
 {
-    bunzipStream(fd, 1);
+    bunzipStream(fd, 1, TT.jobs);
 }
 
 void bzcat_main(void)
 {
+    if (!TT.jobs) TT.jobs = thread_count();
     loopfiles(toys.optargs, do_bzcat);
 }
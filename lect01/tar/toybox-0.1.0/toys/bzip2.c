@@ -0,0 +1,69 @@
+/* vi: set sw=4 ts=4:
+ *
+ * bzip2.c - compress files using bzip2.
+ *
+ * Not in SUSv3.
+
+USE_BZIP2(NEWTOY(bzip2, USE_TOYBOX_THREADS("j#") "ck123456789", TOYFLAG_USR|TOYFLAG_BIN))
+
+config BZIP2
+	bool "bzip2"
+	default y
+	help
+	  usage: bzip2 [-ck123456789] [-j N] [filename...]
+
+	  Compress listed files to filename.bz2, deleting the originals.  Compress
+	  stdin to stdout if no files listed.
+
+	  -c	Write to stdout, keeping the originals
+	  -k	Keep the originals
+	  -1..9	Block size in units of 100k (default 9)
+	  -j	Compress N blocks at once (default one per processor)
+*/
+
+#include "toys.h"
+
+DEFINE_GLOBALS(
+	long jobs;
+	int level;
+)
+
+#define TT this.bzip2
+
+#define FLAG_k 512
+#define FLAG_c 1024
+
+static void do_bzip2(int fd, char *name)
+{
+	char *bzname = NULL;
+	int out = 1;
+
+	if (fd && !(toys.optflags & FLAG_c)) {
+		bzname = xmsprintf("%s.bz2", name);
+		if (0 > (out = open(bzname, O_WRONLY|O_CREAT|O_EXCL, 0644))) {
+			perror_msg("%s", bzname);
+			toys.exitval = 1;
+			free(bzname);
+			return;
+		}
+	}
+
+	bzipStream(fd, out, TT.level, TT.jobs);
+
+	if (bzname) {
+		xclose(out);
+		if (!(toys.optflags & FLAG_k) && unlink(name)) perror_msg("%s", name);
+		free(bzname);
+	}
+}
+
+void bzip2_main(void)
+{
+	// -1 through -9 are the bottom 9 flags, -9 lowest.  Biggest one wins.
+	for (TT.level = 9; TT.level; TT.level--)
+		if (toys.optflags & (1<<(9-TT.level))) break;
+	if (!TT.level) TT.level = 9;
+	if (!TT.jobs) TT.jobs = thread_count();
+
+	loopfiles(toys.optargs, do_bzip2);
+}
@@ -6,13 +6,13 @@
  *
  * See http://www.opengroup.org/onlinepubs/009695399/utilities/cksum.html
 
-USE_CKSUM(NEWTOY(cksum, "IPLN", TOYFLAG_BIN))
+USE_CKSUM(NEWTOY(cksum, USE_TOYBOX_THREADS("j#") "IPLN", TOYFLAG_BIN))
 
 config CKSUM
 	bool "cksum"
 	default y
 	help
-	  usage: cksum [-FL] [file...]
+	  usage: cksum [-FL] [-j N] [file...]
 
 	  For each file, output crc32 checksum value, length and name of file.
 	  If no files listed, copy from stdin.  Filename "-" is a synonym for stdin.
@@ -21,16 +21,24 @@ config CKSUM
 	  -P	Pre-inversion
 	  -I	Skip post-inversion
 	  -N	No length
+	  -j	Checksum N files (or N pieces of a large file) at once,
+	    	0 means one per processor
 */
 
 #include "toys.h"
 
 DEFINE_GLOBALS(
+	long jobs;
+
 	unsigned crc_table[256];
+	unsigned (*cksum)(unsigned crc, unsigned char c);
 )
 
 #define TT this.cksum
 
+// With -j, regular files are checksummed in pieces this big.
+#define CKSUM_CHUNK (16<<20)
+
 static unsigned cksum_be(unsigned crc, unsigned char c)
 {
 	return (crc<<8)^TT.crc_table[(crc>>24)^c];
@@ -41,36 +49,25 @@ static unsigned cksum_le(unsigned crc, unsigned char c)
 	return TT.crc_table[(crc^c)&0xff] ^ (crc>>8);
 }
 
-static void do_cksum(int fd, char *name)
+static unsigned cksum_buf(unsigned crc, char *buf, int len)
 {
-	unsigned crc = (toys.optflags&4) ? 0xffffffff : 0;
-	uint64_t llen = 0, llen2;
-	unsigned (*cksum)(unsigned crc, unsigned char c);
-
+	int i;
 
-	cksum = (toys.optflags&2) ? cksum_le : cksum_be;
-	// CRC the data
+	if (toys.optflags&2) for (i=0; i<len; i++) crc = cksum_le(crc, buf[i]);
+	else for (i=0; i<len; i++) crc = cksum_be(crc, buf[i]);
 
-	for (;;) {
-		int len, i;
-
-		len = read(fd, toybuf, sizeof(toybuf));
-		if (len<0) {
-			perror_msg("%s",name);
-			toys.exitval = EXIT_FAILURE;
-		}
-		if (len<1) break;
+	return crc;
+}
 
-		llen += len;
-		for (i=0; i<len; i++) crc=cksum(crc, toybuf[i]);
-	}
+// CRC the length and print the result.
 
-	// CRC the length
+static void cksum_finish(unsigned crc, uint64_t llen, char *name)
+{
+	uint64_t llen2 = llen;
 
-	llen2 = llen;
 	if (!(toys.optflags&1)) {
 		while (llen) {
-			crc = cksum(crc, llen);
+			crc = TT.cksum(crc, llen);
 			llen >>= 8;
 		}
 	}
@@ -80,8 +77,161 @@ static void do_cksum(int fd, char *name)
 	xputc('\n');
 }
 
+// Callback for loopfd()
+
+static void cksum_chunk(void *crc, char *data, size_t len)
+{
+	*(unsigned *)crc = cksum_buf(*(unsigned *)crc, data, len);
+}
+
+static void do_cksum(int fd, char *name)
+{
+	unsigned crc = (toys.optflags&4) ? 0xffffffff : 0;
+	off_t llen;
+
+	// CRC the data, straight out of the page cache when possible.
+
+	llen = loopfd(fd, 0, -1, &crc, cksum_chunk);
+	if (llen<0) {
+		perror_msg("%s",name);
+		toys.exitval = EXIT_FAILURE;
+	} else cksum_finish(crc, llen, name);
+}
+
+// Advance crc over len zero bytes.  The CRC is linear over GF(2), so this is
+// a 32x32 bit matrix (the effect of one zero byte on each bit of crc) raised
+// to the len'th power, by repeated squaring.
+
+static unsigned gf2_times(unsigned *mat, unsigned vec)
+{
+	unsigned sum = 0;
+
+	for (; vec; vec >>= 1, mat++) if (vec&1) sum ^= *mat;
+
+	return sum;
+}
+
+static unsigned cksum_zeroes(unsigned crc, uint64_t len)
+{
+	unsigned op[32], sq[32];
+	int i;
+
+	for (i=0; i<32; i++) op[i] = TT.cksum(1U<<i, 0);
+	while (len) {
+		if (len&1) crc = gf2_times(op, crc);
+		if (!(len >>= 1)) break;
+		for (i=0; i<32; i++) sq[i] = gf2_times(op, op[i]);
+		memcpy(op, sq, sizeof(op));
+	}
+
+	return crc;
+}
+
+// With -j, each file becomes one or more pieces that get checksummed on
+// thread_loop() workers.  Every piece but a file's first starts from a zero
+// CRC, and the done() callback stitches them back together in order:
+// crc(A+B) = crc(A followed by len(B) zeroes) ^ crc(B).
+
+struct cksum_piece {
+	char *name;
+	off_t start, len;  // len -1 means read to EOF
+	uint64_t got;
+	unsigned crc;
+	int err, first, last;
+};
+
+struct cksum_jobs {
+	struct cksum_piece *pieces;
+	unsigned crc;
+	uint64_t llen;
+	int failed;
+};
+
+static void cksum_job(void *arg, long i)
+{
+	struct cksum_piece *p = ((struct cksum_jobs *)arg)->pieces+i;
+	off_t len;
+	int fd = 0;
+
+	if (p->err) return;
+	if (strcmp(p->name, "-") && 0>(fd = open(p->name, O_RDONLY))) {
+		p->err = errno;
+		return;
+	}
+	p->crc = (p->first && (toys.optflags&4)) ? 0xffffffff : 0;
+	len = loopfd(fd, p->start, p->len, &p->crc, cksum_chunk);
+	if (len<0) p->err = errno;
+	else p->got = len;
+	if (fd) close(fd);
+}
+
+static void cksum_job_done(void *arg, long i)
+{
+	struct cksum_jobs *jobs = arg;
+	struct cksum_piece *p = jobs->pieces+i;
+
+	if (p->first) {
+		jobs->crc = p->crc;
+		jobs->llen = jobs->failed = 0;
+	} else jobs->crc = cksum_zeroes(jobs->crc, p->got) ^ p->crc;
+	jobs->llen += p->got;
+
+	if (p->err && !jobs->failed++) {
+		errno = p->err;
+		perror_msg("%s", p->name);
+		toys.exitval = EXIT_FAILURE;
+	}
+	if (p->last && !jobs->failed) cksum_finish(jobs->crc, jobs->llen, p->name);
+}
+
+static void cksum_threaded(char **argv)
+{
+	struct cksum_jobs jobs;
+	struct cksum_piece *p;
+	long count = 0;
+
+	memset(&jobs, 0, sizeof(jobs));
+	for (; *argv; argv++) {
+		struct stat st;
+		off_t len = -1, start = 0;
+		int err = 0;
+
+		if (strcmp(*argv, "-")) {
+			if (stat(*argv, &st)) err = errno;
+			else if (S_ISREG(st.st_mode) && st.st_size) len = st.st_size;
+		}
+
+		// Split regular files into pieces, everything else (including
+		// /proc files that claim to be empty) is one piece read to EOF.
+		do {
+			if (!(count&63))
+				jobs.pieces = xrealloc(jobs.pieces, sizeof(*p)*(count+64));
+			p = jobs.pieces + count++;
+			memset(p, 0, sizeof(*p));
+			p->name = *argv;
+			p->err = err;
+			p->first = !start;
+			p->start = start;
+			p->len = len;
+			if (len != -1) {
+				if (p->len > CKSUM_CHUNK) p->len = CKSUM_CHUNK;
+				start += p->len;
+				len -= p->len;
+			}
+			p->last = len<1;
+		} while (len>0);
+	}
+
+	thread_loop(TT.jobs ? TT.jobs : thread_count(), count, &jobs, cksum_job,
+		cksum_job_done);
+	if (CFG_TOYBOX_FREE) free(jobs.pieces);
+}
+
 void cksum_main(void)
 {
 	crc_init(TT.crc_table, toys.optflags&2);
-	loopfiles(toys.optargs, do_cksum);
+	TT.cksum = (toys.optflags&2) ? cksum_le : cksum_be;
+	if (CFG_TOYBOX_THREADS && (toys.optflags&16) && *toys.optargs)
+		cksum_threaded(toys.optargs);
+	else loopfiles(toys.optargs, do_cksum);
 }
@@ -141,7 +141,7 @@ int cp_node(char *path, struct dirtree *node)
 	if (s != path) s++;
 
 	s = xmsprintf("%s/%s", TT.destname, s);
-	cp_file(path, s, &(node->st));
+	cp_file(path, s, node->st);
 	free(s);
 
 	return 0;
@@ -83,6 +83,34 @@ struct ext2_dentry {
 	char     name[0];     // File name
 };
 
+// ext4 extent tree.  A header, then either extents (depth 0) or index
+// entries pointing to the next level down.  The root is in the inode's
+// block[] array, with room for 4 entries.
+
+#define EXT4_EXT_MAGIC 0xF30A
+
+struct ext4_extent_header {
+	uint16_t magic;
+	uint16_t entries;     // Entries in use
+	uint16_t max;         // Room for this many entries
+	uint16_t depth;       // 0 if entries are extents
+	uint32_t generation;
+};
+
+struct ext4_extent {
+	uint32_t block;       // First file block it covers
+	uint16_t len;         // Number of blocks (up to 32768)
+	uint16_t start_hi;    // High 16 bits of first disk block
+	uint32_t start;       // Low 32 bits of first disk block
+};
+
+struct ext4_extent_idx {
+	uint32_t block;       // First file block it covers
+	uint32_t leaf;        // Low 32 bits of next level's block
+	uint16_t leaf_hi;     // High 16 bits of next level's block
+	uint16_t unused;
+};
+
 struct ext2_inode {
 	uint16_t mode;        // File mode
 	uint16_t uid;         // Low 16 bits of Owner Uid
@@ -125,6 +153,9 @@ struct ext2_inode {
 #define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS		0x0040
+
+#define EXT4_EXTENTS_FL 0x80000
 
 #define EXT2_NAME_LEN 255
 
@@ -180,7 +180,7 @@ static int callback(char *path, struct dirtree *node)
 	if(!strcmp(node->name, "block")) return 1;
 
 	// Does this directory have a "dev" entry in it?
-	if (S_ISDIR(node->st.st_mode) || S_ISLNK(node->st.st_mode)) {
+	if (S_ISDIR(node->mode) || S_ISLNK(node->mode)) {
 		char *dest = path+strlen(path);
 		strcpy(dest, "/dev");
 		if (!access(path, R_OK)) make_device(path);
@@ -198,10 +198,11 @@ void mdev_main(void)
 
 	if (toys.optflags) {
 		xchdir("/sys/class");
+		// The callback only needs to know what type each entry is.
 		strcpy(toybuf, "/sys/class");
-		dirtree_read(toybuf, NULL, callback);
+		dirtree_walk(toybuf, NULL, NULL, DIRTREE_NOSTAT, callback);
 		strcpy(toybuf+5, "block");
-		dirtree_read(toybuf, NULL, callback);
+		dirtree_walk(toybuf, NULL, NULL, DIRTREE_NOSTAT, callback);
 	}
 //	if (toys.optflags) {
 //		strcpy(toybuf, "/sys/block");
@@ -6,17 +6,18 @@
  *
  * Not in SUSv3.
 
-// Still to go: "E:jJ:L:m:O:"
-USE_MKE2FS(NEWTOY(mke2fs, "<1>2g:Fnqm#N#i#b#", TOYFLAG_SBIN))
+// Still to go: "E:jJ:L:m:"
+USE_MKE2FS(NEWTOY(mke2fs, "<1>2" USE_TOYBOX_THREADS("(threads)#") "O:g:DFnqm#N#i#b#", TOYFLAG_SBIN))
 
 config MKE2FS
 	bool "mke2fs"
 	default n
 	help
-	  usage: mke2fs [-Fnq] [-b ###] [-N|i ###] [-m ###] device
+	  usage: mke2fs [-DFnq] [-b ###] [-N|i ###] [-m ###] device
 
 	  Create an ext2 filesystem on a block device or filesystem image.
 
+	  -D         Use direct I/O, bypassing the page cache
 	  -F         Force to run on a mounted device
 	  -n         Don't write to device
 	  -q         Quiet (no output)
@@ -42,9 +43,11 @@ config MKE2FS_GEN
 	default n
 	depends on MKE2FS
 	help
-	  usage: gene2fs [options] device filename
+	  usage: mke2fs [-g dir] [--threads=N]
 
-	  The [options] are the same as mke2fs.
+	  -g dir     Copy the contents of dir into the new filesystem
+	  --threads=N  Read N directories or copy N files at once (default one
+	             per processor)
 
 config MKE2FS_LABEL
 	bool "Label support"
@@ -65,10 +68,11 @@ config MKE2FS_EXTENDED
 	  usage: mke2fs [-E stride=###] [-O option[,option]]
 
 	  -E stride= Set RAID stripe size (in blocks)
-	  -O [opts]  Specify fewer ext2 option flags (for old kernels)
-	             All of these are on by default (as appropriate)
+	  -O [opts]  Turn ext2 option flags on (or with ^ in front, off)
+	             Default is filetype,sparse_super
 	     none         Clear default options (all but journaling)
 	     dir_index    Use htree indexes for large directories
+	     extents      Map file blocks with ext4 extents (not ext2 compatible)
 	     filetype     Store file type info in directory entry
 	     has_journal  Set by -j
 	     journal_dev  Set by -J device=XXX
@@ -84,23 +88,37 @@ DEFINE_GLOBALS(
 	long inodes;           // Total inodes in filesystem.
 	long reserved_percent; // Integer precent of space to reserve for root.
 	char *gendir;          // Where to read dirtree from.
+	char *features;        // Option flags to turn on and off.
+	long jobs;             // Files to copy at once
 
 	// Internal data.
-	struct dirtree *dt;    // Tree of files to copy into the new filesystem.
-	unsigned treeblocks;   // Blocks used by dt
-	unsigned treeinodes;   // Inodes used by dt
+	struct dirtree_arena tree; // Where the tree's nodes live
+	struct dirtree **inode;// Root directory, then tree by inode number
+	unsigned treeblocks;   // Blocks used by the tree
+	unsigned treeinodes;   // Inodes used by the tree (other than root)
+	int largefile;         // Tree has files too big for 32 bit size
+	uint32_t feature[3];   // Compat, incompat, and ro_compat option flags
 
 	unsigned blocks;       // Total blocks in the filesystem.
 	unsigned freeblocks;   // Free blocks in the filesystem.
 	unsigned inodespg;     // Inodes per group
 	unsigned groups;       // Total number of block groups.
 	unsigned blockbits;    // Bits per block.  (Also blocks per group.)
-
-	// For gene2fs
-	unsigned nextblock;    // Next data block to allocate
-	unsigned nextgroup;    // Next group we'll be allocating from
+	unsigned firstblock;   // Block group 0 starts at
+	unsigned itable;       // Blocks of inode table in each group
+	unsigned *datastart;   // Each group's first data block, in data space
 	int fsfd;              // File descriptor of filesystem (to output to).
 
+	// Image writer
+	char *buf;             // Blocks waiting to be written out together
+	unsigned buflen;       // Bytes in buf
+	int align;             // O_DIRECT alignment, or 0 if not using it
+	int nocopy;            // copy_file_range() doesn't work here
+	off_t bufpos;          // Where buf goes in the image
+	off_t pos;             // Where the next write goes in the image
+	off_t holepos;         // Start of zeroes not yet punched out
+	off_t oldlen;          // Length of existing data that zeroes must replace
+
 	struct ext2_superblock sb;
 )
 
@@ -109,6 +127,30 @@ DEFINE_GLOBALS(
 
 #define INODES_RESERVED 10
 
+#define FLAG_N 4
+#define FLAG_D 128
+
+// Which option flags are on?
+#define EXTENTS (TT.feature[1] & EXT4_FEATURE_INCOMPAT_EXTENTS)
+#define FILETYPE (TT.feature[1] & EXT2_FEATURE_INCOMPAT_FILETYPE)
+#define SPARSE (TT.feature[2] & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)
+
+// Option flags -O can turn on and off, and which of TT.feature they're in.
+static struct mke2fs_feature {
+	char *name;
+	int which;
+	uint32_t flag;
+} features[] = {
+	{"dir_index", 0, EXT2_FEATURE_COMPAT_DIR_INDEX},
+	{"extents", 1, EXT4_FEATURE_INCOMPAT_EXTENTS},
+	{"filetype", 1, EXT2_FEATURE_INCOMPAT_FILETYPE},
+	{"sparse_super", 2, EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER}
+};
+
+// Size of the write batch buffer, and of the buffer for copying files.
+#define MKE2FS_BUF (1<<20)
+#define MKE2FS_COPY (1<<18)
+
 static uint32_t div_round_up(uint32_t a, uint32_t b)
 {
 	uint32_t c = a/b;
@@ -117,28 +159,22 @@ static uint32_t div_round_up(uint32_t a, uint32_t b)
 	return c;
 }
 
-// Calculate data blocks plus index blocks needed to hold a file.
-
-static uint32_t file_blocks_used(uint64_t size, uint32_t *blocklist)
+// Allocate memory aligned well enough for O_DIRECT.
+static void *block_alloc(size_t len)
 {
-	uint32_t dblocks = (uint32_t)((size+(TT.blocksize-1))/TT.blocksize);
-	uint32_t idx=TT.blocksize/4, iblocks=0, diblocks=0, tiblocks=0;
+	void *buf;
 
-	// Fill out index blocks in inode.
+	if (posix_memalign(&buf, 4096, len)) error_exit("no memory");
 
-	if (blocklist) {
-		int i;
+	return buf;
+}
 
-		// Direct index blocks
-		for (i=0; i<13 && i<dblocks; i++) blocklist[i] = i;
-		// Singly indirect index blocks
-		if (dblocks > 13+idx) blocklist[13] = 13+idx;
-		// Doubly indirect index blocks
-		idx = 13 + idx + (idx*idx);
-		if (dblocks > idx) blocklist[14] = idx;
+// Calculate data blocks plus index blocks needed to hold a file.
 
-		return 0;
-	}
+static uint32_t file_blocks_used(uint64_t size)
+{
+	uint32_t dblocks = (uint32_t)((size+(TT.blocksize-1))/TT.blocksize);
+	uint32_t idx=TT.blocksize/4, iblocks=0, diblocks=0, tiblocks=0;
 
 	// Account for direct, singly, doubly, and triply indirect index blocks
 
@@ -154,74 +190,196 @@ static uint32_t file_blocks_used(uint64_t size, uint32_t *blocklist)
 	return dblocks + iblocks + diblocks + tiblocks;
 }
 
-// Use the parent pointer to iterate through the tree non-recursively.
+// Use the parent pointer to iterate through the tree non-recursively,
+// visiting each directory before its contents.
 static struct dirtree *treenext(struct dirtree *this)
 {
+	if (this->child) return this->child;
 	while (this && !this->next) this = this->parent;
 	if (this) this = this->next;
 
 	return this;
 }
 
-// Recursively calculate the number of blocks used by each inode in the tree.
-// Returns blocks used by this directory, assigns bytes used to *size.
-// Writes total block count to TT.treeblocks and inode count to TT.treeinodes.
+// Length of a directory entry with this name.
+static unsigned dentry_len(char *name)
+{
+	return (sizeof(struct ext2_dentry) + strlen(name) + 3) & ~3;
+}
+
+static int dentry_type(mode_t mode)
+{
+	if (S_ISREG(mode)) return EXT2_FT_REG_FILE;
+	if (S_ISDIR(mode)) return EXT2_FT_DIR;
+	if (S_ISCHR(mode)) return EXT2_FT_CHRDEV;
+	if (S_ISBLK(mode)) return EXT2_FT_BLKDEV;
+	if (S_ISFIFO(mode)) return EXT2_FT_FIFO;
+	if (S_ISSOCK(mode)) return EXT2_FT_SOCK;
+	if (S_ISLNK(mode)) return EXT2_FT_SYMLINK;
+
+	return EXT2_FT_UNKNOWN;
+}
 
-static long check_treesize(struct dirtree *that, off_t *size)
+// Lay out a directory's entries (".", "..", then its contents) in blocks,
+// filling out data if it isn't NULL.  Entries can't cross a block boundary,
+// so the last one in each block is stretched to the end of it.  Returns the
+// directory's size.
+
+static off_t dir_pack(struct dirtree *dir, char *data)
 {
-	long blocks;
+	struct dirtree *dt = 0;
+	struct ext2_dentry *de = 0;
+	off_t size = 0;
+	unsigned used = 0, last = 0;
+	int i;
 
-	while (that) {
-		*size += sizeof(struct ext2_dentry) + strlen(that->name);
+	for (i = 0;; i++) {
+		struct dirtree *that = dir;
+		char *name = ".";
+		unsigned len;
+
+		if (i == 1) {
+			name = "..";
+			if (dir->parent) that = dir->parent;
+		} else if (i > 1) {
+			if (!(dt = dt ? dt->next : dir->child)) break;
+			name = (that = dt)->name;
+		}
 
-		if (that->child)
-			that->st.st_blocks = check_treesize(that->child, &that->st.st_size);
-		else if (S_ISREG(that->st.st_mode)) {
-			 that->st.st_blocks = file_blocks_used(that->st.st_size, 0);
-			 TT.treeblocks += that->st.st_blocks;
+		len = dentry_len(name);
+		if (used + len > TT.blocksize) {
+			if (data) de->rec_len = SWAP_LE16(TT.blocksize - last);
+			size += TT.blocksize;
+			used = 0;
 		}
-		that = that->next;
+		if (data) {
+			de = (struct ext2_dentry *)(data + size + used);
+			de->inode = SWAP_LE32(that->st->st_ino);
+			de->rec_len = SWAP_LE16(len);
+			de->name_len = strlen(name);
+			if (FILETYPE) de->file_type = dentry_type(that->mode);
+			memcpy(de->name, name, de->name_len);
+		}
+		last = used;
+		used += len;
 	}
-	TT.treeblocks += blocks = file_blocks_used(*size, 0);
-	TT.treeinodes++;
+	if (data) de->rec_len = SWAP_LE16(TT.blocksize - last);
+
+	return size + TT.blocksize;
+}
+
+// Sort hard link candidates by which file they are, then tree order.
+struct treelink {
+	struct dirtree *dt;
+	long order;
+};
+
+static int treelink_cmp(const void *a, const void *b)
+{
+	const struct treelink *la = a, *lb = b;
+
+	if (la->dt->st->st_dev != lb->dt->st->st_dev)
+		return la->dt->st->st_dev < lb->dt->st->st_dev ? -1 : 1;
+	if (la->dt->st->st_ino != lb->dt->st->st_ino)
+		return la->dt->st->st_ino < lb->dt->st->st_ino ? -1 : 1;
 
-	return blocks;
+	return la->order < lb->order ? -1 : la->order > lb->order;
 }
 
 // Calculate inode numbers and link counts.
-// 
-// To do this right I need to copy the tree and sort it, but here's a really
-// ugly n^2 way of dealing with the problem that doesn't scale well to large
-// numbers of files (> 100,000) but can be done in very little code.
-// This rewrites inode numbers to their final values, allocating depth first.
+//
+// Number inodes in tree order (the root directory is always inode 2), with
+// each hard link sharing the number of the first copy found.  Sorting the
+// files with more than one link finds the copies.  Fills out TT.inode with
+// the root directory followed by each inode by number.
 
 static void check_treelinks(struct dirtree *tree)
 {
-	struct dirtree *current=tree, *that;
-	long inode = INODES_RESERVED;
+	struct dirtree *dt, **all;
+	struct treelink *links;
+	long count = 0, nlinks = 0, i, *first;
+
+	for (dt = tree; dt; dt = treenext(dt)) count++;
+	all = xmalloc(count*sizeof(struct dirtree *));
+	links = xmalloc(count*sizeof(struct treelink));
+	first = xmalloc(count*sizeof(long));
+	for (dt = tree, i = 0; dt; dt = treenext(dt), i++) {
+		all[i] = dt;
+		first[i] = i;
+		if (!S_ISDIR(dt->mode) && dt->st->st_nlink > 1) {
+			links[nlinks].dt = dt;
+			links[nlinks++].order = i;
+		}
+	}
+	qsort(links, nlinks, sizeof(struct treelink), treelink_cmp);
+	for (i = 1; i < nlinks; i++)
+		if (links[i].dt->st->st_dev == links[i-1].dt->st->st_dev
+			&& links[i].dt->st->st_ino == links[i-1].dt->st->st_ino)
+				first[links[i].order] = first[links[i-1].order];
+
+	TT.inode = xmalloc(count*sizeof(struct dirtree *));
+	TT.treeinodes = 0;
+	for (i = 0; i < count; i++) {
+		dt = all[i];
+		if (first[i] != i) {
+			dt->st->st_ino = all[first[i]]->st->st_ino;
+			all[first[i]]->st->st_nlink++;
+			continue;
+		}
+		dt->st->st_ino = i ? INODES_RESERVED + TT.treeinodes + 1 : 2;
+		if (i) TT.treeinodes++;
+		TT.inode[i ? TT.treeinodes : 0] = dt;
 
-	while (current) {
-		++inode;
 		// Since we can't hardlink to directories, we know their link count.
-		if (S_ISDIR(current->st.st_mode)) current->st.st_nlink = 2;
-		else {
-			dev_t new = current->st.st_dev;
-
-			if (!new) continue;
-
-			// Look for other copies of current node
-			current->st.st_nlink = 0;
-			for (that = tree; that; that = treenext(that)) {
-				if (current->st.st_ino == that->st.st_ino &&
-					current->st.st_dev == that->st.st_dev)
-				{
-					current->st.st_nlink++;
-					current->st.st_ino = inode;
-				}
-			}
+		dt->st->st_nlink = 1;
+		if (S_ISDIR(dt->mode)) {
+			dt->st->st_nlink++;
+			if (dt->parent) dt->parent->st->st_nlink++;
 		}
-		current->st.st_ino = inode;
-		current = treenext(current);
+	}
+	free(all);
+	free(links);
+	free(first);
+}
+
+// Find the tree node for an inode number, or NULL if it's unused (or
+// reserved).
+static struct dirtree *find_inode(uint32_t ino)
+{
+	if (ino == 2) return *TT.inode;
+	if (ino <= INODES_RESERVED || ino > INODES_RESERVED+TT.treeinodes) return 0;
+
+	return TT.inode[ino-INODES_RESERVED];
+}
+
+// Does this inode keep its contents in blocks?  (Short symlinks live in the
+// inode, and devices, fifos, and sockets have no contents.)
+static int has_blocks(struct dirtree *that)
+{
+	mode_t mode = that->mode;
+
+	if (S_ISLNK(mode)) return that->st->st_size >= 60;
+	return S_ISREG(mode) || S_ISDIR(mode);
+}
+
+// Calculate the size of each inode, and how many data blocks the tree uses
+// (in TT.treeblocks).  That's too few to hold it with its index blocks or
+// extent trees, so it's a safe first guess at how big to make the filesystem.
+
+static void check_treesize(void)
+{
+	uint32_t i;
+
+	TT.treeblocks = 0;
+	for (i = 0; i <= TT.treeinodes; i++) {
+		struct dirtree *that = TT.inode[i];
+		mode_t mode = that->mode;
+
+		if (S_ISDIR(mode)) that->st->st_size = dir_pack(that, 0);
+		else if (!S_ISREG(mode) && !S_ISLNK(mode)) that->st->st_size = 0;
+		if (S_ISREG(mode) && that->st->st_size > INT_MAX) TT.largefile++;
+		if (has_blocks(that))
+			TT.treeblocks += (that->st->st_size+(TT.blocksize-1))/TT.blocksize;
 	}
 }
 
@@ -280,7 +438,7 @@ static void init_superblock(struct ext2_superblock *sb)
 	temp = (TT.blocks * (uint64_t)TT.reserved_percent) / 100;
 	sb->r_blocks_count = SWAP_LE32(temp);
 
-	sb->first_data_block = SWAP_LE32(TT.blocksize == 1024 ? 1 : 0);
+	sb->first_data_block = SWAP_LE32(TT.firstblock);
 
 	// Set blocks_per_group and frags_per_group, which is the size of an
 	// allocation bitmap that fits in one block (I.E. how many bits per block)?
@@ -299,17 +457,27 @@ static void init_superblock(struct ext2_superblock *sb)
 	// Fill out the rest of the superblock.
 	sb->max_mnt_count=0xFFFF;
 	sb->wtime = sb->lastcheck = sb->mkfs_time = SWAP_LE32(time(NULL));
-	sb->magic = SWAP_LE32(0xEF53);
+	sb->magic = SWAP_LE16(0xEF53);
 	sb->state = sb->errors = SWAP_LE16(1);
 
 	sb->rev_level = SWAP_LE32(1);
 	sb->first_ino = SWAP_LE32(INODES_RESERVED+1);
 	sb->inode_size = SWAP_LE16(sizeof(struct ext2_inode));
-	sb->feature_incompat = SWAP_LE32(EXT2_FEATURE_INCOMPAT_FILETYPE);
-	sb->feature_ro_compat = SWAP_LE32(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER);
+	sb->feature_compat = SWAP_LE32(TT.feature[0]);
+	sb->feature_incompat = SWAP_LE32(TT.feature[1]);
+	temp = TT.feature[2];
+	if (TT.largefile) temp |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+	sb->feature_ro_compat = SWAP_LE32(temp);
 
 	create_uuid(sb->uuid);
-	
+
+	// Directories start out linear, the kernel adds htree indexes as they
+	// grow.  It just needs to know how to hash names.
+	if (TT.feature[0] & EXT2_FEATURE_COMPAT_DIR_INDEX) {
+		create_uuid((char *)sb->hash_seed);
+		sb->def_hash_version = 1;
+	}
+
 	// TODO If we're called as mke3fs or mkfs.ext3, do a journal.
 
 	//if (strchr(toys.which->name,'3'))
@@ -322,7 +490,8 @@ static int is_sb_group(uint32_t group)
 	int i;
 
 	// Superblock backups are on groups 0, 1, and powers of 3, 5, and 7.
-	if(!group || group==1) return 1;
+	// (Or every group, if not sparse.)
+	if(!group || group==1 || !SPARSE) return 1;
 	for (i=3; i<9; i+=2) {
 		int j = i;
 		while (j<group) j*=i;
@@ -331,7 +500,7 @@ static int is_sb_group(uint32_t group)
 	return 0;
 }
 
-	
+
 // Number of blocks used in group by optional superblock/group list backup.
 static int group_superblock_overhead(uint32_t group)
 {
@@ -345,8 +514,6 @@ static int group_superblock_overhead(uint32_t group)
 	used /= TT.blocksize;
 	// Plus the superblock itself.
 	used++;
-	// And a corner case.
-	if (!group && TT.blocksize == 1024) used++;
 
 	return used;
 }
@@ -356,8 +523,181 @@ static int group_overhead(uint32_t group)
 {
 	// Return superblock backup overhead (if any), plus block/inode
 	// allocation bitmaps, plus inode tables.
-	return group_superblock_overhead(group) + 2 + get_inodespg(TT.inodespg)
-				/ (TT.blocksize/sizeof(struct ext2_inode));
+	return group_superblock_overhead(group) + 2 + TT.itable;
+}
+
+// First block of a group, and how many blocks it has.  (The last group can
+// be short.)
+static uint32_t group_start(uint32_t group)
+{
+	return TT.firstblock + group*TT.blockbits;
+}
+
+static uint32_t group_size(uint32_t group)
+{
+	uint32_t left = TT.blocks - group_start(group);
+
+	return left < TT.blockbits ? left : TT.blockbits;
+}
+
+// How many of this group's data blocks the tree uses.
+static uint32_t group_used(uint32_t group)
+{
+	uint32_t start = TT.datastart[group], end = TT.datastart[group+1];
+
+	if (TT.treeblocks <= start) return 0;
+	return (TT.treeblocks < end ? TT.treeblocks : end) - start;
+}
+
+// Convert a block in data space to a block in the filesystem.  If run isn't
+// NULL, set it to how many blocks after that one are contiguous with it.
+static uint32_t data_block(uint32_t block, uint32_t *run)
+{
+	uint32_t lo = 0, hi = TT.groups-1;
+
+	while (lo < hi) {
+		uint32_t mid = (lo+hi+1)/2;
+
+		if (TT.datastart[mid] <= block) lo = mid;
+		else hi = mid-1;
+	}
+	if (run) *run = TT.datastart[lo+1] - block;
+
+	return group_start(lo) + group_overhead(lo) + block - TT.datastart[lo];
+}
+
+// Find where each group's data starts in data space.  If we don't know how
+// big the filesystem is yet, every group is full and the last goes on
+// forever.
+static void find_datastart(void)
+{
+	uint32_t i, temp;
+
+	for (i = temp = 0; i < TT.groups; i++) {
+		TT.datastart[i] = temp;
+		temp += (TT.blocks ? group_size(i) : TT.blockbits) - group_overhead(i);
+	}
+	TT.datastart[i] = TT.blocks ? temp : UINT_MAX;
+}
+
+// Fill out the extents mapping dblocks data blocks starting at block first
+// in data space, if ext isn't NULL.  Returns how many extents it takes:
+// a new one starts at each group boundary, and every 32768 blocks.
+static uint32_t file_extents(uint32_t first, uint32_t dblocks,
+	struct ext4_extent *ext)
+{
+	uint32_t count = 0, done = 0, block, run;
+
+	while (done < dblocks) {
+		block = data_block(first + done, &run);
+		if (run > dblocks - done) run = dblocks - done;
+		if (run > 32768) run = 32768;
+		if (ext) {
+			memset(ext+count, 0, sizeof(struct ext4_extent));
+			ext[count].block = SWAP_LE32(done);
+			ext[count].len = SWAP_LE16(run);
+			ext[count].start = SWAP_LE32(block);
+		}
+		count++;
+		done += run;
+	}
+
+	return count;
+}
+
+// How many blocks of extent tree does a file with this many extents need?
+// The inode holds 4 entries, and each level of blocks below it holds the
+// entries for the level below that.
+static uint32_t extent_blocks(uint32_t count)
+{
+	uint32_t per = TT.blocksize/sizeof(struct ext4_extent) - 1, total = 0;
+
+	while (count > 4) total += (count = div_round_up(count, per));
+
+	return total;
+}
+
+// Build an inode's extent tree, with the root in block (the inode's block
+// array).  The rest goes right after its data, leaves first, then each
+// level of index blocks up.  Returns those blocks, or NULL if none.
+static char *extent_tree(struct dirtree *that, uint32_t *block)
+{
+	struct ext4_extent_header *eh;
+	struct ext4_extent_idx *idx;
+	uint32_t first = that->st->st_dev, count, dblocks, per, pos, i, j, depth;
+	char *entries, *tree = 0;
+
+	dblocks = (that->st->st_size+(TT.blocksize-1))/TT.blocksize;
+	count = file_extents(first, dblocks, 0);
+	entries = xmalloc(count*sizeof(struct ext4_extent) + 1);
+	file_extents(first, dblocks, (void *)entries);
+	if ((i = extent_blocks(count))) {
+		tree = block_alloc(i*TT.blocksize);
+		memset(tree, 0, i*TT.blocksize);
+	}
+
+	// Fill out each level of blocks with the entries from the level below,
+	// and make an index entry pointing to each block for the level above.
+	// (Extents and index entries both start with the first file block
+	// they cover.)
+	per = TT.blocksize/sizeof(struct ext4_extent) - 1;
+	for (depth = pos = 0; count > 4; depth++) {
+		idx = xmalloc(div_round_up(count, per)*sizeof(struct ext4_extent_idx));
+		for (i = 0; i*per < count; i++, pos++) {
+			j = count - i*per;
+			if (j > per) j = per;
+			eh = (void *)(tree + pos*TT.blocksize);
+			eh->magic = SWAP_LE16(EXT4_EXT_MAGIC);
+			eh->entries = SWAP_LE16(j);
+			eh->max = SWAP_LE16(per);
+			eh->depth = SWAP_LE16(depth);
+			memcpy(eh+1, entries + i*per*sizeof(struct ext4_extent),
+				j*sizeof(struct ext4_extent));
+			memset(idx+i, 0, sizeof(struct ext4_extent_idx));
+			idx[i].block = *(uint32_t *)(eh+1);
+			idx[i].leaf = SWAP_LE32(data_block(first + dblocks + pos, 0));
+		}
+		free(entries);
+		entries = (char *)idx;
+		count = i;
+	}
+
+	eh = (void *)block;
+	eh->magic = SWAP_LE16(EXT4_EXT_MAGIC);
+	eh->entries = SWAP_LE16(count);
+	eh->max = SWAP_LE16(4);
+	eh->depth = SWAP_LE16(depth);
+	memcpy(eh+1, entries, count*sizeof(struct ext4_extent));
+	free(entries);
+
+	return tree;
+}
+
+// Allocate each inode's blocks (data plus index or extent tree), now that
+// we know where the groups go.  Each inode gets a contiguous run of blocks
+// in data space (the data blocks of every group laid end to end), starting
+// at the block saved in st_dev now that we're done with it.
+// Writes total block count to TT.treeblocks.
+
+static void allocate_tree(void)
+{
+	uint32_t i, dblocks;
+
+	TT.treeblocks = 0;
+	for (i = 0; i <= TT.treeinodes; i++) {
+		struct dirtree *that = TT.inode[i];
+
+		that->st->st_blocks = 0;
+		if (has_blocks(that)) {
+			if (EXTENTS) {
+				dblocks = (that->st->st_size+(TT.blocksize-1))/TT.blocksize;
+				that->st->st_blocks = dblocks
+					+ extent_blocks(file_extents(TT.treeblocks, dblocks, 0));
+			} else that->st->st_blocks = file_blocks_used(that->st->st_size);
+		}
+		that->st->st_dev = TT.treeblocks;
+		TT.treeblocks += that->st->st_blocks;
+	}
 }
 
 // In bitmap "array" set "len" bits starting at position "start" (from 0).
@@ -376,63 +716,422 @@ static void bits_set(char *array, int start, int len)
 	}
 }
 
-// Seek past len bytes (to maintain sparse file), or write zeroes if output
-// not seekable
-static void put_zeroes(int len)
+// Write len bytes at offset pos, dropping O_DIRECT for writes it can't do.
+static void write_at(char *data, off_t pos, size_t len)
+{
+	int flags = 0;
+
+	if (TT.align && ((pos|len|(long)data) & (TT.align-1))) {
+		flags = fcntl(TT.fsfd, F_GETFL);
+		fcntl(TT.fsfd, F_SETFL, flags & ~O_DIRECT);
+	}
+	while (len) {
+		ssize_t i = pwrite(TT.fsfd, data, len, pos);
+
+		if (i < 1) perror_exit("write");
+		data += i;
+		pos += i;
+		len -= i;
+	}
+	if (flags) fcntl(TT.fsfd, F_SETFL, flags);
+}
+
+// Write out the batch of blocks collected so far.
+static void flush_blocks(void)
+{
+	if (TT.buflen) write_at(TT.buf, TT.bufpos, TT.buflen);
+	TT.buflen = 0;
+}
+
+// Zero the run of bytes from TT.holepos to TT.pos.  Whatever's past the end
+// of the old data reads back as zeroes already.  Otherwise punch a hole
+// (which block devices treat as discard and zero), or write zeroes if we
+// can't.
+static void flush_zeroes(void)
 {
-	if(-1 == lseek(TT.fsfd, len, SEEK_SET)) {
-		memset(toybuf, 0, sizeof(toybuf));
+	off_t len = (TT.pos < TT.oldlen ? TT.pos : TT.oldlen) - TT.holepos;
+
+	if (len > 0 && fallocate(TT.fsfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		TT.holepos, len))
+	{
+		flush_blocks();
+		memset(TT.buf, 0, MKE2FS_BUF);
 		while (len) {
-			int out = len > sizeof(toybuf) ? sizeof(toybuf) : len;
-			xwrite(TT.fsfd, toybuf, out);
+			size_t out = len > MKE2FS_BUF ? MKE2FS_BUF : len;
+
+			write_at(TT.buf, TT.holepos, out);
+			TT.holepos += out;
 			len -= out;
 		}
 	}
+	TT.holepos = TT.pos;
+}
+
+// Append data to the image, batching it up with the blocks around it so
+// it goes out in large writes.  Zeroes become holes.
+static void put_data(void *data, size_t len)
+{
+	char *d = data;
+
+	if (!*d && !memcmp(d, d+1, len-1)) {
+		TT.pos += len;
+		return;
+	}
+	if (TT.holepos != TT.pos) flush_zeroes();
+	while (len) {
+		size_t out = MKE2FS_BUF - TT.buflen;
+
+		if (TT.bufpos + TT.buflen != TT.pos || !out) {
+			flush_blocks();
+			TT.bufpos = TT.pos;
+			out = MKE2FS_BUF;
+		}
+		if (out > len) out = len;
+		memcpy(TT.buf + TT.buflen, d, out);
+		TT.buflen += out;
+		TT.pos += out;
+		TT.holepos = TT.pos;
+		d += out;
+		len -= out;
+	}
+}
+
+// Skip len bytes of zeroes, leaving a hole in the image.
+static void put_zeroes(off_t len)
+{
+	TT.pos += len;
+}
+
+// Skip len bytes of data blocks, which don't need zeroing: unused ones can
+// hold anything, and the rest get written later.
+static void skip_data(off_t len)
+{
+	flush_zeroes();
+	TT.pos += len;
+	TT.holepos = TT.pos;
+}
+
+// Finish writing the image, extending a regular file out to its full size.
+static void finish_image(void)
+{
+	struct stat st;
+
+	flush_blocks();
+	flush_zeroes();
+	if (!fstat(TT.fsfd, &st) && S_ISREG(st.st_mode) && st.st_size < TT.pos
+		&& ftruncate(TT.fsfd, TT.pos))
+	{
+		perror_exit("ftruncate");
+	}
+}
+
+// Write the path of a node in the tree into buf, returning its end.
+static char *node_fullpath(struct dirtree *dt, char *buf)
+{
+	if (!dt->parent) return stpcpy(buf, TT.gendir);
+	buf = node_fullpath(dt->parent, buf);
+	*(buf++) = '/';
+
+	return stpcpy(buf, dt->name);
+}
+
+// Open a directory of the tree one level at a time.
+static int node_dirfd(struct dirtree *dt)
+{
+	int fd, dirfd;
+
+	if (!dt->parent) return open(TT.gendir, O_RDONLY|O_DIRECTORY);
+	if (-1 == (dirfd = node_dirfd(dt->parent))) return -1;
+	fd = openat(dirfd, dt->name, O_RDONLY|O_DIRECTORY);
+	close(dirfd);
+
+	return fd;
+}
+
+// Find a node of the tree: returns the directory to look up buf relative to.
+// Usually that's AT_FDCWD with the whole path in buf, but paths too long for
+// PATH_MAX get just the name, and an open directory for the caller to close.
+static int node_path(struct dirtree *dt, char *buf)
+{
+	struct dirtree *up;
+	long len = strlen(TT.gendir);
+
+	for (up = dt; up->parent; up = up->parent) len += strlen(up->name)+1;
+	if (len < PATH_MAX) {
+		node_fullpath(dt, buf);
+		return AT_FDCWD;
+	}
+	strcpy(buf, dt->name);
+
+	return node_dirfd(dt->parent);
 }
 
 // Fill out an inode structure from struct stat info in dirtree.
 static void fill_inode(struct ext2_inode *in, struct dirtree *that)
 {
-	uint32_t fbu[15];
+	uint32_t *block = in->block, first = that->st->st_dev,
+		idx = TT.blocksize/4, dblocks;
 	int temp;
 
-	file_blocks_used(that->st.st_size, fbu);
-
-	// If that inode needs data blocks allocated to it.
-	if (that->st.st_size) {
-		int i, group = TT.nextblock/TT.blockbits;
-
-		// TODO: teach this about indirect blocks.
-		for (i=0; i<15; i++) {
-			// If we just jumped into a new group, skip group overhead blocks.
-			while (group >= TT.nextgroup)
-				TT.nextblock += group_overhead(TT.nextgroup++);
-		}
+	// Device numbers and short symlinks go where block pointers would.
+	if (S_ISCHR(that->mode) || S_ISBLK(that->mode)) {
+		unsigned maj = major(that->st->st_rdev), min = minor(that->st->st_rdev);
+
+		if (maj < 256 && min < 256) block[0] = SWAP_LE32((maj<<8)|min);
+		else block[1] = SWAP_LE32((min&0xff)|(maj<<8)|((min&~0xff)<<12));
+	} else if (S_ISLNK(that->mode) && !that->st->st_blocks) {
+		temp = node_path(that, toybuf);
+		if (that->st->st_size != readlinkat(temp, toybuf, (char *)block, 60))
+			perror_msg("%s", toybuf);
+		if (temp != AT_FDCWD) close(temp);
+
+	// With extents, block holds the root of the extent tree.  (Even an empty
+	// file needs one.)
+	} else if (EXTENTS && has_blocks(that)) {
+		in->flags = SWAP_LE32(EXT4_EXTENTS_FL);
+		free(extent_tree(that, block));
+
+	// Index blocks go right before the first block they point to, so a
+	// file's single, double, and triple indirect blocks come after 12, 12+idx,
+	// and 12+idx+idx*idx data blocks.  (See populate_index().)
+	} else if (that->st->st_blocks) {
+		dblocks = (that->st->st_size+(TT.blocksize-1))/TT.blocksize;
+		for (temp = 0; temp<12 && temp<dblocks; temp++)
+			block[temp] = SWAP_LE32(data_block(first+temp, 0));
+		if (dblocks > 12) block[12] = SWAP_LE32(data_block(first+12, 0));
+		if (dblocks > 12+idx)
+			block[13] = SWAP_LE32(data_block(first+13+idx, 0));
+		if (dblocks > 12+idx+idx*idx)
+			block[14] = SWAP_LE32(data_block(first+14+idx+idx*(idx+1), 0));
 	}
+
 	// TODO :  S_ISREG/DIR/CHR/BLK/FIFO/LNK/SOCK(m)
-	in->mode = SWAP_LE32(that->st.st_mode);
+	in->mode = SWAP_LE16(that->mode);
 
-	in->uid = SWAP_LE16(that->st.st_uid & 0xFFFF);
-	in->uid_high = SWAP_LE16(that->st.st_uid >> 16);
-	in->gid = SWAP_LE16(that->st.st_gid & 0xFFFF);
-	in->gid_high = SWAP_LE16(that->st.st_gid >> 16);
-	in->size = SWAP_LE32(that->st.st_size & 0xFFFFFFFF);
+	in->uid = SWAP_LE16(that->st->st_uid & 0xFFFF);
+	in->uid_high = SWAP_LE16(that->st->st_uid >> 16);
+	in->gid = SWAP_LE16(that->st->st_gid & 0xFFFF);
+	in->gid_high = SWAP_LE16(that->st->st_gid >> 16);
+	in->size = SWAP_LE32(that->st->st_size & 0xFFFFFFFF);
 
 	// Contortions to make the compiler not generate a warning for x>>32
 	// when x is 32 bits.  The optimizer should clean this up.
-	if (sizeof(that->st.st_size) > 4) temp = 32;
+	if (sizeof(that->st->st_size) > 4) temp = 32;
 	else temp = 0;
-	if (temp) in->dir_acl = SWAP_LE32(that->st.st_size >> temp);
-	
-	in->atime = SWAP_LE32(that->st.st_atime);
-	in->ctime = SWAP_LE32(that->st.st_ctime);
-	in->mtime = SWAP_LE32(that->st.st_mtime);
-
-	in->links_count = SWAP_LE16(that->st.st_nlink);
-	in->blocks = SWAP_LE32(that->st.st_blocks);
+	if (temp) in->dir_acl = SWAP_LE32(that->st->st_size >> temp);
+
+	in->atime = SWAP_LE32(that->st->st_atime);
+	in->ctime = SWAP_LE32(that->st->st_ctime);
+	in->mtime = SWAP_LE32(that->st->st_mtime);
+
+	in->links_count = SWAP_LE16(that->st->st_nlink);
+	in->blocks = SWAP_LE32(that->st->st_blocks * (TT.blocksize/512));
 	// in->faddr
 }
 
+// Write the group descriptor table.
+static void put_group_table(char *block, uint16_t *dirs)
+{
+	struct ext2_group *bg = (struct ext2_group *)block;
+	uint32_t j, used, temp, inodes = INODES_RESERVED + TT.treeinodes;
+	int slot;
+
+	for (j=0; j<TT.groups; j++) {
+
+		// Find next array slot in this block (flush block if full).
+		slot = j % (TT.blocksize/sizeof(struct ext2_group));
+		if (!slot) {
+			if (j) put_data(bg, TT.blocksize);
+			memset(bg, 0, TT.blocksize);
+		}
+
+		// How many free inodes and blocks in this group?
+		temp = j*TT.inodespg;
+		temp = inodes < temp ? 0 : inodes - temp;
+		if (temp > TT.inodespg) temp = TT.inodespg;
+		bg[slot].free_inodes_count = SWAP_LE16(TT.inodespg - temp);
+		temp = TT.datastart[j+1] - TT.datastart[j] - group_used(j);
+		bg[slot].free_blocks_count = SWAP_LE16(temp);
+
+		// Fill out rest of group structure
+		used = group_start(j) + group_superblock_overhead(j);
+		bg[slot].block_bitmap = SWAP_LE32(used++);
+		bg[slot].inode_bitmap = SWAP_LE32(used++);
+		bg[slot].inode_table = SWAP_LE32(used);
+		bg[slot].used_dirs_count = SWAP_LE16(dirs[j]);
+	}
+	put_data(bg, TT.blocksize);
+}
+
+// What one populate_work() is writing.
+struct populate {
+	struct dirtree *dt;
+	char *data;            // Contents to write (NULL to copy from fd)
+	int fd;
+	uint32_t first;        // Start of its blocks in data space
+	uint32_t pos;          // Position of next block in that run
+	uint32_t dblocks;      // Number of data blocks
+	uint32_t next;         // Next data block to write
+	uint32_t *index[3];    // Index block being filled out at each level
+	char *buf;             // For copying without copy_file_range()
+	char path[PATH_MAX];
+};
+
+// Copy count data blocks of the file to block "to" in the image.
+static void populate_copy(struct populate *pp, uint32_t to, uint32_t count)
+{
+	off_t from = pp->next*(off_t)TT.blocksize, dest = to*(off_t)TT.blocksize,
+		len = count*(off_t)TT.blocksize;
+
+	if (pp->data) {
+		write_at(pp->data+from, dest, len);
+		return;
+	}
+
+	// Let the kernel copy it (maybe by sharing extents) unless we need our
+	// own aligned buffer for O_DIRECT.
+	while (len > 0) {
+		ssize_t got, out;
+
+		if (!TT.align && !TT.nocopy) {
+			got = copy_file_range(pp->fd, &from, TT.fsfd, &dest, len, 0);
+			if (got > 0) len -= got;
+			if (got >= 0) {
+				if (!got) break;
+				continue;
+			}
+			if (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+				&& errno != EOPNOTSUPP)
+			{
+				perror_msg("%s", pp->path);
+				break;
+			}
+			TT.nocopy++;
+		}
+		if (!pp->buf) pp->buf = block_alloc(MKE2FS_COPY);
+		got = pread(pp->fd, pp->buf, len < MKE2FS_COPY ? len : MKE2FS_COPY, from);
+		if (got < 0) perror_msg("%s", pp->path);
+		if (got < 1) break;
+
+		// Pad the end of the file out to a whole block.
+		out = (got + TT.blocksize-1) & ~(TT.blocksize-1);
+		memset(pp->buf+got, 0, out-got);
+		write_at(pp->buf, dest, out);
+		from += got;
+		dest += out;
+		len -= out;
+	}
+}
+
+// Write up to count data blocks at the current position in the run.
+static void populate_data(struct populate *pp, uint32_t count)
+{
+	if (count > pp->dblocks - pp->next) count = pp->dblocks - pp->next;
+	while (count) {
+		uint32_t run, to = data_block(pp->first + pp->pos, &run);
+
+		if (run > count) run = count;
+		populate_copy(pp, to, run);
+		pp->next += run;
+		pp->pos += run;
+		count -= run;
+	}
+}
+
+// Write an index block with this many levels of indirection at the current
+// position in the run, followed by everything it points to.  Returns where
+// the index block went.
+static uint32_t populate_index(struct populate *pp, int level)
+{
+	uint32_t *index = pp->index[level-1], idx = TT.blocksize/4,
+		here = data_block(pp->first + pp->pos++, 0), block = 0, run = 0, i;
+
+	memset(index, 0, TT.blocksize);
+	if (level == 1) {
+		uint32_t count = pp->dblocks - pp->next;
+
+		if (count > idx) count = idx;
+		for (i = 0; i < count; i++, run--) {
+			if (!run) block = data_block(pp->first + pp->pos + i, &run);
+			index[i] = SWAP_LE32(block++);
+		}
+		populate_data(pp, count);
+	} else for (i = 0; i < idx && pp->next < pp->dblocks; i++)
+		index[i] = SWAP_LE32(populate_index(pp, level-1));
+	write_at((char *)index, here*(off_t)TT.blocksize, TT.blocksize);
+
+	return here;
+}
+
+// Write an inode's data (and index) blocks into the space allocated to it.
+// Directory contents are generated, and files copied from the gen tree.
+static void populate_work(void *arg, long i)
+{
+	struct populate *pp;
+	struct dirtree *dt = TT.inode[i];
+	int level;
+
+	if (!dt->st->st_blocks) return;
+	pp = xzalloc(sizeof(struct populate));
+	pp->dt = dt;
+	pp->first = dt->st->st_dev;
+	pp->dblocks = (dt->st->st_size+(TT.blocksize-1))/TT.blocksize;
+	pp->fd = -1;
+	if (S_ISDIR(dt->mode)) {
+		pp->data = block_alloc(dt->st->st_size);
+		memset(pp->data, 0, dt->st->st_size);
+		dir_pack(dt, pp->data);
+	} else {
+		int dirfd = node_path(dt, pp->path);
+
+		if (S_ISLNK(dt->mode)) {
+			pp->data = block_alloc(pp->dblocks*TT.blocksize);
+			memset(pp->data, 0, pp->dblocks*TT.blocksize);
+			if (dt->st->st_size
+				!= readlinkat(dirfd, pp->path, pp->data, dt->st->st_size))
+			{
+				perror_msg("%s", pp->path);
+			}
+		} else if (-1 == (pp->fd = openat(dirfd, pp->path, O_RDONLY))) {
+			perror_msg("%s", pp->path);
+			toys.exitval = 1;
+		}
+		if (dirfd != AT_FDCWD) close(dirfd);
+	}
+
+	// With extents the data is one run, and the extent tree goes after it.
+	if (EXTENTS && (pp->data || pp->fd != -1)) {
+		uint32_t root[15], count, j;
+		char *tree;
+
+		populate_data(pp, pp->dblocks);
+		if ((tree = extent_tree(dt, root))) {
+			count = dt->st->st_blocks - pp->dblocks;
+			for (j = 0; j < count; j++)
+				write_at(tree + j*TT.blocksize,
+					data_block(pp->first+pp->pos+j, 0)*(off_t)TT.blocksize,
+					TT.blocksize);
+			free(tree);
+		}
+	} else if (pp->data || pp->fd != -1) {
+		populate_data(pp, 12);
+		for (level = 1; level < 4 && pp->next < pp->dblocks; level++) {
+			if (!pp->index[0]) {
+				pp->index[0] = block_alloc(3*TT.blocksize);
+				pp->index[1] = pp->index[0] + TT.blocksize/4;
+				pp->index[2] = pp->index[1] + TT.blocksize/4;
+			}
+			populate_index(pp, level);
+		}
+	}
+
+	if (pp->fd != -1) close(pp->fd);
+	free(pp->data);
+	free(pp->index[0]);
+	free(pp->buf);
+	free(pp);
+}
+
 // Works like an archiver.
 // The first argument is the name of the file to create.  If it already
 // exists, that size will be used.
@@ -441,222 +1140,242 @@ void mke2fs_main(void)
 {
 	int i, temp;
 	off_t length;
-	uint32_t usedblocks, usedinodes, dtiblk, dtbblk;
-	struct dirtree *dti, *dtb;
+	struct stat st;
+	struct dirtree *dtb, *dt = 0;
+	uint16_t *dirs;
+	char *block;
 
 	// Handle command line arguments.
 
-	if (toys.optargs[1]) {
-		sscanf(toys.optargs[1], "%u", &TT.blocks);
-		temp = O_RDWR|O_CREAT;
-	} else temp = O_RDWR;
+	temp = O_RDWR;
+	if (toys.optargs[1]) sscanf(toys.optargs[1], "%u", &TT.blocks);
+	if (toys.optargs[1] || TT.gendir) temp |= O_CREAT;
 	if (!TT.reserved_percent) TT.reserved_percent = 5;
+	if (!TT.jobs) TT.jobs = thread_count();
+
+	// Option flags start with the defaults, then -O turns them on and off.
+	TT.feature[1] = EXT2_FEATURE_INCOMPAT_FILETYPE;
+	TT.feature[2] = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+	if (TT.features) {
+		char *opt, *save = 0, *opts = xstrdup(TT.features);
+		int count = sizeof(features)/sizeof(*features);
+
+		for (opt = strtok_r(opts, ",", &save); opt;
+			opt = strtok_r(0, ",", &save))
+		{
+			int off = *opt == '^';
+
+			if (!strcmp(opt, "none")) {
+				memset(TT.feature, 0, sizeof(TT.feature));
+				continue;
+			}
+			for (i = 0; i < count; i++)
+				if (!strcmp(opt+off, features[i].name)) break;
+			if (i == count) error_exit("bad -O '%s'", opt);
+			if (off) TT.feature[features[i].which] &= ~features[i].flag;
+			else TT.feature[features[i].which] |= features[i].flag;
+		}
+		free(opts);
+	}
 
 	// TODO: Check if filesystem is mounted here
 
 	// For mke?fs, open file.  For gene?fs, create file.
 	TT.fsfd = xcreate(*toys.optargs, temp, 0777);
-	
+
 	// Determine appropriate block size and block count from file length.
 	// (If no length, default to 4k.  They can override it on the cmdline.)
 
 	length = fdlength(TT.fsfd);
+
+	// Set up the writer.  Anything already there that we'd write zeroes over
+	// has to be zeroed, but holes past the end are free.  O_DIRECT needs
+	// writes aligned to the device's sectors (or the file's blocks).
+	if (-1 == lseek(TT.fsfd, 0, SEEK_CUR)) error_exit("not seekable");
+	TT.oldlen = length;
+	if (toys.optflags & FLAG_D) {
+		if (fstat(TT.fsfd, &st)) perror_exit("%s", *toys.optargs);
+		if (!S_ISBLK(st.st_mode) || ioctl(TT.fsfd, BLKSSZGET, &TT.align))
+			TT.align = st.st_blksize;
+		if (fcntl(TT.fsfd, F_SETFL, fcntl(TT.fsfd, F_GETFL) | O_DIRECT))
+			perror_exit("O_DIRECT");
+	}
+	TT.buf = block_alloc(MKE2FS_BUF);
+
 	if (!TT.blocksize) TT.blocksize = (length && length < 1<<29) ? 1024 : 4096;
 	TT.blockbits = 8*TT.blocksize;
+	TT.firstblock = TT.blocksize == 1024;
 	if (!TT.blocks) TT.blocks = length/TT.blocksize;
+	block = block_alloc(TT.blocksize);
 
-	// Collect gene2fs list or lost+found, calculate requirements.
+	// Collect gene2fs list, and add root directory and lost+found.  The
+	// root directory is the top of the tree, but has no name.
 
+	dtb = dirtree_new(&TT.tree, "", 0);
+	dtb->mode = dtb->st->st_mode = S_IFDIR|0755;
+	dtb->st->st_ctime = dtb->st->st_mtime = dtb->st->st_atime = time(NULL);
 	if (TT.gendir) {
+		if (stat(TT.gendir, dtb->st)) perror_exit("%s", TT.gendir);
+		dtb->mode = dtb->st->st_mode;
 		strncpy(toybuf, TT.gendir, sizeof(toybuf));
-		dti = dirtree_read(toybuf, NULL, NULL);
-	} else {
-		dti = xzalloc(sizeof(struct dirtree)+11);
-		strcpy(dti->name, "lost+found");
-		dti->st.st_mode = S_IFDIR|0755;
-		dti->st.st_ctime = dti->st.st_mtime = time(NULL);
+		dtb->child = dirtree_parallel(toybuf, dtb, &TT.tree, 0, TT.jobs, NULL);
+		for (dt = dtb->child; dt; dt = dt->next)
+			if (!strcmp(dt->name, "lost+found")) break;
+	}
+	if (!dt) {
+		dt = dirtree_new(&TT.tree, "lost+found", 0);
+		dt->mode = dt->st->st_mode = S_IFDIR|0700;
+		dt->st->st_ctime = dt->st->st_mtime = dt->st->st_atime = time(NULL);
+		dt->parent = dtb;
+		dt->next = dtb->child;
+		dtb->child = dt;
 	}
 
-	// Add root directory inode.  This is iterated through for when finding
-	// blocks, but not when finding inodes.  The tree's parent pointers don't
-	// point back into this.
-
-	dtb = xzalloc(sizeof(struct dirtree)+1);
-	dtb->st.st_mode = S_IFDIR|0755;
-	dtb->st.st_ctime = dtb->st.st_mtime = time(NULL);
-	dtb->child = dti;
-	
 	// Figure out how much space is used by preset files
-	length = check_treesize(dtb, &(dtb->st.st_size));
 	check_treelinks(dtb);
+	check_treesize();
 
 	// Figure out how many total inodes we need.
 
 	if (!TT.inodes) {
 		if (!TT.bytes_per_inode) TT.bytes_per_inode = 8192;
 		TT.inodes = (TT.blocks * (uint64_t)TT.blocksize) / TT.bytes_per_inode;
+		if (TT.inodes < INODES_RESERVED+TT.treeinodes)
+			TT.inodes = INODES_RESERVED+TT.treeinodes;
 	}
 
 	// If we're generating a filesystem and have no idea how many blocks it
 	// needs, start with a minimal guess, find the overhead of that many
 	// groups, and loop until this is enough groups to store this many blocks.
 	if (!TT.blocks) TT.groups = (TT.treeblocks/TT.blockbits)+1;
-	else TT.groups = div_round_up(TT.blocks, TT.blockbits);
+	else if (TT.blocks > TT.firstblock)
+		TT.groups = div_round_up(TT.blocks-TT.firstblock, TT.blockbits);
 
 	for (;;) {
-		temp = TT.treeblocks;
+		if (!TT.groups) error_exit("Not enough space.\n");
+		TT.inodespg = get_inodespg(TT.inodes);
+		TT.itable = (TT.inodespg*sizeof(struct ext2_inode))/TT.blocksize;
+		if (TT.inodespg > TT.blockbits) {
+			if (TT.blocks) error_exit("Too many inodes.\n");
+			TT.groups++;
+			continue;
+		}
+
+		// A last group too small to hold its own overhead gets dropped.
+		if (TT.blocks) {
+			temp = TT.groups-1;
+			if (group_size(temp) <= group_overhead(temp)) {
+				TT.blocks = group_start(temp);
+				TT.groups--;
+				continue;
+			}
+		}
+
+		// Allocate the tree's blocks.  Where extents break depends on where
+		// the groups start, so redo it for each try.
+		TT.datastart = xrealloc(TT.datastart, (TT.groups+1)*sizeof(unsigned));
+		find_datastart();
+		allocate_tree();
 
+		temp = TT.firstblock + TT.treeblocks;
 		for (i = 0; i<TT.groups; i++) temp += group_overhead(i);
 
 		if (TT.blocks) {
 			if (TT.blocks < temp) error_exit("Not enough space.\n");
 			break;
 		}
-		if (temp <= TT.groups * TT.blockbits) {
+		if (temp <= group_start(TT.groups)) {
 			TT.blocks = temp;
 			break;
 		}
 		TT.groups++;
 	}
-	TT.freeblocks = TT.blocks - temp;
+
+	// Find where the last group ends, now that the layout is final.  (The
+	// tree's blocks all fit before it, so they don't move.)
+	find_datastart();
+	TT.freeblocks = TT.datastart[TT.groups] - TT.treeblocks;
+	if (TT.inodes > TT.inodespg*TT.groups && (toys.optflags & FLAG_N))
+		error_exit("Not enough inodes.\n");
+	dirs = xzalloc(TT.groups*sizeof(uint16_t));
+	for (i = 0; i <= TT.treeinodes; i++)
+		if (S_ISDIR(TT.inode[i]->mode))
+			dirs[(TT.inode[i]->st->st_ino-1)/TT.inodespg]++;
 
 	// Now we know all the TT data, initialize superblock structure.
 
 	init_superblock(&TT.sb);
 
 	// Start writing.  Skip the first 1k to avoid the boot sector (if any).
-	put_zeroes(1024);
+	TT.pos = TT.holepos = 1024;
 
-	// Loop through block groups, write out each one.
-	dtiblk = dtbblk = usedblocks = usedinodes = 0;
+	// Loop through block groups, write out each one's metadata, leaving its
+	// data blocks to fill in afterwards.
 	for (i=0; i<TT.groups; i++) {
-		struct ext2_inode *in = (struct ext2_inode *)toybuf;
-		uint32_t start, itable, used, end;
-		int j, slot;
-
-		// Where does this group end?
-		end = TT.blockbits;
-		if ((i+1)*TT.blockbits > TT.blocks) end = TT.blocks & (TT.blockbits-1);
-
-		// Blocks used by inode table
-		itable = (TT.inodespg*sizeof(struct ext2_inode))/TT.blocksize;
+		struct ext2_inode *in = (struct ext2_inode *)block;
+		uint32_t end = group_size(i), j;
+		int slot;
 
 		// If a superblock goes here, write it out.
-		start = group_superblock_overhead(i);
-		if (start) {
-			struct ext2_group *bg = (struct ext2_group *)toybuf;
-			int treeblocks = TT.treeblocks, treeinodes = TT.treeinodes;
-
+		if (group_superblock_overhead(i)) {
 			TT.sb.block_group_nr = SWAP_LE16(i);
 
 			// Write superblock and pad it up to block size
-			xwrite(TT.fsfd, &TT.sb, sizeof(struct ext2_superblock));
+			put_data(&TT.sb, sizeof(struct ext2_superblock));
 			temp = TT.blocksize - sizeof(struct ext2_superblock);
 			if (!i && TT.blocksize > 1024) temp -= 1024;
-			memset(toybuf, 0, TT.blocksize);
-			xwrite(TT.fsfd, toybuf, temp);
-
-			// Loop through groups to write group descriptor table.
-			for(j=0; j<TT.groups; j++) {
-
-				// Figure out what sector this group starts in.
-				used = group_superblock_overhead(j);
-
-				// Find next array slot in this block (flush block if full).
-				slot = j % (TT.blocksize/sizeof(struct ext2_group));
-				if (!slot) {
-					if (j) xwrite(TT.fsfd, bg, TT.blocksize);
-					memset(bg, 0, TT.blocksize);
-				}
-
-				// How many free inodes in this group?
-				temp = TT.inodespg;
-				if (!i) temp -= INODES_RESERVED;
-				if (temp > treeinodes) {
-					treeinodes -= temp;
-					temp = 0;
-				} else {
-					temp -= treeinodes;
-					treeinodes = 0;
-				}
-				bg[slot].free_inodes_count = SWAP_LE16(temp);
-
-				// How many free blocks in this group?
-				temp = TT.inodespg/(TT.blocksize/sizeof(struct ext2_inode)) + 2;
-				temp = end-used-temp;
-				if (temp > treeblocks) {
-					treeblocks -= temp;
-					temp = 0;
-				} else {
-					temp -= treeblocks;
-					treeblocks = 0;
-				}
-				bg[slot].free_blocks_count = SWAP_LE32(temp);
-
-				// Fill out rest of group structure
-				used += j*TT.blockbits;
-				bg[slot].block_bitmap = SWAP_LE32(used++);
-				bg[slot].inode_bitmap = SWAP_LE32(used++);
-				bg[slot].inode_table = SWAP_LE32(used);
-				bg[slot].used_dirs_count = 0;  // (TODO)
-			}
-			xwrite(TT.fsfd, bg, TT.blocksize);
+			put_zeroes(temp);
+
+			put_group_table(block, dirs);
 		}
 
 		// Now write out stuff that every block group has.
 
 		// Write block usage bitmap
-
-		start += 2 + itable;
-		memset(toybuf, 0, TT.blocksize);
-		bits_set(toybuf, 0, start);
-		bits_set(toybuf, end, TT.blockbits-end);
-		temp = TT.treeblocks - usedblocks;
-		if (temp) {
-			if (end-start > temp) temp = end-start;
-			bits_set(toybuf, start, temp);
-		}
-		xwrite(TT.fsfd, toybuf, TT.blocksize);
+		memset(block, 0, TT.blocksize);
+		bits_set(block, 0, group_overhead(i) + group_used(i));
+		bits_set(block, end, TT.blockbits-end);
+		put_data(block, TT.blocksize);
 
 		// Write inode bitmap
-		memset(toybuf, 0, TT.blocksize);
-		j = 0;
-		if (!i) bits_set(toybuf, 0, j = INODES_RESERVED);
-		bits_set(toybuf, TT.inodespg, slot = TT.blockbits-TT.inodespg);
-		temp = TT.treeinodes - usedinodes;
-		if (temp) {
-			if (slot-j > temp) temp = slot-j;
-			bits_set(toybuf, j, temp);
-		}
-		xwrite(TT.fsfd, toybuf, TT.blocksize);
-
-		// Write inode table for this group (TODO)
+		memset(block, 0, TT.blocksize);
+		temp = INODES_RESERVED + TT.treeinodes - i*TT.inodespg;
+		if (temp > 0) bits_set(block, 0, temp < TT.inodespg ? temp : TT.inodespg);
+		bits_set(block, TT.inodespg, TT.blockbits-TT.inodespg);
+		put_data(block, TT.blocksize);
+
+		// Write inode table for this group.  (Unused parts are zero, so
+		// become holes.)
 		for (j = 0; j<TT.inodespg; j++) {
 			slot = j % (TT.blocksize/sizeof(struct ext2_inode));
 			if (!slot) {
-				if (j) xwrite(TT.fsfd, in, TT.blocksize);
+				if (j) put_data(in, TT.blocksize);
 				memset(in, 0, TT.blocksize);
 			}
-			if (!i && j<INODES_RESERVED) {
-				// Write root inode
-				if (j == 2) fill_inode(in+slot, dtb);
-			} else if (dti) {
-				fill_inode(in+slot, dti);
-				dti = treenext(dti);
-			}
-		}
-		xwrite(TT.fsfd, in, TT.blocksize);
-
-		while (dtb) {
-			// TODO write index data block
-			// TODO write root directory data block
-			// TODO write directory data block
-			// TODO write file data block
-			put_zeroes(TT.blocksize);
-			start++;
-			if (start == end) break;
+			if ((dt = find_inode(i*TT.inodespg+j+1))) fill_inode(in+slot, dt);
 		}
-		// Write data blocks (TODO)
-		put_zeroes((end-start) * TT.blocksize);
+		put_data(in, TT.blocksize);
+
+		// Data blocks
+		skip_data((end-group_overhead(i)) * (off_t)TT.blocksize);
+	}
+	finish_image();
+
+	// Fill in the data blocks, several files at once.  Their blocks are
+	// already allocated, so each one can go straight to its place.  (If
+	// O_DIRECT can't do whole blocks, skip it: toggling it isn't thread safe.)
+	if (TT.align && (TT.blocksize % TT.align)) {
+		fcntl(TT.fsfd, F_SETFL, fcntl(TT.fsfd, F_GETFL) & ~O_DIRECT);
+		TT.align = 0;
+	}
+	thread_loop(TT.jobs, TT.treeinodes+1, 0, populate_work, 0);
+
+	if (CFG_TOYBOX_FREE) {
+		free(TT.buf);
+		free(block);
+		free(dirs);
+		free(TT.inode);
+		free(TT.datastart);
+		dirtree_free(&TT.tree);
 	}
 }
@@ -18,27 +18,30 @@
  *
  * -E remove empty files --remove-empty-files
  * -f force (no questions asked)
- * -F fuzz (number, default 2)
  * [file] which file to patch
 
-USE_PATCH(NEWTOY(patch, "up#i:R", TOYFLAG_USR|TOYFLAG_BIN))
+USE_PATCH(NEWTOY(patch, USE_TOYBOX_THREADS("j#") "F#up#i:R", TOYFLAG_USR|TOYFLAG_BIN))
 
 config PATCH
 	bool "patch"
 	default y
 	help
-	  usage: patch [-i file] [-p depth] [-Ru]
+	  usage: patch [-i file] [-p depth] [-F fuzz] [-j N] [-Ru]
 
 	  Apply a unified diff to one or more files.
 
 	  -i	Input file (defaults=stdin)
 	  -p	number of '/' to strip from start of file paths (default=all)
+	  -F	Context lines a hunk may ignore at each end (fuzz, default=2)
+	  -j	Patch N files at once (default=1, 0=one per processor)
 	  -R	Reverse patch.
 	  -u	Ignored (only handles "unified" diffs)
 
 	  This version of patch only handles unified diffs, and only modifies
 	  a file when all all hunks to that file apply.  Patch prints failed
 	  hunks to stderr, and exits with nonzero status if any hunks fail.
+	  Hunks are searched for starting at the line number the diff says,
+	  adjusted by however far off the previous hunk was.
 
 	  A file compared against /dev/null (or with a date <= the epoch) is
 	  created/deleted as appropriate.
@@ -49,161 +52,450 @@ config PATCH
 DEFINE_GLOBALS(
 	char *infile;
 	long prefix;
+	long fuzz;
+	long jobs;
 
-	struct double_list *current_hunk;
-	long oldline, oldlen, newline, newlen, linenum;
-	int context, state, filein, fileout, filepatch, hunknum;
-	char *tempname;
+	char *patch;
+	long patchlen, patchsize;
 )
 
 #define TT this.patch
 
 #define FLAG_REVERSE 1
 #define FLAG_PATHLEN 4
+#define FLAG_FUZZ 16
+#define FLAG_JOBS 32
+
+#define PATCH_IOV 1024
+
+// A hunk, with its lines (each starting with ' ', '+', or '-') pointing into
+// the patch.  A hunk that got cut off partway through is bad.
+
+struct patch_hunk {
+	struct patch_hunk *next;
+	long oldline, oldlen, newline, newlen;
+	int context, count, bad;
+	char *line[];
+};
+
+// Output for a file, saved until everything before it has been reported.
+
+struct patch_msg {
+	struct patch_msg *next;
+	int fd;
+	char text[];
+};
+
+// One file's worth of the patch, and the state of patching it.  The old file
+// is mmap()ed and indexed by line.  Lines before pos have been written out,
+// offset is how far from where the diff said the last hunk turned up.
+
+struct patch_file {
+	struct patch_file *next;
+	char *name;
+	int create, delete, failed;
+	struct patch_hunk *hunks;
+	struct patch_msg *msgs, **lastmsg;
+
+	int filein, fileout, err;  // err: errno of first failed write to fileout
+	char *tempname, *map;
+	long mapsize, lines, pos, offset, *start;
+	unsigned *hash;
+	struct iovec *iov;
+	int iovs;
+};
+
+// Queue up a message to print when it's this file's turn.
+
+static void patch_say(struct patch_file *pf, int fd, char *fmt, ...)
+{
+	struct patch_msg *msg;
+	va_list va, va2;
+	int len;
+
+	va_start(va, fmt);
+	va_copy(va2, va);
+	len = vsnprintf(0, 0, fmt, va);
+	va_end(va);
+	msg = xmalloc(sizeof(struct patch_msg)+len+1);
+	vsprintf(msg->text, fmt, va2);
+	va_end(va2);
+
+	msg->fd = fd;
+	msg->next = NULL;
+	*pf->lastmsg = msg;
+	pf->lastmsg = &msg->next;
+}
+
+static unsigned hash_line(char *s, long len)
+{
+	unsigned hash = 5381;
+
+	while (len--) hash = hash*33 + *(unsigned char *)s++;
+
+	return hash;
+}
 
-// Dispose of a line of input, either by writing it out or discarding it.
+// Length of a line of the old file, not counting the newline.
+static long line_len(struct patch_file *pf, long i)
+{
+	long len = pf->start[i+1]-pf->start[i];
+
+	return len - (len && pf->map[pf->start[i+1]-1] == '\n');
+}
 
-// state < 2: just free
-// state = 2: write whole line to stderr
-// state = 3: write whole line to fileout
-// state > 3: write line+1 to fileout when *line != state
+// Map the file we're patching and hash each line, so finding a hunk doesn't
+// have to reread and strcmp() it.
 
-static void do_line(void *data)
+static int load_oldfile(struct patch_file *pf)
 {
-	struct double_list *dlist = (struct double_list *)data;
+	struct stat st;
+	char *s, *end;
+
+	if (fstat(pf->filein, &st)) return 1;
+	if ((pf->mapsize = st.st_size)) {
+		pf->map = mmap(0, pf->mapsize, PROT_READ, MAP_PRIVATE, pf->filein, 0);
+		if (pf->map == MAP_FAILED) {
+			pf->map = NULL;
+			return 1;
+		}
+	}
+
+	end = pf->map + pf->mapsize;
+	for (s = pf->map; s < end; pf->lines++)
+		s = (s = memchr(s, '\n', end-s)) ? s+1 : end;
+	pf->start = xmalloc((pf->lines+1)*sizeof(long));
+	pf->hash = xmalloc((pf->lines+1)*sizeof(unsigned));
+	pf->iov = xmalloc(PATCH_IOV*sizeof(struct iovec));
 
-	if (TT.state>1 && *dlist->data != TT.state)
-		fdprintf(TT.state == 2 ? 2 : TT.fileout,
-			"%s\n", dlist->data+(TT.state>3 ? 1 : 0));
+	for (s = pf->map, pf->lines = 0; s < end; pf->lines++) {
+		pf->start[pf->lines] = s - pf->map;
+		s = (s = memchr(s, '\n', end-s)) ? s+1 : end;
+	}
+	pf->start[pf->lines] = pf->mapsize;
+	for (pf->pos = 0; pf->pos < pf->lines; pf->pos++)
+		pf->hash[pf->pos] = hash_line(pf->map+pf->start[pf->pos],
+			line_len(pf, pf->pos));
+	pf->pos = 0;
 
-	free(dlist->data);
-	free(data);
+	return 0;
 }
 
-static void finish_oldfile(void)
+static void unload_oldfile(struct patch_file *pf)
 {
-	if (TT.tempname) replace_tempfile(TT.filein, TT.fileout, &TT.tempname);
-	TT.fileout = TT.filein = -1;
+	if (pf->map) munmap(pf->map, pf->mapsize);
+	free(pf->start);
+	free(pf->hash);
+	free(pf->iov);
+	pf->map = NULL;
+	pf->start = NULL;
+	pf->hash = NULL;
+	pf->iov = NULL;
 }
 
-static void fail_hunk(void)
+// Queue up data to write to the new file.  Since it points into the map and
+// the patch, flush before the map goes away.  A write error is saved for
+// finish_oldfile() to report, since worker threads can't exit.
+
+static void flush_out(struct patch_file *pf)
 {
-	if (!TT.current_hunk) return;
-	TT.current_hunk->prev->next = 0;
+	if (pf->iovs && !pf->err && writevall(pf->fileout, pf->iov, pf->iovs))
+		pf->err = errno;
+	pf->iovs = 0;
+}
 
-	fdprintf(2, "Hunk %d FAILED %ld/%ld.\n", TT.hunknum, TT.oldline, TT.newline);
-	toys.exitval = 1;
+static void emit(struct patch_file *pf, char *data, long len)
+{
+	if (!len) return;
+	pf->iov[pf->iovs].iov_base = data;
+	pf->iov[pf->iovs].iov_len = len;
+	if (++pf->iovs == PATCH_IOV) flush_out(pf);
+}
+
+static void emit_line(struct patch_file *pf, char *data, long len)
+{
+	emit(pf, data, len);
+	emit(pf, "\n", 1);
+}
 
-	// If we got to this point, we've seeked to the end.  Discard changes to
-	// this file and advance to next file.
+// Returns nonzero (with errno set) if the new file couldn't be written.
 
-	TT.state = 2;
-	llist_free(TT.current_hunk, do_line);
-	TT.current_hunk = NULL;
-	delete_tempfile(TT.filein, TT.fileout, &TT.tempname);
-	TT.state = 0;
+static int finish_oldfile(struct patch_file *pf)
+{
+	emit(pf, pf->map+pf->start[pf->pos], pf->mapsize-pf->start[pf->pos]);
+	flush_out(pf);
+	unload_oldfile(pf);
+	if (pf->err) {
+		delete_tempfile(pf->filein, pf->fileout, &pf->tempname);
+		errno = pf->err;
+
+		return 1;
+	}
+	close(pf->filein);
+
+	return replace_tempfile(-1, pf->fileout, &pf->tempname);
 }
 
-static int apply_hunk(void)
+// Print the failed hunk and discard changes to this file.
+
+static void fail_hunk(struct patch_file *pf, struct patch_hunk *hunk, int num)
 {
-	struct double_list *plist, *buf = NULL, *check;
-	int matcheof = 0, reverse = toys.optflags & FLAG_REVERSE, backwarn = 0;
+	int i;
 
-	// Break doubly linked list so we can use singly linked traversal function.
-	TT.current_hunk->prev->next = NULL;
+	patch_say(pf, 2, "Hunk %d FAILED %ld/%ld.\n", num, hunk->oldline,
+		hunk->newline);
+	for (i = 0; i < hunk->count; i++) patch_say(pf, 2, "%s\n", hunk->line[i]);
+	pf->failed++;
+
+	if (pf->tempname) {
+		unload_oldfile(pf);
+		delete_tempfile(pf->filein, pf->fileout, &pf->tempname);
+	}
+}
+
+// Collect the lines of the hunk that should already be in the file (all but
+// the skip type), with lengths and hashes.  Returns how many.
+
+static int hunk_lines(struct patch_hunk *hunk, char skip, char **line,
+	long *len, unsigned *hash)
+{
+	int i, count = 0;
+
+	for (i = 0; i < hunk->count; i++) {
+		if (*hunk->line[i] == skip) continue;
+		line[count] = hunk->line[i]+1;
+		len[count] = strlen(line[count]);
+		hash[count] = hash_line(line[count], len[count]);
+		count++;
+	}
+
+	return count;
+}
+
+// Find count lines in the unwritten part of the file, starting at line want
+// and working outward.  Returns the line they start at, or -1.
+
+static long find_lines(struct patch_file *pf, long want, char **line,
+	long *len, unsigned *hash, int count, int matcheof)
+{
+	long lo = pf->pos, hi = pf->lines-count, dist, pos;
+	int i, j;
+
+	// (A hunk anchored to EOF can't match lines that were already written.)
+	if (matcheof && hi >= lo) lo = hi;
+	if (hi < lo) return -1;
+	if (want < lo) want = lo;
+	if (want > hi) want = hi;
+
+	for (dist = 0; want-dist >= lo || want+dist <= hi; dist++) {
+		for (j = 0; j < 2; j++) {
+			pos = j ? want-dist : want+dist;
+			if ((j && !dist) || pos < lo || pos > hi) continue;
+			for (i = 0; i < count; i++)
+				if (hash[i] != pf->hash[pos+i] || len[i] != line_len(pf, pos+i))
+					break;
+			if (i < count) continue;
+			for (i = 0; i < count; i++)
+				if (memcmp(line[i], pf->map+pf->start[pos+i], len[i])) break;
+			if (i == count) return pos;
+		}
+	}
+
+	return -1;
+}
+
+static int apply_hunk(struct patch_file *pf, struct patch_hunk *hunk, int num)
+{
+	int reverse = toys.optflags & FLAG_REVERSE, count, trail = 0,
+		fuzz, lead, tail, dropped = 0, i, k;
+	long base, pos = -1, *len;
+	char **line;
+	unsigned *hash;
+
+	if (hunk->bad) return 0;
 
 	// Match EOF if there aren't as many ending context lines as beginning
-	for (plist = TT.current_hunk; plist; plist = plist->next) {
-		if (plist->data[0]==' ') matcheof++;
-		else matcheof = 0;
+	for (i = 0; i < hunk->count; i++) {
+		if (*hunk->line[i] == ' ') trail++;
+		else trail = 0;
 	}
-	matcheof = matcheof < TT.context;
-
-	// Loop through input data searching for this hunk.  Match all context
-	// lines and all lines to be removed until we've found the end of a
-	// complete hunk.
-	plist = TT.current_hunk;
-	buf = NULL;
-	if (TT.context) for (;;) {
-		char *data = get_line(TT.filein);
-
-		TT.linenum++;
-
-		// Figure out which line of hunk to compare with next.  (Skip lines
-		// of the hunk we'd be adding.)
-		while (plist && *plist->data == "+-"[reverse]) {
-			if (data && !strcmp(data, plist->data+1)) {
-				if (!backwarn) {
-					fdprintf(2,"Possibly reversed hunk %d at %ld\n",
-						TT.hunknum, TT.linenum);
-					backwarn++;
-				}
-			}
-			plist = plist->next;
+
+	count = hunk->count;
+	line = xmalloc(count*(sizeof(char *)+sizeof(long)+sizeof(unsigned)));
+	len = (long *)(line+count);
+	hash = (unsigned *)(len+count);
+	count = hunk_lines(hunk, "+-"[reverse], line, len, hash);
+
+	// Where the diff says the hunk goes (a hunk with no old lines goes after
+	// the line it names), adjusted by how far off the last hunk was.
+	base = (reverse ? hunk->newline : hunk->oldline) - !!count;
+
+	// Try an exact match first, then drop context lines from each end.
+	for (fuzz = 0; fuzz <= TT.fuzz; fuzz++) {
+		lead = fuzz < hunk->context ? fuzz : hunk->context;
+		tail = fuzz < trail ? fuzz : trail;
+		if (fuzz && (lead+tail == dropped || count-lead-tail < 1)) break;
+		dropped = lead+tail;
+		pos = find_lines(pf, base+pf->offset+lead, line+lead, len+lead,
+			hash+lead, count-lead-tail, !tail && trail < hunk->context);
+		if (pos != -1) break;
+	}
+
+	if (pos == -1) {
+		// Would this hunk apply the other way around?
+		k = hunk_lines(hunk, "-+"[reverse], line, len, hash);
+		pos = find_lines(pf, base+pf->offset, line, len, hash, k, 0);
+		if (pos != -1)
+			patch_say(pf, 2, "Possibly reversed hunk %d at %ld\n", num, pos+1);
+		free(line);
+
+		return 0;
+	}
+	if (fuzz)
+		patch_say(pf, 1, "Hunk %d applied at %ld with fuzz %d.\n", num, pos+1,
+			fuzz);
+
+	// We have a match.  Copy everything up to it, then the hunk, taking the
+	// context from the file (a fuzzed line might not be what the hunk says).
+	emit(pf, pf->map+pf->start[pf->pos], pf->start[pos]-pf->start[pf->pos]);
+	for (i = k = 0; i < hunk->count; i++) {
+		char *s = hunk->line[i];
+
+		if (*s == "+-"[reverse]) emit_line(pf, s+1, strlen(s+1));
+		else {
+			if (*s == ' ' && k >= lead && k < count-tail)
+				emit_line(pf, pf->map+pf->start[pos+k-lead],
+					line_len(pf, pos+k-lead));
+			k++;
 		}
+	}
+	flush_out(pf);
+	pf->pos = pos+count-lead-tail;
+	pf->offset = pos-lead-base;
+	free(line);
 
-		// Is this EOF?
-		if (!data) {
-			// Does this hunk need to match EOF?
-			if (!plist && matcheof) break;
+	return 1;
+}
+
+// Create, delete, or patch one file.  This runs on a worker thread, so it
+// saves its output for patch_done() and doesn't exit on errors (other than
+// running out of memory).
+
+static void patch_work(void *arg, long i)
+{
+	struct patch_file *pf = ((struct patch_file **)arg)[i];
+	struct patch_hunk *hunk;
+	char *s, *name = pf->name, buf[128];
+	int num = 1, err;
+
+	pf->filein = pf->fileout = -1;
+	if (pf->delete) {
+		patch_say(pf, 1, "removing %s\n", name);
+		if (unlink(name)) goto fail;
+
+		return;
+	}
 
-			// File ended before we found a place for this hunk.
-			fail_hunk();
-			goto done;
+	// No file to patch (-p didn't leave a name)?
+	if (!name) {
+		if (pf->hunks) fail_hunk(pf, pf->hunks, num);
+
+		return;
+	}
+
+	if (pf->create) {
+		patch_say(pf, 1, "creating %s\n", name);
+		if ((s = strrchr(name, '/'))) {
+			*s = 0;
+			err = mkpath(name, -1);
+			*s = '/';
+			if (err) goto fail;
 		}
-		check = dlist_add(&buf, data);
-
-		// Compare this line with next expected line of hunk.
-		// todo: teach the strcmp() to ignore whitespace.
-
-		// A match can fail because the next line doesn't match, or because
-		// we hit the end of a hunk that needed EOF, and this isn't EOF.
-
-		// If match failed, flush first line of buffered data and
-		// recheck buffered data for a new match until we find one or run
-		// out of buffer.
-
-		for (;;) {
-			if (!plist || strcmp(check->data, plist->data+1)) {
-				// Match failed.  Write out first line of buffered data and
-				// recheck remaining buffered data for a new match.
-	
-				TT.state = 3;
-				check = llist_pop(&buf);
-				check->prev->next = buf;
-				buf->prev = check->prev;
-				do_line(check);
-				plist = TT.current_hunk;
-
-				// If we've reached the end of the buffer without confirming a
-				// match, read more lines.
-				if (check==buf) {
-					buf = 0;
-					break;
-				}
-				check = buf;
-			} else {
-				// This line matches.  Advance plist, detect successful match.
-				plist = plist->next;
-				if (!plist && !matcheof) goto out;
-				check = check->next;
-				if (check == buf) break;
-			}
+		pf->filein = open(name, O_CREAT|O_EXCL|O_RDWR, 0666);
+	} else {
+		patch_say(pf, 1, "patching %s\n", name);
+		pf->filein = open(name, O_RDWR);
+	}
+	if (pf->filein == -1) goto fail;
+	pf->fileout = copy_tempfile(pf->filein, name, &pf->tempname);
+	if (pf->fileout == -1) {
+		err = errno;
+		close(pf->filein);
+		errno = err;
+		goto fail;
+	}
+	if (load_oldfile(pf)) {
+		err = errno;
+		unload_oldfile(pf);
+		delete_tempfile(pf->filein, pf->fileout, &pf->tempname);
+		errno = err;
+		goto fail;
+	}
+
+	for (hunk = pf->hunks; hunk; hunk = hunk->next, num++) {
+		if (!apply_hunk(pf, hunk, num)) {
+			fail_hunk(pf, hunk, num);
+
+			return;
 		}
 	}
-out:
-	// We have a match.  Emit changed data.
-	TT.state = "-+"[reverse];
-	llist_free(TT.current_hunk, do_line);
-	TT.current_hunk = NULL;
-	TT.state = 1;
-done:
-	if (buf) {
-		buf->prev->next = NULL;
-		llist_free(buf, do_line);
+	if (!finish_oldfile(pf)) return;
+
+fail:
+	// With _GNU_SOURCE (see portability.h), strerror_r() returns the string,
+	// which might not be in buf.
+	patch_say(pf, 2, "%s: %s: %s\n", toys.which->name, name,
+		strerror_r(errno, buf, sizeof(buf)));
+	pf->failed++;
+}
+
+// Print what a file had to say, in the order the files were in the patch.
+
+static void patch_done(void *arg, long i)
+{
+	struct patch_file *pf = ((struct patch_file **)arg)[i];
+
+	while (pf->msgs) {
+		struct patch_msg *msg = pf->msgs;
+
+		if (msg->fd == 2) {
+			fflush(stdout);
+			xwrite(2, msg->text, strlen(msg->text));
+		} else xprintf("%s", msg->text);
+		pf->msgs = msg->next;
+		free(msg);
 	}
+	if (pf->failed) toys.exitval = 1;
 
-	return TT.state;
+	llist_free(pf->hunks, NULL);
+}
+
+// Parse "line,len" from a hunk header (diff leaves off ",1").  Returns the
+// rest of the string, or NULL if it isn't a range.
+
+static char *hunk_range(char *s, long *line, long *len)
+{
+	char *end;
+
+	*line = strtol(s, &end, 10);
+	*len = 1;
+	if (end == s) return NULL;
+	if (*end == ',') {
+		*len = strtol(s = end+1, &end, 10);
+		if (end == s || *len < 0) return NULL;
+	}
+
+	return end;
+}
+
+static void read_patch(void *arg, char *data, size_t len)
+{
+	if (TT.patchlen+len >= TT.patchsize) {
+		TT.patchsize = (TT.patchlen+len)*2+1;
+		TT.patch = xrealloc(TT.patch, TT.patchsize);
+	}
+	memcpy(TT.patch+TT.patchlen, data, len);
+	TT.patchlen += len;
 }
 
 // state 0: Not in a hunk, look for +++.
@@ -213,96 +505,104 @@ done:
 
 void patch_main(void)
 {
-	int reverse = toys.optflags & FLAG_REVERSE, state = 0;
-	char *oldname = NULL, *newname = NULL;
-
-	if (TT.infile) TT.filepatch = xopen(TT.infile, O_RDONLY);
-	TT.filein = TT.fileout = -1;
+	int reverse = toys.optflags & FLAG_REVERSE, state = 0, filepatch = 0,
+		hunknum = 0;
+	char *oldname = NULL, *newname = NULL, *patchline, *next, *end;
+	struct patch_file *files = NULL, *pf = NULL, **list;
+	struct patch_hunk *hunk = NULL, **lasthunk = NULL;
+	long count = 0, linenum = 0, i, j, k;
+
+	if (TT.infile) filepatch = xopen(TT.infile, O_RDONLY);
+	if (!(toys.optflags & FLAG_FUZZ)) TT.fuzz = 2;
+	if (!(toys.optflags & FLAG_JOBS)) TT.jobs = 1;
+	else if (TT.jobs < 1) TT.jobs = thread_count();
+
+	// Read the whole patch and sort it into files and hunks, so the files can
+	// be patched independently.
+	if (loopfd(filepatch, 0, -1, NULL, read_patch) < 0) perror_exit("read");
+	read_patch(NULL, "\n", 1);
+	end = TT.patch + TT.patchlen - 1;
 
 	// Loop through the lines in the patch
-	for(;;) {
-		char *patchline;
-
-		patchline = get_line(TT.filepatch);
-		if (!patchline) break;
-
-		// Other versions of patch accept damaged patches,
-		// so we need to also.
-		if (!*patchline) {
-			free(patchline);
-			patchline = xstrdup(" ");
-		}
+	for (patchline = TT.patch; patchline < end; patchline = next) {
+		next = memchr(patchline, '\n', end+1-patchline);
+		*(next++) = 0;
+		linenum++;
 
 		// Are we assembling a hunk?
 		if (state >= 2) {
+			// Other versions of patch accept damaged patches,
+			// so we need to also.
+			if (!*patchline) patchline = " ";
+
 			if (*patchline==' ' || *patchline=='+' || *patchline=='-') {
-				dlist_add(&TT.current_hunk, patchline);
+				hunk->line[hunk->count++] = patchline;
 
-				if (*patchline != '+') TT.oldlen--;
-				if (*patchline != '-') TT.newlen--;
+				if (*patchline != '+') hunk->oldlen--;
+				if (*patchline != '-') hunk->newlen--;
 
 				// Context line?
-				if (*patchline==' ' && state==2) TT.context++;
+				if (*patchline==' ' && state==2) hunk->context++;
 				else state=3;
 
-				// If we've consumed all expected hunk lines, apply the hunk.
-
-				if (!TT.oldlen && !TT.newlen) state = apply_hunk();
+				// If we've consumed all expected hunk lines, get the next.
+				if (!hunk->oldlen && !hunk->newlen) state = 1;
+				else if (hunk->oldlen < 0 || hunk->newlen < 0) {
+					hunk->bad++;
+					state = 0;
+				}
 				continue;
 			}
-			fail_hunk();
+			hunk->bad++;
 			state = 0;
-			continue;
 		}
 
 		// Open a new file?
 		if (!strncmp("--- ", patchline, 4) || !strncmp("+++ ", patchline, 4)) {
 			char *s, **name = &oldname;
-			int i;
 
 			if (*patchline == '+') {
 				name = &newname;
 				state = 1;
 			}
-
-			free(*name);
-			finish_oldfile();
+			pf = NULL;
 
 			// Trim date from end of filename (if any).  We don't care.
 			for (s = patchline+4; *s && *s!='\t'; s++)
 				if (*s=='\\' && s[1]) s++;
 			i = atoi(s);
-			if (i && i<=1970)
-				*name = xstrdup("/dev/null");
+			if (i && i<=1970) *name = "/dev/null";
 			else {
 				*s = 0;
-				*name = xstrdup(patchline+4);
+				*name = patchline+4;
 			}
 
-			// We defer actually opening the file because svn produces broken
-			// patches that don't signal they want to create a new file the
-			// way the patch man page says, so you have to read the first hunk
-			// and _guess_.
+			// We defer deciding what to do with the file because svn produces
+			// broken patches that don't signal they want to create a new file
+			// the way the patch man page says, so you have to read the first
+			// hunk and _guess_.
 
 		// Start a new hunk?
 		} else if (state == 1 && !strncmp("@@ -", patchline, 4)) {
-			int i;
-
-			i = sscanf(patchline+4, "%ld,%ld +%ld,%ld", &TT.oldline,
-						&TT.oldlen, &TT.newline, &TT.newlen);
-			if (i != 4)
-				error_exit("Corrupt hunk %d at %ld\n", TT.hunknum, TT.linenum);
+			long oldline, oldlen, newline, newlen;
+			char *s;
 
-			TT.context = 0;
-			state = 2;
+			hunknum = pf ? hunknum+1 : 1;
+			if (!(s = hunk_range(patchline+4, &oldline, &oldlen))
+				|| strncmp(s, " +", 2) || !hunk_range(s+2, &newline, &newlen))
+				error_exit("Corrupt hunk %d at %ld", hunknum, linenum);
 
-			// If this is the first hunk, open the file.
-			if (TT.filein == -1) {
-				int oldsum, newsum, del = 0;
+			// If this is the first hunk, figure out which file it's for.
+			if (!pf) {
+				long oldsum = oldline + oldlen, newsum = newline + newlen;
 				char *s, *name;
 
- 				oldsum = TT.oldline + TT.oldlen;
-				newsum = TT.newline + TT.newlen;
+				pf = xzalloc(sizeof(struct patch_file));
+				pf->lastmsg = &pf->msgs;
+				lasthunk = &pf->hunks;
+				pf->next = files;
+				files = pf;
+				count++;
 
 				name = reverse ? oldname : newname;
 
@@ -311,7 +611,7 @@ void patch_main(void)
 				if (!strcmp(name, "/dev/null") || !(reverse ? oldsum : newsum))
 				{
 					name = reverse ? newname : oldname;
-					del++;
+					pf->delete++;
 				}
 
 				// handle -p path truncation.
@@ -323,46 +623,54 @@ void patch_main(void)
 					}
 				}
 
-				if (del) {
-					printf("removing %s\n", name);
-					xunlink(name);
-					state = 0;
-				// If we've got a file to open, do so.
-				} else if (!(toys.optflags & FLAG_PATHLEN) || i <= TT.prefix) {
-					// If the old file was null, we're creating a new one.
-					if (!strcmp(oldname, "/dev/null") || !oldsum) {
-						printf("creating %s\n", name);
-						s = strrchr(name, '/');
-						if (s) {
-							*s = 0;
-							xmkpath(name, -1);
-							*s = '/';
-						}
-						TT.filein = xcreate(name, O_CREAT|O_EXCL|O_RDWR, 0666);
-					} else {
-						printf("patching %s\n", name);
-						TT.filein = xopen(name, O_RDWR);
-					}
-					TT.fileout = copy_tempfile(TT.filein, name, &TT.tempname);
-					TT.linenum = 0;
-					TT.hunknum = 0;
-				}
+				if (pf->delete || !(toys.optflags & FLAG_PATHLEN) || i <= TT.prefix)
+					pf->name = name;
+
+				// If the old file was null, we're creating a new one.
+				if (!strcmp(reverse ? newname : oldname, "/dev/null")
+					|| !(reverse ? newsum : oldsum))
+					pf->create++;
 			}
 
-			TT.hunknum++;
+			if (pf->delete) {
+				state = 0;
+				continue;
+			}
 
-			continue;
+			// Hunks go on the end of the file's list, oldest first.
+			hunk = xzalloc(sizeof(struct patch_hunk)
+				+ (oldlen+newlen)*sizeof(char *));
+			hunk->oldline = oldline;
+			hunk->oldlen = oldlen;
+			hunk->newline = newline;
+			hunk->newlen = newlen;
+			*lasthunk = hunk;
+			lasthunk = &hunk->next;
+			state = oldlen || newlen ? 2 : 1;
 		}
-
-		// If we didn't continue above, discard this line.
-		free(patchline);
 	}
 
-	finish_oldfile();
+	// The files went on the list backwards.
+	list = xmalloc(count*sizeof(struct patch_file *));
+	for (i = count; i--; files = files->next) list[i] = files;
+
+	// Files patched more than once in a row can't be done at the same time,
+	// so they go in separate batches, in order.
+	for (i = 0; i < count; i = j) {
+		for (j = i+1; TT.jobs > 1 && j < count; j++) {
+			for (k = i; k < j; k++)
+				if (list[k]->name && list[j]->name
+					&& !strcmp(list[k]->name, list[j]->name)) break;
+			if (k < j) break;
+		}
+		if (TT.jobs == 1) j = count;
+		thread_loop(TT.jobs, j-i, list+i, patch_work, patch_done);
+	}
 
 	if (CFG_TOYBOX_FREE) {
-		close(TT.filepatch);
-		free(oldname);
-		free(newname);
+		for (i = 0; i < count; i++) free(list[i]);
+		free(list);
+		free(TT.patch);
+		close(filepatch);
 	}
 }
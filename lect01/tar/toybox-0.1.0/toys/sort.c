@@ -6,7 +6,7 @@
  *
  * See http://www.opengroup.org/onlinepubs/007904975/utilities/sort.html
 
-USE_SORT(NEWTOY(sort, USE_SORT_BIG("S:T:m" "o:k*t:bgMcszdfi") "run", TOYFLAG_USR|TOYFLAG_BIN))
+USE_SORT(NEWTOY(sort, USE_SORT_BIG(USE_TOYBOX_THREADS("(parallel)#") "S:T:m" "o:k*t:bgMcszdfi") "run", TOYFLAG_USR|TOYFLAG_BIN))
 
 config SORT
     bool "sort"
@@ -25,7 +25,7 @@ config SORT_BIG
     default y
     depends on SORT
     help
-      usage: sort [-bcdfgiMsz] [-k#[,#[x]] [-t X]] [-o FILE]
+      usage: sort [-bcdfgiMsz] [-k#[,#[x]] [-t X]] [-o FILE] [-S SIZE] [-T DIR]
 
       -b    ignore leading blanks (or trailing blanks in second part of key)
       -c    check whether input is sorted
@@ -39,9 +39,15 @@ config SORT_BIG
       -k    sort by "key" (see below)
       -t    use a key separator other than whitespace
       -o    output to FILE instead of stdout
+      -S    memory to use before sorting in chunks (suffix bKMG or %, default K)
+      -T    directory for temporary files holding those chunks (default /tmp)
+      --parallel=N  sort on N threads (default one per processor)
 
       This version of sort requires floating point.
 
+      Input bigger than -S (default half of physical memory) is sorted
+      in chunks, which are saved to temporary files and merged at the end.
+
       Sorting by key looks at a subset of the words on each line.  -k2
       uses the second word to the end of the line, -k2,2 looks at only
       the second word, -k2,4 looks from the start of the second to the end
@@ -57,15 +63,32 @@ DEFINE_GLOBALS(
     char *key_separator;
     struct arg_list *raw_keys;
     char *outfile;
-    char *ignore1, ignore2;   // GNU compatability NOPs for -S and -T.
+    char *tmpdir;
+    char *bufsize;
+    long parallel;
 
     void *key_list;
-    int linecount;
-    char **lines;
+    int nkeys, linecount, bytesort;
+    struct sort_line **lines;
+    struct arena arena;  // where TT.lines records live
+    struct arena checkarena;
+    struct arena data;   // lines read from pipes
+
+    long budget, used;  // -S in bytes, and how much of it TT.lines uses now
+    int nruns, *runs;   // fds of sorted runs spilled to temp files
+    int outlen;         // bytes waiting in outbuf
+    char *outbuf;
 )
 
 #define TT this.sort
 
+#define SORT_OUTBUF 65536         // output buffer, and smallest run buffer
+#define SORT_RUNBUF_MAX (8<<20)   // biggest read buffer per run in a merge
+#define SORT_FANIN 64             // runs merged at once
+#define SORT_MAXRUNS 256          // runs kept open while reading input
+#define SORT_IOV 1024             // writev() entries, two per line
+#define SORT_READ (1<<20)         // input read from pipes at once
+
 // The sort types are n, g, and M.
 // u, c, s, and z apply to top level only, not to keys.
 // b at top level implies bb.
@@ -96,20 +119,36 @@ struct sort_key
     int flags;
 };
 
-// Copy of the part of this string corresponding to a key/flags.
+// Each line is read once into a record holding its keys, already extracted
+// and converted, so comparisons don't have to.
+struct sort_line {
+    char *line;       // not null terminated
+    int len;
+    struct sort_val {
+        char *str;    // text of an ascii key, after -bdfi
+        double num;   // value of a -n, -g or -M key
+        int len;      // length of str
+        int type;     // -g: 0 not number, 1 NaN, 2 -inf, 3 number, 4 +inf
+    } vals[];         //   -M: 0 not a month, 1 month
+};
+
+// The part of this string corresponding to a key/flags, and its length in
+// *keylen.  Unless that's the whole string, it's a null terminated copy
+// allocated from arena.
 
-static char *get_key_data(char *str, struct sort_key *key, int flags)
+static char *get_key_data(char *str, int len, struct sort_key *key, int flags,
+    struct arena *arena, int *keylen)
 {
-    int start=0, end, len, i, j;
+    int start=0, end, i, j;
 
     // Special case whole string, so we don't have to make a copy
 
+    *keylen = len;
     if(key->range[0]==1 && !key->range[1] && !key->range[2] && !key->range[3]
-        && !(flags&(FLAG_b&FLAG_d&FLAG_f&FLAG_i&FLAG_bb))) return str;
+        && !(flags&(FLAG_b|FLAG_d|FLAG_f|FLAG_i|FLAG_bb))) return str;
 
     // Find start of key on first pass, end on second pass
 
-    len = strlen(str);
     for (j=0; j<2; j++) {
         if (!key->range[2*j]) end=len;
 
@@ -118,12 +157,13 @@ static char *get_key_data(char *str, struct sort_key *key, int flags)
             end=0;
             for (i=1; i < key->range[2*j]+j; i++) {
 
-                // Skip leading blanks
-                if (str[end] && !TT.key_separator)
-                    while (isspace(str[end])) end++;
+                // Skip leading blanks, or the separator ending the last field
+                if (end<len && !TT.key_separator)
+                    while (end<len && isspace(str[end])) end++;
+                else if (i>1 && end<len) end++;
 
                 // Skip body of key
-                for (; str[end]; end++) {
+                for (; end<len; end++) {
                     if (TT.key_separator) {
                         if (str[end]==*TT.key_separator) break;
                     } else if (isspace(str[end])) break;
@@ -134,10 +174,10 @@ static char *get_key_data(char *str, struct sort_key *key, int flags)
     }
 
     // Key with explicit separator starts after the separator
-    if (TT.key_separator && str[start]==*TT.key_separator) start++;
+    if (TT.key_separator && start<len && str[start]==*TT.key_separator) start++;
 
     // Strip leading and trailing whitespace if necessary
-    if (flags&FLAG_b) while (isspace(str[start])) start++;
+    if (flags&FLAG_b) while (start<len && isspace(str[start])) start++;
     if (flags&FLAG_bb) while (end>start && isspace(str[end-1])) end--;
 
     // Handle offsets on start and end
@@ -152,24 +192,27 @@ static char *get_key_data(char *str, struct sort_key *key, int flags)
 
     // Make the copy
     if (end<start) end=start;
-    str = xstrndup(str+start, end-start);
+    len = end-start;
+    str = memcpy(arena_alloc(arena, len+1), str+start, len);
 
     // Handle -d
     if (flags&FLAG_d) {
-        for (start = end = 0; str[end]; end++)
+        for (start = end = 0; end<len; end++)
             if (isspace(str[end]) || isalnum(str[end])) str[start++] = str[end];
-        str[start] = 0;
+        len = start;
     }
 
     // Handle -i
     if (flags&FLAG_i) {
-        for (start = end = 0; str[end]; end++)
+        for (start = end = 0; end<len; end++)
             if (isprint(str[end])) str[start++] = str[end];
-        str[start] = 0;
+        len = start;
     }
 
     // Handle -f
-    if (flags*FLAG_f) for(i=0; str[i]; i++) str[i] = toupper(str[i]);
+    if (flags&FLAG_f) for(i=0; i<len; i++) str[i] = toupper(str[i]);
+
+    str[*keylen = len] = 0;
 
     return str;
 }
@@ -182,136 +225,817 @@ static struct sort_key *add_key(void)
     struct sort_key **pkey = (struct sort_key **)stupid_compiler;
 
     while (*pkey) pkey = &((*pkey)->next_key);
+    TT.nkeys++;
     return *pkey = xzalloc(sizeof(struct sort_key));
 }
 
-// Perform actual comparison
-static int compare_values(int flags, char *x, char *y)
+// Extract and convert each key of a line, into a record allocated from arena.
+static struct sort_line *sort_decorate(char *line, int len,
+    struct arena *arena)
 {
-    int ff = flags & (FLAG_n|FLAG_g|FLAG_M);
+    struct sort_line *rec = arena_alloc(arena,
+        sizeof(struct sort_line)+TT.nkeys*sizeof(struct sort_val));
+    struct sort_val *val = rec->vals;
+    struct sort_key *key;
 
-    // Ascii sort
-    if (!ff) return strcmp(x, y);
+    rec->line = line;
+    rec->len = len;
+    for (key = TT.key_list; key; key = key->next_key, val++) {
+        int flags = key->flags ? key->flags : toys.optflags,
+            ff = flags & (FLAG_n|FLAG_g|FLAG_M);
+        char *x = get_key_data(line, len, key, flags, arena, &val->len), *xx;
 
-    if (CFG_SORT_BIG && ff == FLAG_g) {
-        char *xx,*yy;
-        double dx = strtod(x,&xx), dy = strtod(y,&yy);
-        int xinf, yinf;
+        val->str = x;
+        val->num = val->type = 0;
 
-        // not numbers < NaN < -infinity < numbers < +infinity)
+        // Ascii sort
+        if (!ff) continue;
 
-        if (x==xx) return y==yy ? 0 : -1;
-        if (y==yy) return 1;
+        // The number parsing functions need a null terminated copy.
+        if (x == line) {
+            x = memcpy(arena_alloc(arena, len+1), line, len);
+            x[len] = 0;
+        }
 
-        // Check for isnan
-        if (dx!=dx) return (dy!=dy) ? 0 : -1;
-        if (dy!=dy) return 1;
+        if (CFG_SORT_BIG && ff == FLAG_g) {
+            double dx = strtod(x, &xx);
+
+            // not numbers < NaN < -infinity < numbers < +infinity
+            // (Check for infinity could underflow, but avoids needing libm.)
+            if (x != xx) {
+                if (dx!=dx) val->type = 1;
+                else if (1.0/dx == 0.0) val->type = dx<0 ? 2 : 4;
+                else {
+                    val->type = 3;
+                    val->num = dx;
+                }
+            }
+        } else if (CFG_SORT_BIG && ff == FLAG_M) {
+            struct tm thyme;
 
-        // Check for infinity.  (Could underflow, but avoids needing libm.)
-        xinf = (1.0/dx == 0.0);
-        yinf = (1.0/dy == 0.0);
-        if (xinf) {
-            if(dx<0) return (yinf && dy<0) ? 0 : -1;
-            return (yinf && dy>0) ? 0 : 1;
-        }
-        if (yinf) return dy<0 ? 1 : -1;
-
-        return dx>dy ? 1 : (dx<dy ? -1 : 0);
-    } else if (CFG_SORT_BIG && ff == FLAG_M) {
-        struct tm thyme;
-        int dx;
-        char *xx,*yy;
-
-        xx = strptime(x,"%b",&thyme);
-        dx = thyme.tm_mon;
-        yy = strptime(y,"%b",&thyme);
-        if (!xx) return !yy ? 0 : -1;
-        else if (!yy) return 1;
-        else return dx==thyme.tm_mon ? 0 : dx-thyme.tm_mon;
-
-    // This has to be ff == FLAG_n
-    } else {
-        // Full floating point version of -n
-        if (CFG_SORT_BIG) {
-            double dx = atof(x), dy = atof(y);
+            if (strptime(x, "%b", &thyme)) {
+                val->type = 1;
+                val->num = thyme.tm_mon;
+            }
+
+        // This has to be ff == FLAG_n.  Use the integer version of -n on
+        // tiny systems.
+        } else val->num = CFG_SORT_BIG ? atof(x) : atoi(x);
 
-            return dx>dy ? 1 : (dx<dy ? -1 : 0);
-        // Integer version of -n for tiny systems
-        } else return atoi(x)-atoi(y);
+        // Numbers don't need the text, so give back the copy (if any).
+        if (x != line) arena_free(arena, x);
+        val->str = 0;
     }
-}
 
+    return rec;
+}
 
-// Callback from qsort(): Iterate through key_list and perform comparisons.
-static int compare_keys(const void *xarg, const void *yarg)
+// Compare strings like strcmp(), but by length.
+static int compare_bytes(char *x, int xlen, char *y, int ylen)
 {
-    int flags = toys.optflags, retval = 0;
-    char *x, *y, **xx = (char **)xarg, **yy = (char **)yarg;
-    struct sort_key *key;
+    int i = memcmp(x, y, xlen<ylen ? xlen : ylen);
 
-    if (CFG_SORT_BIG) {
-        for (key=(struct sort_key *)TT.key_list; !retval && key;
-             key = key->next_key)
-        {
-            flags = key->flags ? key->flags : toys.optflags;
+    return i ? i : (xlen>ylen)-(xlen<ylen);
+}
 
-            // Chop out and modify key chunks, handling -dfib
+// Perform actual comparison
+static int compare_values(int flags, struct sort_val *x, struct sort_val *y)
+{
+    // Ascii sort
+    if (!(flags & (FLAG_n|FLAG_g|FLAG_M)))
+        return compare_bytes(x->str, x->len, y->str, y->len);
 
-            x = get_key_data(*xx, key, flags);
-            y = get_key_data(*yy, key, flags);
+    if (x->type != y->type) return x->type<y->type ? -1 : 1;
 
-            retval = compare_values(flags, x, y);
+    return x->num>y->num ? 1 : (x->num<y->num ? -1 : 0);
+}
 
-            // Free the copies get_key_data() made.
 
-            if (x != *xx) free(x);
-            if (y != *yy) free(y);
+// Callback from sort: Iterate through key_list and perform comparisons.
+static int compare_keys(const void *xarg, const void *yarg)
+{
+    struct sort_line *xx = *(struct sort_line **)xarg,
+        *yy = *(struct sort_line **)yarg;
+    int flags = toys.optflags, retval = 0, i = 0;
+    struct sort_key *key;
 
-            if (retval) break;
-        }
-    } else retval = compare_values(flags, *xx, *yy);
+    for (key=(struct sort_key *)TT.key_list; key; key = key->next_key, i++) {
+        flags = key->flags ? key->flags : toys.optflags;
+        if ((retval = compare_values(flags, xx->vals+i, yy->vals+i))) break;
+    }
 
     // Perform fallback sort if necessary
     if (!retval && !(CFG_SORT_BIG && (toys.optflags&FLAG_s))) {
-        retval = strcmp(*xx, *yy);
+        retval = compare_bytes(xx->line, xx->len, yy->line, yy->len);
         flags = toys.optflags;
     }
 
     return retval * ((flags&FLAG_r) ? -1 : 1);
 }
 
-// Callback from loopfiles to handle input files.
-static void sort_read(int fd, char *name)
+// Buffered output for merges, where each line is gone once we read the next.
+static void sort_flush(int fd)
+{
+    xwrite(fd, TT.outbuf, TT.outlen);
+    TT.outlen = 0;
+}
+
+static void sort_write(int fd, char *s, int len, char end)
+{
+    if (!TT.outbuf) TT.outbuf = xmalloc(SORT_OUTBUF);
+    if (TT.outlen+len+1 > SORT_OUTBUF) {
+        sort_flush(fd);
+        if (len >= SORT_OUTBUF) {
+            xwrite(fd, s, len);
+            len = 0;
+        }
+    }
+    memcpy(TT.outbuf+TT.outlen, s, len);
+    TT.outlen += len;
+    TT.outbuf[TT.outlen++] = end;
+}
+
+// Write count lines, each followed by end, straight from where they are.
+static void sort_writev(int fd, struct sort_line **lines, long count, char end)
+{
+    struct iovec iov[SORT_IOV];
+    long i;
+    int n = 0;
+
+    for (i = 0; i<count; i++) {
+        iov[n].iov_base = lines[i]->line;
+        iov[n++].iov_len = lines[i]->len;
+        iov[n].iov_base = &end;
+        iov[n++].iov_len = 1;
+        if (n == SORT_IOV || i == count-1) {
+            xwritev(fd, iov, n);
+            n = 0;
+        }
+    }
+}
+
+// Stable merge sort of count lines, using tmp (count entries) as scratch.
+static void sort_msort(struct sort_line **lines, struct sort_line **tmp,
+    long count)
+{
+    long half = count/2, i, j, k;
+
+    // Insertion sort small pieces.
+    if (count < 8) {
+        for (i=1; i<count; i++) {
+            struct sort_line *x = lines[i];
+
+            for (j=i; j && compare_keys(&x, lines+j-1)<0; j--)
+                lines[j] = lines[j-1];
+            lines[j] = x;
+        }
+
+        return;
+    }
+
+    sort_msort(lines, tmp, half);
+    sort_msort(lines+half, tmp, count-half);
+    if (compare_keys(lines+half-1, lines+half) <= 0) return;
+
+    // Merge the halves, taking from the first one on ties.
+    memcpy(tmp, lines, sizeof(*tmp)*half);
+    for (i=0, j=half, k=0; i<half && j<count;)
+        lines[k++] = compare_keys(lines+j, tmp+i)<0 ? lines[j++] : tmp[i++];
+    while (i<half) lines[k++] = tmp[i++];
+}
+
+// Does source a's line go before source b's in a merge?  NULL (used up)
+// goes last, ties go to the earlier source so merges are stable.
+static int merge_less(struct sort_line **heads, int a, int b)
+{
+    int i;
+
+    if (!heads[a]) return 0;
+    if (!heads[b]) return 1;
+    i = compare_keys(heads+a, heads+b);
+
+    return i<0 || (!i && a<b);
+}
+
+// Play off the subtree under node of a loser tree with leaves count..2*count-1,
+// leaving each match's loser in tree[] and returning the winner.
+static int merge_tree(struct sort_line **heads, int *tree, int count,
+    int node)
+{
+    int a, b;
+
+    if (node >= count) return node-count;
+    a = merge_tree(heads, tree, count, 2*node);
+    b = merge_tree(heads, tree, count, 2*node+1);
+    if (merge_less(heads, b, a)) {
+        tree[node] = a;
+        return b;
+    }
+    tree[node] = b;
+
+    return a;
+}
+
+// After the winner's head changes, replay its path up the tree and return the
+// new winner.
+static int merge_replay(struct sort_line **heads, int *tree, int count,
+    int win)
+{
+    int idx;
+
+    for (idx = (win+count)/2; idx; idx /= 2) {
+        if (merge_less(heads, tree[idx], win)) {
+            int temp = tree[idx];
+
+            tree[idx] = win;
+            win = temp;
+        }
+    }
+
+    return win;
+}
+
+// Sorting TT.lines on several threads: each thread sorts one chunk, then the
+// chunks are split into one partition per thread at a common set of
+// splitters, and each thread merges the pieces of its partition into out[].
+struct sort_par {
+    struct sort_line **out;
+    long count, *bound;  // bound[p*chunks+c]: where partition p starts in chunk c
+    int chunks;
+};
+
+static long chunk_start(struct sort_par *sp, int c)
+{
+    return c*sp->count/sp->chunks;
+}
+
+static void sort_chunk(void *arg, long c)
+{
+    struct sort_par *sp = arg;
+    long start = chunk_start(sp, c);
+
+    sort_msort(TT.lines+start, sp->out+start, chunk_start(sp, c+1)-start);
+}
+
+static void merge_partition(void *arg, long p)
+{
+    struct sort_par *sp = arg;
+    int count = sp->chunks, *tree = xmalloc(sizeof(int)*2*count), win, c;
+    long *pos = xmalloc(sizeof(long)*count), *end = sp->bound+(p+1)*count, out;
+    struct sort_line **heads = xmalloc(sizeof(*heads)*count);
+
+    for (out = c = 0; c<count; c++) {
+        pos[c] = sp->bound[p*count+c];
+        heads[c] = pos[c]<end[c] ? TT.lines[pos[c]] : 0;
+        out += pos[c]-chunk_start(sp, c);
+    }
+
+    tree[0] = merge_tree(heads, tree, count, 1);
+    while (heads[win = tree[0]]) {
+        sp->out[out++] = heads[win];
+        heads[win] = ++pos[win]<end[win] ? TT.lines[pos[win]] : 0;
+        tree[0] = merge_replay(heads, tree, count, win);
+    }
+
+    free(tree);
+    free(pos);
+    free(heads);
+}
+
+// qsort() callback ordering samples by line, then by position.
+static int compare_sample(const void *xarg, const void *yarg)
+{
+    long x = *(long *)xarg, y = *(long *)yarg;
+    int i = compare_keys(TT.lines+x, TT.lines+y);
+
+    return i ? i : (x>y)-(x<y);
+}
+
+// Sort TT.lines with compare_keys().
+static void sort_keyed(void)
+{
+    struct sort_par sp;
+    int jdx, c;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.count = TT.linecount;
+    sp.out = xmalloc(sizeof(*sp.out)*sp.count);
+
+    // Chunks smaller than a few thousand lines aren't worth a thread.
+    sp.chunks = TT.parallel ? TT.parallel : thread_count();
+    if (sp.chunks > sp.count/4096) sp.chunks = sp.count/4096;
+    if (sp.chunks > 1024) sp.chunks = 1024;
+    if (sp.chunks < 2) sort_msort(TT.lines, sp.out, sp.count);
+    else {
+        long *samples = xmalloc(sizeof(long)*sp.chunks*sp.chunks), i;
+        struct sort_line **swap;
+        int p;
+
+        thread_loop(sp.chunks, sp.chunks, &sp, sort_chunk, NULL);
+
+        // Take evenly spaced samples from each sorted chunk, and use evenly
+        // spaced samples of those as splitters.  Equal lines are ordered by
+        // chunk, then position in chunk, as the merge does.
+        for (c = 0; c<sp.chunks; c++) {
+            i = chunk_start(&sp, c);
+            for (p = 0; p<sp.chunks; p++)
+                samples[c*sp.chunks+p] =
+                    i+p*(chunk_start(&sp, c+1)-i)/sp.chunks;
+        }
+        qsort(samples, sp.chunks*sp.chunks, sizeof(long), compare_sample);
+
+        // Find where each splitter falls in each chunk.
+        sp.bound = xmalloc(sizeof(long)*(sp.chunks+1)*sp.chunks);
+        for (c = 0; c<sp.chunks; c++) {
+            sp.bound[c] = chunk_start(&sp, c);
+            sp.bound[sp.chunks*sp.chunks+c] = chunk_start(&sp, c+1);
+        }
+        for (p = 1; p<sp.chunks; p++) {
+            long split = samples[p*sp.chunks+sp.chunks/2-1];
+
+            for (c = 0; c<sp.chunks; c++) {
+                long lo = chunk_start(&sp, c), hi = chunk_start(&sp, c+1);
+
+                // Is split in this chunk, or does it go after equal lines
+                // in earlier chunks and before them in later ones?
+                if (split >= lo && split < hi) lo = split;
+                else while (lo < hi) {
+                    i = (lo+hi)/2;
+                    jdx = compare_keys(TT.lines+i, TT.lines+split);
+                    if (jdx<0 || (!jdx && i<split)) lo = i+1;
+                    else hi = i;
+                }
+                sp.bound[p*sp.chunks+c] = lo;
+            }
+        }
+        free(samples);
+
+        thread_loop(sp.chunks, sp.chunks, &sp, merge_partition, NULL);
+        free(sp.bound);
+        swap = TT.lines;
+        TT.lines = sp.out;
+        sp.out = swap;
+    }
+    free(sp.out);
+}
+
+// When the sort is plain byte order over whole lines, sort an array of each
+// line's next 8 bytes (as a big endian number, zero padded) next to its
+// record, a byte at a time.  Only ties among short groups need memcmp().
+struct sort_pre {
+    unsigned long long pre;
+    struct sort_line *rec;
+};
+
+static unsigned long long sort_prefix(struct sort_line *rec, long off)
 {
-    // Read each line from file, appending to a big array.
+    unsigned char *s = (unsigned char *)rec->line+off;
+    unsigned long long pre = 0;
+    int i;
+
+    for (i = 0; i<8; i++) pre = (pre<<8) | (off+i<rec->len ? s[i] : 0);
+
+    return pre;
+}
+
+// Compare entries whose first off bytes match.
+static int compare_pre(struct sort_pre *x, struct sort_pre *y, long off)
+{
+    if (x->pre != y->pre) return x->pre<y->pre ? -1 : 1;
+
+    return compare_bytes(x->rec->line+off, x->rec->len-off,
+        y->rec->line+off, y->rec->len-off);
+}
+
+// Shared state for sorting the first level's buckets on several threads.
+struct sort_radix {
+    struct sort_pre *pre, *tmp;
+    long bucket[257], off;
+    int depth;
+};
+
+// MSD radix sort of count entries whose first off+depth bytes match, with
+// pre holding bytes off through off+7.  Bucket 0 is lines that ended, which
+// are all the same, and bucket 1+i is lines with byte i next.
+static void sort_radix(struct sort_pre *pre, struct sort_pre *tmp, long count,
+    int depth, long off, struct sort_radix *par)
+{
+    long bucket[258], i, j;
 
     for (;;) {
-        char * line = (CFG_SORT_BIG && (toys.optflags&FLAG_z))
-                       ? get_rawline(fd, NULL, 0) : get_line(fd);
+        int shift;
 
-        if (!line) break;
+        // Insertion sort small groups.
+        if (count < 32 && !par) {
+            for (i=1; i<count; i++) {
+                struct sort_pre x = pre[i];
 
-        // handle -c here so we don't allocate more memory than necessary.
-        if (CFG_SORT_BIG && (toys.optflags&FLAG_c)) {
-            int j = (toys.optflags&FLAG_u) ? -1 : 0;
+                for (j=i; j && compare_pre(&x, pre+j-1, off)<0; j--)
+                    pre[j] = pre[j-1];
+                pre[j] = x;
+            }
 
-            if (TT.linecount && compare_keys((char *)TT.lines,line)>j)
-                error_exit("%s: Check line %d\n", name, TT.linecount);
+            return;
+        }
+
+        // Used up the cached bytes?  Load the next 8.  (Everything left is
+        // at least that long, lines that ended went in bucket 0.)
+        if (depth == 8) {
+            off += 8;
+            for (i=0; i<count; i++) pre[i].pre = sort_prefix(pre[i].rec, off);
+            depth = 0;
+        }
 
-            if (TT.lines) free(TT.lines);
-            else TT.linecount = 0;
-            TT.lines = (char **)line;
-        } else {
-            if (!(TT.linecount&63))
-                TT.lines = xrealloc(TT.lines, sizeof(char *)*(TT.linecount+64));
-            TT.lines[TT.linecount] = line;
+        // Count how many go in each bucket, then move them there.
+        shift = 56-8*depth;
+        memset(bucket, 0, sizeof(bucket));
+        for (i=0; i<count; i++) {
+            j = 255&(pre[i].pre>>shift);
+            if (j || pre[i].rec->len>off+depth) j++;
+            bucket[1+j]++;
         }
+        depth++;
+
+        // Everything in one bucket is common for long shared prefixes, and
+        // needs no moving.
+        for (i=0; i<257; i++) if (bucket[1+i]) break;
+        if (bucket[1+i] == count) {
+            if (!i) return;
+            continue;
+        }
+
+        for (i=1; i<257; i++) bucket[i] += bucket[i-1];
+        for (i=0; i<count; i++) {
+            j = 255&(pre[i].pre>>(64-8*depth));
+            if (j || pre[i].rec->len>=off+depth) j++;
+            tmp[bucket[j]++] = pre[i];
+        }
+        memcpy(pre, tmp, sizeof(*pre)*count);
+
+        // Now bucket[i] is where bucket i ends.
+        if (par) {
+            par->pre = pre;
+            par->tmp = tmp;
+            memcpy(par->bucket, bucket, sizeof(par->bucket));
+            par->off = off;
+            par->depth = depth;
+
+            return;
+        }
+        for (i=1; i<257; i++) {
+            j = bucket[i]-bucket[i-1];
+            if (j>1)
+                sort_radix(pre+bucket[i-1], tmp+bucket[i-1], j, depth, off, 0);
+        }
+
+        return;
+    }
+}
+
+static void sort_bucket(void *arg, long i)
+{
+    struct sort_radix *par = arg;
+    long start = i ? par->bucket[i-1] : 0, len = par->bucket[i]-start;
+
+    if (i && len>1)
+        sort_radix(par->pre+start, par->tmp+start, len, par->depth, par->off,
+            0);
+}
+
+static void sort_bytes(void)
+{
+    struct sort_pre *pre = xmalloc(sizeof(*pre)*2*TT.linecount);
+    struct sort_radix par;
+    long i;
+    int threads = TT.parallel ? TT.parallel : thread_count();
+
+    for (i = 0; i<TT.linecount; i++) {
+        pre[i].pre = sort_prefix(TT.lines[i], 0);
+        pre[i].rec = TT.lines[i];
+    }
+
+    // With threads, sort the first level's buckets in parallel.
+    if (threads > 1 && TT.linecount >= 4096) {
+        par.depth = 0;
+        sort_radix(pre, pre+TT.linecount, TT.linecount, 0, 0, &par);
+        if (par.depth) thread_loop(threads, 257, &par, sort_bucket, NULL);
+    } else sort_radix(pre, pre+TT.linecount, TT.linecount, 0, 0, 0);
+
+    for (i = 0; i<TT.linecount; i++)
+        TT.lines[(toys.optflags&FLAG_r) ? TT.linecount-1-i : i] = pre[i].rec;
+    free(pre);
+}
+
+// Sort TT.lines, and discard duplicates for -u.
+static void sort_lines(void)
+{
+    int idx, jdx;
+
+    if (!TT.linecount) return;
+    if (TT.bytesort) sort_bytes();
+    else sort_keyed();
+
+    if (toys.optflags&FLAG_u) {
+        for (jdx=0, idx=1; idx<TT.linecount; idx++) {
+            if (compare_keys(&TT.lines[jdx], &TT.lines[idx]))
+                TT.lines[++jdx] = TT.lines[idx];
+        }
+        if (TT.linecount) TT.linecount = jdx+1;
+    }
+}
+
+// Open an already deleted temporary file under -T.
+static int sort_tempfile(void)
+{
+    char *dir = TT.tmpdir, *name;
+    int fd;
+
+    if (!dir && !(dir = getenv("TMPDIR"))) dir = "/tmp";
+    name = xmsprintf("%s/sortXXXXXX", dir);
+    if (-1 == (fd = mkstemp(name))) perror_exit("%s", name);
+    unlink(name);
+    free(name);
+
+    return fd;
+}
+
+// Add a file to the list of sorted runs waiting to be merged.
+static void sort_addrun(int fd)
+{
+    xlseek(fd, 0, SEEK_SET);
+    if (!(TT.nruns&63))
+        TT.runs = xrealloc(TT.runs, sizeof(int)*(TT.nruns+64));
+    TT.runs[TT.nruns++] = fd;
+}
+
+// One sorted run being read back in for the merge.
+struct sort_run {
+    int fd, pos, len, size, linelen;
+    char *buf, *line;
+    struct arena arena;  // record for line
+};
+
+// Point run->line at the run's next line, or NULL when it's used up.  The
+// previous line gets overwritten.
+static void run_next(struct sort_run *run, char end)
+{
+    for (;;) {
+        char *s = memchr(run->buf+run->pos, end, run->len-run->pos);
+        int len;
+
+        if (s) {
+            run->line = run->buf+run->pos;
+            run->linelen = s-run->line;
+            run->pos = s+1-run->buf;
+
+            return;
+        }
+
+        // Slide the partial line to the start of the buffer and refill the
+        // rest, growing the buffer when a single line doesn't fit.
+        memmove(run->buf, run->buf+run->pos, run->len -= run->pos);
+        run->pos = 0;
+        if (run->len == run->size)
+            run->buf = xrealloc(run->buf, run->size *= 2);
+        if (!(len = xread(run->fd, run->buf+run->len, run->size-run->len))) {
+            run->line = 0;
+
+            return;
+        }
+        run->len += len;
+    }
+}
+
+// Record for the run's current line, or NULL at the end.
+static struct sort_line *run_decorate(struct sort_run *run)
+{
+    if (!run->line) return 0;
+    arena_trim(&run->arena, 1);
+
+    return sort_decorate(run->line, run->linelen, &run->arena);
+}
+
+// Merge count sorted runs into fd, ending each line with end.  Each run gets
+// an equal share of the memory budget as its read buffer, so we do big reads.
+static void sort_merge(int *fds, int count, int fd, char end)
+{
+    struct sort_run *runs = xzalloc(sizeof(struct sort_run)*count);
+    int *tree = xmalloc(sizeof(int)*2*count), idx, win, prevsize = 0;
+    struct sort_line **heads = xmalloc(sizeof(*heads)*count), *prev = 0;
+    struct arena prevarena = {0, 0};
+    long size = TT.budget/(count+1);
+    char *prevline = 0;
+
+    if (size > SORT_RUNBUF_MAX) size = SORT_RUNBUF_MAX;
+    if (size < SORT_OUTBUF) size = SORT_OUTBUF;
+    for (idx=0; idx<count; idx++) {
+        runs[idx].fd = fds[idx];
+        runs[idx].buf = xmalloc(runs[idx].size = size);
+        run_next(runs+idx, (toys.optflags&FLAG_z) ? 0 : '\n');
+        heads[idx] = run_decorate(runs+idx);
+    }
+
+    tree[0] = merge_tree(heads, tree, count, 1);
+    while (heads[win = tree[0]]) {
+        char *line = heads[win]->line;
+        int len = heads[win]->len;
+
+        // For -u, keep a copy of the last line written to check the next one.
+        if (toys.optflags&FLAG_u) {
+            if (prev && !compare_keys(&prev, heads+win)) line = 0;
+            else {
+                if (len >= prevsize)
+                    prevline = xrealloc(prevline, prevsize = len+1);
+                memcpy(prevline, line, len);
+                arena_trim(&prevarena, 1);
+                prev = sort_decorate(prevline, len, &prevarena);
+            }
+        }
+        if (line) sort_write(fd, line, len, end);
+
+        // Advance the winning run and replay its path up the tree.
+        run_next(runs+win, (toys.optflags&FLAG_z) ? 0 : '\n');
+        heads[win] = run_decorate(runs+win);
+        tree[0] = merge_replay(heads, tree, count, win);
+    }
+    sort_flush(fd);
+
+    for (idx=0; idx<count; idx++) {
+        close(runs[idx].fd);
+        free(runs[idx].buf);
+        arena_free(&runs[idx].arena, 0);
+    }
+    free(runs);
+    free(tree);
+    free(heads);
+    free(prevline);
+    arena_free(&prevarena, 0);
+}
+
+// With too many runs to read at once, merge each batch of adjacent runs
+// into one (keeping them in input order for -s), until there are at most max.
+static void sort_reduce(int max)
+{
+    while (TT.nruns > max) {
+        int *fds = TT.runs, count = TT.nruns, i, j, fd;
+
+        TT.runs = 0;
+        TT.nruns = 0;
+        for (i = 0; i<count; i += j) {
+            if ((j = count-i) > SORT_FANIN) j = SORT_FANIN;
+            if (j == 1) sort_addrun(fds[i]);
+            else {
+                fd = sort_tempfile();
+                sort_merge(fds+i, j, fd, (toys.optflags&FLAG_z) ? 0 : '\n');
+                sort_addrun(fd);
+            }
+        }
+        free(fds);
+    }
+}
+
+// Sort what we've read so far and write it out to a temp file, to be
+// merged with the other runs at the end.
+static void sort_spill(void)
+{
+    char end = (toys.optflags&FLAG_z) ? 0 : '\n';
+    int fd = sort_tempfile();
+
+    sort_lines();
+    sort_writev(fd, TT.lines, TT.linecount, end);
+    sort_addrun(fd);
+    arena_trim(&TT.arena, 1);
+
+    // Done with lines read from pipes, except the chunk still being indexed.
+    arena_trim(&TT.data, 0);
+    TT.linecount = TT.used = 0;
+
+    // Don't run out of filehandles.
+    if (TT.nruns >= SORT_MAXRUNS) sort_reduce(SORT_FANIN);
+}
+
+// Parse -S: a number of kilobytes, another unit with a bKMGT suffix, or a
+// percentage of physical memory.
+static long sort_size(char *arg)
+{
+    long mem = sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+    char *s = arg, *units = "bKMGT";
+    double size = strtod(arg, &s);
+
+    if (s == arg || size < 0) s = "?";
+    else if (*s == '%') size = mem*(size/100), s++;
+    else {
+        char *unit = *s ? strchr(units, *s) : units+1;
+
+        if (unit && *s) s++;
+        if (unit) while (unit-- > units) size *= 1024;
+    }
+    if (*s) error_exit("bad -S '%s'", arg);
+
+    return size < 1 ? 1 : size;
+}
+
+// Add a line to TT.lines, or for -c check it against the previous one.
+static void sort_add(char *line, int len, char *name)
+{
+    struct sort_line *rec;
+
+    if (CFG_SORT_BIG && (toys.optflags&FLAG_c)) {
+        int j = (toys.optflags&FLAG_u) ? -1 : 0;
+
+        // Alternate arenas, so the previous line's record stays around, with
+        // its own copy of the line since the input buffer gets reused.
+        struct arena *arena =
+            (TT.linecount&1) ? &TT.checkarena : &TT.arena;
+
+        arena_trim(arena, 1);
+        line = memcpy(arena_alloc(arena, len), line, len);
+        rec = sort_decorate(line, len, arena);
+        if (TT.linecount && compare_keys(TT.lines, &rec)>j)
+            error_exit("%s: Check line %d\n", name, TT.linecount);
+
+        if (!TT.lines) TT.lines = xmalloc(sizeof(*TT.lines));
+        *TT.lines = rec;
         TT.linecount++;
+    } else {
+        int i;
+
+        rec = sort_decorate(line, len, &TT.arena);
+        if (!(TT.linecount&63))
+            TT.lines = xrealloc(TT.lines, sizeof(*TT.lines)*(TT.linecount+64));
+        TT.lines[TT.linecount++] = rec;
+
+        // Line, pointer to it (and scratch space for sorting that, up to 4
+        // pointers for sort_bytes()), and the record with any copies of keys.
+        TT.used += len+1+5*sizeof(char *)
+            + sizeof(struct sort_line)+TT.nkeys*sizeof(struct sort_val);
+        for (i = 0; i<TT.nkeys; i++)
+            if (rec->vals[i].str && rec->vals[i].str != line)
+                TT.used += rec->vals[i].len+8;
+        if (TT.used > TT.budget) sort_spill();
+    }
+}
+
+// Add each line in data.  The last one doesn't need a terminator.
+static void sort_index(char *data, long len, char *name)
+{
+    char end = (CFG_SORT_BIG && (toys.optflags&FLAG_z)) ? 0 : '\n';
+
+    while (len) {
+        char *s = memchr(data, end, len);
+        long i = s ? s-data : len;
+
+        sort_add(data, i, name);
+        if (s) i++;
+        data += i;
+        len -= i;
     }
 }
 
+// Callback from loopfiles to handle input files.
+static void sort_read(int fd, char *name)
+{
+    char end = (CFG_SORT_BIG && (toys.optflags&FLAG_z)) ? 0 : '\n', *buf;
+    long len = 0, size = SORT_READ, i, done;
+    struct stat st;
+
+    // Map regular files and index the lines where they are.  Mappings last
+    // until we exit, except for -c, which copies the last line it saw.
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size
+        && st.st_size == (size_t)st.st_size)
+    {
+        buf = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            sort_index(buf, st.st_size, name);
+            if (CFG_SORT_BIG && (toys.optflags&FLAG_c))
+                munmap(buf, st.st_size);
+
+            return;
+        }
+    }
+
+    // Read anything else in big chunks, copying the complete lines from each
+    // (except for -c) so the buffer can be reused.
+    buf = xmalloc(size);
+    do {
+        if ((i = xread(fd, buf+len, size-len))) {
+            len += i;
+            for (done = len; done && buf[done-1] != end; done--);
+        } else done = len;
+        if (done) {
+            if (CFG_SORT_BIG && (toys.optflags&FLAG_c))
+                sort_index(buf, done, name);
+            else sort_index(memcpy(arena_alloc(&TT.data, done), buf, done),
+                done, name);
+            memmove(buf, buf+done, len -= done);
+        } else if (len == size) buf = xrealloc(buf, size *= 2);
+    } while (i);
+    free(buf);
+}
+
 void sort_main(void)
 {
+    struct sort_key *key;
     int idx, fd = 1;
 
     // Open output file if necessary.
@@ -349,13 +1073,13 @@ void sort_main(void)
                     // Which flag is this?
 
                     optlist = toys.which->options;
-                    temp2 = index(optlist, *temp);
-                    flag = (1<<(optlist-temp2+strlen(optlist)-1));
+                    temp2 = strrchr(optlist, *temp);
+                    flag = temp2 ? strlen(temp2)-1 : 32;
 
-                    // Was it a flag that can apply to a key?
+                    // Was it a flag that can apply to a key?  (FLAG_b is 1<<11)
 
-                    if (!temp2 || flag>FLAG_b
-                        || (flag&(FLAG_u|FLAG_c|FLAG_s|FLAG_z)))
+                    if (flag>11 || ((flag = 1<<flag)
+                        & (FLAG_u|FLAG_c|FLAG_s|FLAG_z)))
                     {
                         error_exit("Unknown key option.");
                     }
@@ -371,7 +1095,21 @@ void sort_main(void)
     if (toys.optflags&FLAG_b) toys.optflags |= FLAG_bb;
 
     // If no keys, perform alphabetic sort over the whole line.
-    if (CFG_SORT_BIG && !TT.key_list) add_key()->range[0] = 1;
+    if (!TT.key_list) add_key()->range[0] = 1;
+
+    // Plain byte order over whole lines doesn't need compare_keys().
+    TT.bytesort = 1;
+    for (key = TT.key_list; key; key = key->next_key) {
+        int flags = key->flags ? key->flags : toys.optflags;
+
+        if (key->range[0]!=1 || key->range[1] || key->range[2]
+            || key->range[3] || ((flags^toys.optflags)&FLAG_r)
+            || (flags&(FLAG_n|FLAG_g|FLAG_M|FLAG_b|FLAG_d|FLAG_f|FLAG_i|FLAG_bb)))
+                TT.bytesort = 0;
+    }
+
+    // Memory budget for -S, default half of physical memory.
+    TT.budget = sort_size(CFG_SORT_BIG && TT.bufsize ? TT.bufsize : "50%");
 
     // Open input files and read data, populating TT.lines[TT.linecount]
     loopfiles(toys.optargs, sort_read);
@@ -380,31 +1118,25 @@ void sort_main(void)
     // so if we got here, we're done.
     if (CFG_SORT_BIG && (toys.optflags&FLAG_c)) return;
 
-    // Perform the actual sort
-    qsort(TT.lines, TT.linecount, sizeof(char *), compare_keys);
-
-    // handle unique (-u)
-    if (toys.optflags&FLAG_u) {
-        int jdx;
+    // Sort what's left in memory.  If that's everything, write it out,
+    // otherwise spill it as one last run and merge all the runs.
+    if (TT.nruns) {
+        if (TT.linecount) sort_spill();
 
-        for (jdx=0, idx=1; idx<TT.linecount; idx++) {
-            if (!compare_keys(&TT.lines[jdx], &TT.lines[idx]))
-                free(TT.lines[idx]);
-            else TT.lines[++jdx] = TT.lines[idx];
-        }
-        if (TT.linecount) TT.linecount = jdx+1;
-    }
-
-    // Output result
-    for (idx = 0; idx<TT.linecount; idx++) {
-        char *s = TT.lines[idx];
-        xwrite(fd, s, strlen(s));
-        if (CFG_TOYBOX_FREE) free(s);
-        xwrite(fd, "\n", 1);
+        sort_reduce(SORT_FANIN);
+        sort_merge(TT.runs, TT.nruns, fd, '\n');
+    } else {
+        sort_lines();
+        sort_writev(fd, TT.lines, TT.linecount, '\n');
     }
 
     if (CFG_TOYBOX_FREE) {
       if (fd != 1) close(fd);
       free(TT.lines);
+      arena_free(&TT.arena, 0);
+      arena_free(&TT.checkarena, 0);
+      arena_free(&TT.data, 0);
+      free(TT.runs);
+      free(TT.outbuf);
     }
 }
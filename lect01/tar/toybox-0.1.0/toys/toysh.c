@@ -18,6 +18,7 @@
 
 USE_TOYSH(NEWTOY(cd, NULL, TOYFLAG_NOFORK))
 USE_TOYSH(NEWTOY(exit, NULL, TOYFLAG_NOFORK))
+USE_TOYSH(NEWTOY(hash, "r", TOYFLAG_NOFORK))
 USE_TOYSH(OLDTOY(sh, toysh, "c:i", TOYFLAG_BIN))
 USE_TOYSH(NEWTOY(toysh, "c:i", TOYFLAG_BIN))
 
@@ -138,6 +139,15 @@ config TOYSH_BUILTINS
 	  Adds the commands exec, fg, bg, help, jobs, pwd, export, source, set,
 	  unset, read, alias.
 
+config TOYSH_CACHE
+	bool "Cache parsed scripts"
+	default n
+	depends on TOYSH
+	help
+	  If $TOYSH_CACHE names a directory, save the parsed form of each
+	  script run there, and use it instead of parsing the script again until
+	  the script changes.
+
 config EXIT
 	bool
 	default n
@@ -148,6 +158,19 @@ config EXIT
 	  Exit shell.  If no return value supplied on command line, use value
 	  of most recent command, or 0 if none.
 
+config HASH
+	bool
+	default n
+	depends on TOYSH
+	help
+	  usage: hash [-r] [command...]
+
+	  Look up commands in $PATH and remember where they were found, or with
+	  no arguments list the remembered commands and how often each was run.
+	  Changing $PATH forgets them all.
+
+	  -r	Forget all remembered commands
+
 config CD
 	bool
 	default n
@@ -172,6 +195,15 @@ config CD_P
 
 DEFINE_GLOBALS(
 	char *command;
+
+	FILE *input;
+	int status;
+
+	void *hashcmds[64];
+	char *hashpath;
+
+	char *script;
+	long scriptlen;
 )
 
 #define TT this.toysh
@@ -186,11 +218,21 @@ DEFINE_GLOBALS(
 #define TOYSH_FLAG_SEMI    64
 #define TOYSH_FLAG_PAREN   128
 
+// A redirection of fd: type '<' '>' or 'a' (>>) opens file word, 'h' (<<) is
+// a here document (word is the terminator, here the text), and 'd' (>& or <&)
+// duplicates fd number word ("-" closes fd instead).
+struct redirect {
+	struct redirect *next;
+	int fd, type;
+	char *word, *here;
+};
+
 // What we know about a single process.
 struct command {
 	struct command *next;
 	int flags;              // exit, suspend, && ||
 	int pid;                // pid (or exit code)
+	struct redirect *redir;
 	int argc;
 	char *argv[0];
 };
@@ -202,8 +244,89 @@ struct pipeline {
 	struct command *cmd;
 	char *cmdline;         // Unparsed line for display purposes
 	int cmdlinelen;        // How long is cmdline?
+	char *error;           // Syntax error to report instead of running it
+};
+
+// Parsed pipelines, all in one block of memory that can be saved to disk and
+// loaded back.  Pointers in the block are saved as offsets from its start.
+struct script {
+	char magic[8];
+	long long dev, ino, size, mtime, mnsec;
+	long len;
+	struct pipeline *line;
 };
 
+// Changes whenever struct layout does, so saved scripts go stale.
+#define TOYSH_SCRIPT_MAGIC "tsh%c%c%c%c", (int)sizeof(long), \
+	(int)sizeof(struct pipeline), (int)sizeof(struct command), \
+	(int)sizeof(struct redirect)
+
+#define TOYSH_HASH (sizeof(TT.hashcmds)/sizeof(*TT.hashcmds))
+
+// Where a command was found in $PATH, and how often we've run it since.
+struct hashcmd {
+	struct hashcmd *next;
+	char *name;
+	int hits;
+	char path[];
+};
+
+// Forget where all the commands were.
+static void hash_forget(void)
+{
+	int i;
+
+	for (i = 0; i < TOYSH_HASH; i++) {
+		llist_free(TT.hashcmds[i], NULL);
+		TT.hashcmds[i] = 0;
+	}
+}
+
+// Find a command in $PATH, remembering where so the next lookup doesn't
+// have to stat its way through $PATH again.  Counts a hit if we're going to
+// run it.  Returns NULL if not found.
+static char *hash_find(char *name, int run)
+{
+	char *path = getenv("PATH"), *next;
+	struct hashcmd *hc, **bucket;
+	struct stat st;
+
+	if (!path) path = "/bin:/usr/bin";
+	if (!TT.hashpath || strcmp(path, TT.hashpath)) {
+		hash_forget();
+		free(TT.hashpath);
+		TT.hashpath = xstrdup(path);
+	}
+
+	bucket = (struct hashcmd **)TT.hashcmds
+		+ toy_name_hash(name, 0) % TOYSH_HASH;
+	for (hc = *bucket; hc; hc = hc->next)
+		if (!strcmp(name, hc->name)) goto found;
+
+	// An empty $PATH entry means the current directory.
+	for (;;) {
+		int len;
+
+		next = strchr(path, ':');
+		len = next ? next-path : strlen(path);
+		hc = xmalloc(sizeof(struct hashcmd) + len + strlen(name) + 3);
+		sprintf(hc->path, "%.*s/%s", len ? len : 1, len ? path : ".", name);
+		if (!stat(hc->path, &st) && S_ISREG(st.st_mode) && (st.st_mode & 0111))
+			break;
+		free(hc);
+		if (!next) return NULL;
+		path = next+1;
+	}
+	hc->name = strrchr(hc->path, '/')+1;
+	hc->hits = 0;
+	hc->next = *bucket;
+	*bucket = hc;
+
+found:
+	if (run) hc->hits++;
+	return hc->path;
+}
+
 // Parse one word from the command line, appending one or more argv[] entries
 // to struct command.  Handles environment variable substitution and
 // substrings.  Returns pointer to next used byte, or NULL if it
@@ -213,11 +336,18 @@ static char *parse_word(char *start, struct command **cmd)
 	char *end;
 
 	// Detect end of line (and truncate line at comment)
-	if (CFG_TOYSH_PIPES && strchr("><&|(;", *start)) return 0;
+	if (CFG_TOYSH_PIPES) {
+		for (end = start; isdigit(*end); end++);
+		if (*end=='<' || *end=='>' || (*start && strchr("><&|(;\n", *start)))
+			return 0;
+	}
 
 	// Grab next word.  (Add dequote and envvar logic here)
 	end = start;
-	while (*end && !isspace(*end)) end++;
+	while (*end && !isspace(*end)) {
+		if (CFG_TOYSH_PIPES && strchr("><&|;", *end)) break;
+		end++;
+	}
 	(*cmd)->argv[(*cmd)->argc++] = xstrndup(start, end-start);
 
 	// Allocate more space if there's no room for NULL terminator.
@@ -229,6 +359,100 @@ static char *parse_word(char *start, struct command **cmd)
 	return end;
 }
 
+// Read a here document.  Its text starts on the line after the one we're
+// parsing, which is either more of the command string (cut out so parsing
+// can carry on with the rest of this line) or more input.
+static void parse_heredoc(struct redirect *rd, char *line)
+{
+	char *nl = strchr(line, '\n'), *s, *buf = NULL;
+	long len = 0, wlen = strlen(rd->word);
+	size_t size = 0;
+	int found = 0;
+
+	rd->here = xzalloc(1);
+	if (nl) {
+		for (s = nl+1; *s && !found;) {
+			char *e = strchr(s, '\n');
+			long l = e ? e-s : strlen(s);
+
+			if (l == wlen && !strncmp(s, rd->word, l)) found++;
+			else {
+				rd->here = xrealloc(rd->here, len+l+2);
+				memcpy(rd->here+len, s, l);
+				len += l;
+				rd->here[len++] = '\n';
+				rd->here[len] = 0;
+			}
+			s += l + !!e;
+		}
+		memmove(nl+1, s, strlen(s)+1);
+	}
+
+	while (!found && TT.input) {
+		long l = getline(&buf, &size, TT.input);
+
+		if (l < 1) break;
+		if (buf[l-1] == '\n') buf[--l] = 0;
+		if (l == wlen && !strcmp(buf, rd->word)) break;
+		rd->here = xrealloc(rd->here, len+l+2);
+		memcpy(rd->here+len, buf, l);
+		len += l;
+		rd->here[len++] = '\n';
+		rd->here[len] = 0;
+	}
+	free(buf);
+}
+
+// Parse a redirection ([fd]< [fd]> [fd]>> [fd]<< [fd]>&fd [fd]<&fd) and the
+// word after it onto the end of the command's list.  Returns pointer to next
+// used byte, or NULL if there's no word.
+static char *parse_redirect(char *start, struct command *cmd)
+{
+	struct redirect *rd, **prd = &cmd->redir;
+	int fd = -1, type;
+	char *end;
+
+	if (isdigit(*start)) fd = strtol(start, &start, 10);
+	type = *(start++);
+	if (fd < 0) fd = type == '>';
+	if (*start == '&') type = 'd';
+	else if (type == '>' && *start == '>') type = 'a';
+	else if (type == '<' && *start == '<') type = 'h';
+	if (type != '<' && type != '>') start++;
+
+	while (isspace(*start) && *start != '\n') start++;
+	for (end = start; *end && !isspace(*end); end++)
+		if (strchr("><&|;(", *end)) break;
+	if (end == start) return 0;
+
+	rd = xzalloc(sizeof(struct redirect));
+	rd->fd = fd;
+	rd->type = type;
+	rd->word = xstrndup(start, end-start);
+	while (*prd) prd = &(*prd)->next;
+	*prd = rd;
+	if (type == 'h') parse_heredoc(rd, end);
+
+	return end;
+}
+
+// Free the contents of a command structure
+static void free_cmd(void *data)
+{
+	struct command *cmd=(struct command *)data;
+
+	while(cmd->argc) free(cmd->argv[--cmd->argc]);
+	while (cmd->redir) {
+		struct redirect *rd = cmd->redir;
+
+		cmd->redir = rd->next;
+		free(rd->word);
+		free(rd->here);
+		free(rd);
+	}
+	free(cmd);
+}
+
 // Parse a line of text into a pipeline.
 // Returns a pointer to the next line.
 
@@ -245,8 +469,15 @@ static char *parse_pipeline(char *cmdline, struct pipeline *line)
 	for (;;) {
 		char *end;
 
-		// Skip leading whitespace and detect end of line.
-		while (isspace(*start)) start++;
+		// Skip leading whitespace and detect end of line.  With pipes, a
+		// newline ends a command (unless we're still waiting for one) and
+		// a comment only lasts until the next one.
+		for (;;) {
+			while (isspace(*start) && (!CFG_TOYSH_PIPES || *start!='\n' || !*cmd))
+				start++;
+			if (!CFG_TOYSH_PIPES || *start!='#') break;
+			while (*start && *start!='\n') start++;
+		}
 		if (!*start || *start=='#') {
 			if (CFG_TOYSH_JOBCTL) line->cmdlinelen = start-cmdline;
 			return 0;
@@ -261,11 +492,27 @@ static char *parse_pipeline(char *cmdline, struct pipeline *line)
 		// If we hit the end of this command, how did it end?
 		if (!end) {
 			if (CFG_TOYSH_PIPES && *start) {
-				if (*start==';') {
+				if (*start==';' || *start=='\n') (*cmd)->flags |= TOYSH_FLAG_SEMI;
+				else if (!strncmp(start, "&&", 2)) (*cmd)->flags |= TOYSH_FLAG_AND;
+				else if (!strncmp(start, "||", 2)) (*cmd)->flags |= TOYSH_FLAG_OR;
+				else if (*start=='&') (*cmd)->flags |= TOYSH_FLAG_AMP;
+				else if (*start=='|') {
+					(*cmd)->flags |= TOYSH_FLAG_PIPE;
+					cmd = &(*cmd)->next;
 					start++;
-					break;
+					continue;
+				} else if (*start!='(' && (end = parse_redirect(start, *cmd))) {
+					start = end;
+					continue;
+				} else {
+					line->error = xmsprintf("syntax error at '%.*s'",
+						(int)strcspn(start, "\n"), start);
+					llist_free(line->cmd, free_cmd);
+					line->cmd = 0;
+
+					return 0;
 				}
-				// handle | & < > >> << || &&
+				start += 1 + !!((*cmd)->flags & (TOYSH_FLAG_AND|TOYSH_FLAG_OR));
 			}
 			break;
 		}
@@ -277,73 +524,530 @@ static char *parse_pipeline(char *cmdline, struct pipeline *line)
 	return start;
 }
 
-// Execute the commands in a pipeline
-static void run_pipeline(struct pipeline *line)
+// Move a new file descriptor out of the way of ones we'll dup2() onto, and
+// keep children that exec from inheriting it.
+static int toysh_fd(int fd)
+{
+	int new = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+
+	close(fd);
+
+	return new;
+}
+
+// Close the fds in a map that were only there to be dup2()ed somewhere.
+static void close_map(int *map, int count)
 {
-	struct toy_list *tl;
-	struct command *cmd = line->cmd;
-	if (!cmd || !cmd->argc) return;
-
-	tl = toy_find(cmd->argv[0]);
-	// Is this command a builtin that should run in this process?
-	if (tl && (tl->flags & TOYFLAG_NOFORK)) {
-		struct toy_context temp;
-
-		// This fakes lots of what toybox_main() does.
-		memcpy(&temp, &toys, sizeof(struct toy_context));
-		bzero(&toys, sizeof(struct toy_context));
-		toy_init(tl, cmd->argv);
-		tl->toy_main();
-		cmd->pid = toys.exitval;
-		free(toys.optargs);
-		if (toys.old_umask) umask(toys.old_umask);
-		memcpy(&toys, &temp, sizeof(struct toy_context));
-	} else {
-		int status;
-
-		cmd->pid = vfork();
-		if (!cmd->pid) xexec(cmd->argv);
-		else waitpid(cmd->pid, &status, 0);
-
-		if (CFG_TOYSH_FLOWCTL || CFG_TOYSH_PIPES) {
-			if (WIFEXITED(status)) cmd->pid = WEXITSTATUS(status);
-			if (WIFSIGNALED(status)) cmd->pid = WTERMSIG(status);
+	int i;
+
+	for (i = 0; i < count; i += 2)
+		if (map[i] >= 10 && (fcntl(map[i], F_GETFD) & FD_CLOEXEC))
+			close(map[i]);
+}
+
+// Open a command's redirections, adding (from, to) pairs to the fd map in
+// the order they should be dup2()ed.  A from of -1 closes to.  Returns the
+// new size of the map, or -1 after complaining.
+static int open_redirects(struct command *cmd, int *map, int count)
+{
+	struct redirect *rd;
+	int first = count;
+
+	for (rd = cmd->redir; rd; rd = rd->next) {
+		int from = -1;
+
+		if (rd->type == 'd') {
+			if (strcmp(rd->word, "-")) {
+				char *end;
+
+				from = strtol(rd->word, &end, 10);
+				if (*end || end == rd->word) {
+					error_msg("%s: bad fd", rd->word);
+					close_map(map+first, count-first);
+
+					return -1;
+				}
+			}
+		} else if (rd->type == 'h') {
+			char name[] = "/tmp/toyshXXXXXX";
+
+			from = mkstemp(name);
+			if (from != -1) {
+				unlink(name);
+				xwrite(from, rd->here, strlen(rd->here));
+				lseek(from, 0, SEEK_SET);
+			}
+		} else from = open(rd->word, rd->type == '<' ? O_RDONLY
+				: O_WRONLY|O_CREAT|(rd->type == 'a' ? O_APPEND : O_TRUNC), 0666);
+
+		if (rd->type != 'd') {
+			if (from == -1) {
+				perror_msg("%s", rd->type == 'h' ? "here document" : rd->word);
+				close_map(map+first, count-first);
+
+				return -1;
+			}
+			from = toysh_fd(from);
 		}
+		map[count++] = from;
+		map[count++] = rd->fd;
 	}
 
-	return;
+	return count;
 }
 
-// Free the contents of a command structure
-static void free_cmd(void *data)
+// Start one command of a pipeline with its fds rearranged per map, returning
+// its pid (or -1).  Toybox applets run in a forked copy of this process
+// without exec(), anything else is found through hash_find() and started
+// with posix_spawn().
+static int launch_command(struct toy_list *tl, struct command *cmd, int *map,
+	int count, int top)
 {
-	struct command *cmd=(struct command *)data;
+	posix_spawn_file_actions_t fa;
+	int i, pid, rc;
+
+	if (tl) {
+		// Exiting the child syncs its copy of our input buffer, which would
+		// seek our input back to reread it.  Empty it first.
+		fflush(stdout);
+		if (TT.input) fflush(TT.input);
+		if (!(pid = fork())) {
+			for (i = 0; i < count; i += 2) {
+				if (map[i] == -1) close(map[i+1]);
+				else if (map[i] != map[i+1] && -1 == dup2(map[i], map[i+1]))
+					perror_exit("%d", map[i]);
+			}
 
-	while(cmd->argc) free(cmd->argv[--cmd->argc]);
+			// What exec() would have closed.
+			for (i = 3; i <= top; i++)
+				if (fcntl(i, F_GETFD) & FD_CLOEXEC) close(i);
+
+			// This fakes what toybox_main() does.
+			memset(&this, 0, sizeof(this));
+			memset(&toys, 0, sizeof(toys));
+			toy_init(tl, cmd->argv);
+			tl->toy_main();
+			exit(toys.exitval);
+		}
+		if (pid == -1) perror_msg("fork");
+
+		return pid;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	for (i = 0; i < count; i += 2) {
+		if (map[i] == -1) posix_spawn_file_actions_addclose(&fa, map[i+1]);
+		else posix_spawn_file_actions_adddup2(&fa, map[i], map[i+1]);
+	}
+	if (strchr(cmd->argv[0], '/'))
+		rc = posix_spawn(&pid, cmd->argv[0], &fa, NULL, cmd->argv, environ);
+	else for (i = 0;; i++) {
+		char *path = hash_find(cmd->argv[0], 1);
+
+		if (!path) rc = ENOENT;
+		else rc = posix_spawn(&pid, path, &fa, NULL, cmd->argv, environ);
+
+		// If a remembered command went away, look for it again.
+		if (rc != ENOENT || !path || i) break;
+		hash_forget();
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	if (rc) {
+		errno = rc;
+		perror_msg("%s", cmd->argv[0]);
+		pid = -1;
+	}
+
+	return pid;
+}
+
+// Run a builtin (like cd) in this process, with its redirections applied
+// only while it runs.
+static void run_nofork(struct toy_list *tl, struct command *cmd, int *map,
+	int count)
+{
+	struct toy_context temp;
+	int i, *saved = xmalloc((count/2+1)*sizeof(int));
+
+	fflush(stdout);
+	for (i = 0; i < count; i += 2) {
+		saved[i/2] = fcntl(map[i+1], F_DUPFD_CLOEXEC, 10);
+		if (map[i] == -1) close(map[i+1]);
+		else dup2(map[i], map[i+1]);
+	}
+
+	// This fakes lots of what toybox_main() does.
+	memcpy(&temp, &toys, sizeof(struct toy_context));
+	bzero(&toys, sizeof(struct toy_context));
+	toy_init(tl, cmd->argv);
+	tl->toy_main();
+	cmd->pid = toys.exitval;
+	if (tl->options) free(toys.optargs);
+	if (toys.old_umask) umask(toys.old_umask);
+	memcpy(&toys, &temp, sizeof(struct toy_context));
+
+	fflush(stdout);
+	for (i = count-2; i >= 0; i -= 2) {
+		if (saved[i/2] == -1) close(map[i+1]);
+		else {
+			dup2(saved[i/2], map[i+1]);
+			close(saved[i/2]);
+		}
+	}
+	free(saved);
+}
+
+// Execute the commands in a pipeline, connecting each one's stdout to the
+// next one's stdin.  Returns the exit status of the last one, or 0 if it was
+// started in the background.
+static int run_pipeline(struct pipeline *line)
+{
+	struct command *cmd, *last = 0;
+	int in = -1, top = 0, *map = 0;
+
+	// Collect any background commands that have finished.
+	if (CFG_TOYSH_PIPES) while (waitpid(-1, NULL, WNOHANG) > 0);
+
+	for (cmd = line->cmd; cmd; cmd = cmd->next) {
+		struct toy_list *tl = cmd->argc ? toy_find(cmd->argv[0]) : 0;
+		struct redirect *rd;
+		int pipes[2] = {-1, -1}, count = 0, i;
+
+		// Until we know otherwise, pid is the exit code.
+		cmd->flags |= TOYSH_FLAG_EXIT;
+
+		for (rd = cmd->redir, count = 4; rd; rd = rd->next) count += 2;
+		map = xrealloc(map, count*sizeof(int));
+		count = 0;
+
+		// Hook up pipes first, so redirections can override them.
+		if (in != -1) {
+			map[count++] = in;
+			map[count++] = 0;
+		}
+		if (cmd->next) {
+			if (pipe(pipes)) perror_exit("pipe");
+			pipes[0] = toysh_fd(pipes[0]);
+			pipes[1] = toysh_fd(pipes[1]);
+			map[count++] = pipes[1];
+			map[count++] = 1;
+			if (pipes[0] > top) top = pipes[0];
+			if (pipes[1] > top) top = pipes[1];
+		}
+		if (in > top) top = in;
+
+		i = count;
+		count = open_redirects(cmd, map, count);
+		if (count == -1) {
+			close_map(map, i);
+			cmd->pid = 1;
+		} else {
+			for (i = 0; i < count; i += 2) if (map[i] > top) top = map[i];
+
+			// Is this command a builtin that should run in this process?
+			if (!cmd->argc) cmd->pid = 0;
+			else if (tl && (tl->flags & TOYFLAG_NOFORK) && cmd == line->cmd
+				&& !cmd->next)
+			{
+				run_nofork(tl, cmd, map, count);
+			} else if (-1 == (cmd->pid = launch_command(tl, cmd, map, count, top)))
+				cmd->pid = 127;
+			else cmd->flags &= ~TOYSH_FLAG_EXIT;
+			close_map(map, count);
+		}
+		in = pipes[0];
+		if (!cmd->next) last = cmd;
+	}
+	if (in != -1) close(in);
+	free(map);
+
+	// Wait for everything to finish (unless it's in the background), and the
+	// last command's exit code is the pipeline's.
+	if (CFG_TOYSH_PIPES && (last->flags & TOYSH_FLAG_AMP)) return 0;
+	for (cmd = line->cmd; cmd; cmd = cmd->next) {
+		int status = 0;
+
+		if (cmd->flags & TOYSH_FLAG_EXIT) continue;
+		waitpid(cmd->pid, &status, 0);
+		if (WIFEXITED(status)) cmd->pid = WEXITSTATUS(status);
+		if (WIFSIGNALED(status)) cmd->pid = 128+WTERMSIG(status);
+		cmd->flags |= TOYSH_FLAG_EXIT;
+	}
+
+	return last->pid;
+}
+
+// Append len bytes of data (or zeroes if NULL) to the script being compiled,
+// returning their offset.
+static long script_add(void *data, long len)
+{
+	long off = TT.scriptlen,
+		pad = (len+sizeof(long long)-1) & ~(sizeof(long long)-1);
+
+	TT.script = xrealloc(TT.script, TT.scriptlen += pad);
+	memset(TT.script+off, 0, pad);
+	if (data) memcpy(TT.script+off, data, len);
+
+	return off;
+}
+
+static long script_str(char *str)
+{
+	return str ? script_add(str, strlen(str)+1) : 0;
 }
 
+// Copy a list of redirections into the script, returning the first's offset.
+static long script_redir(struct redirect *rd)
+{
+	struct redirect new;
+
+	if (!rd) return 0;
+	new = *rd;
+	new.next = (void *)script_redir(rd->next);
+	new.word = (void *)script_str(rd->word);
+	new.here = (void *)script_str(rd->here);
+
+	return script_add(&new, sizeof(new));
+}
+
+// Copy a list of commands into the script, returning the first's offset.
+static long script_cmd(struct command *cmd)
+{
+	long len, off;
+	struct command *new;
+	int i;
+
+	if (!cmd) return 0;
+	len = sizeof(struct command) + (cmd->argc+1)*sizeof(char *);
+	new = xmalloc(len);
+	memcpy(new, cmd, len);
+	new->next = (void *)script_cmd(cmd->next);
+	new->redir = (void *)script_redir(cmd->redir);
+	for (i = 0; i < cmd->argc; i++) new->argv[i] = (void *)script_str(cmd->argv[i]);
+	off = script_add(new, len);
+	free(new);
+
+	return off;
+}
+
+// Parse all of text, returning a script with offsets instead of pointers.
+// Parsing stops at the first syntax error, which is saved to be reported
+// when running the script gets that far.
+static struct script *script_compile(char *text)
+{
+	struct pipeline line;
+	long off, prev = offsetof(struct script, line), cmd, error;
+
+	TT.script = 0;
+	TT.scriptlen = 0;
+	script_add(0, sizeof(struct script));
+	for (;;) {
+		memset(&line, 0, sizeof(struct pipeline));
+		text = parse_pipeline(text, &line);
+		if (!line.cmd && !line.error) break;
+
+		// Adding to the script can move it, so finish before storing into it.
+		off = script_add(0, sizeof(struct pipeline));
+		cmd = script_cmd(line.cmd);
+		error = script_str(line.error);
+		((struct pipeline *)(TT.script+off))->cmd = (void *)cmd;
+		((struct pipeline *)(TT.script+off))->error = (void *)error;
+		*(long *)(TT.script+prev) = off;
+		prev = off + offsetof(struct pipeline, next);
+		llist_free(line.cmd, free_cmd);
+		free(line.error);
+		if (!text) break;
+	}
+	((struct script *)TT.script)->len = TT.scriptlen;
+
+	return (struct script *)TT.script;
+}
+
+// Is there an object of size bytes at offset off in the script (after the
+// header, aligned the way script_add() aligns things)?
+static int script_fits(struct script *script, unsigned long off, long size)
+{
+	return off >= sizeof(struct script) && !(off & (sizeof(long long)-1))
+		&& off < script->len && size <= script->len-off;
+}
+
+// Turn the offsets in a compiled script into pointers.  Returns 0 unless
+// every object fits inside the script, every string ends inside it, and
+// each list runs the direction script_compile() laid it out in (so a damaged
+// file can't send us off the end or around in circles).
+static int script_relocate(struct script *script)
+{
+	struct pipeline *line;
+	struct command *cmd;
+	struct redirect *rd;
+	char *base = (char *)script;
+	long len = script->len;
+	int i;
+
+#define RELOC(ptr, size) \
+	if (ptr) { \
+		if (!script_fits(script, (long)ptr, size)) return 0; \
+		ptr = (void *)(base+(long)ptr); \
+	}
+#define RELOC_STR(ptr) \
+	RELOC(ptr, 1); \
+	if (ptr && !memchr(ptr, 0, base+len-(char *)ptr)) return 0;
+#define FORWARD(obj, next) ((long)(obj)->next > (char *)(obj)-base)
+
+	RELOC(script->line, sizeof(struct pipeline));
+	for (line = script->line; line; line = line->next) {
+		if (line->next && !FORWARD(line, next)) return 0;
+		RELOC(line->next, sizeof(struct pipeline));
+		RELOC(line->cmd, sizeof(struct command));
+		RELOC_STR(line->error);
+		line->cmdline = 0;
+		for (cmd = line->cmd; cmd; cmd = cmd->next) {
+			if (cmd->argc < 0 || (cmd->argc+1L)*sizeof(char *)
+				> len-((char *)cmd-base)-sizeof(struct command)) return 0;
+			if (cmd->argv[cmd->argc]) return 0;
+			if (cmd->next && FORWARD(cmd, next)) return 0;
+			RELOC(cmd->next, sizeof(struct command));
+			RELOC(cmd->redir, sizeof(struct redirect));
+			for (i = 0; i < cmd->argc; i++) RELOC_STR(cmd->argv[i]);
+			for (rd = cmd->redir; rd; rd = rd->next) {
+				if (rd->next && FORWARD(rd, next)) return 0;
+				RELOC(rd->next, sizeof(struct redirect));
+				RELOC_STR(rd->word);
+				RELOC_STR(rd->here);
+			}
+		}
+	}
+#undef FORWARD
+#undef RELOC_STR
+#undef RELOC
+
+	return 1;
+}
+
+// Run a compiled script.
+static void script_run(struct script *script)
+{
+	struct pipeline *line;
+	int skip = 0;
+
+	for (line = script->line; line; line = line->next) {
+		struct command *cmd;
+
+		if (line->error) {
+			error_msg("%s", line->error);
+			TT.status = 2;
+			break;
+		}
+
+		// Run those commands, unless && or || said not to.
+
+		if (!skip) TT.status = run_pipeline(line);
+		for (cmd = line->cmd; cmd->next; cmd = cmd->next);
+		if (cmd->flags & TOYSH_FLAG_AND) skip = !!TT.status;
+		else if (cmd->flags & TOYSH_FLAG_OR) skip = !TT.status;
+		else skip = 0;
+	}
+}
 
 // Parse a command line and do what it says to do.
 static void handle(char *command)
 {
-	struct pipeline line;
-	char *start = command;
+	struct script *script = script_compile(command);
 
-	// Loop through commands in this line
+	script_relocate(script);
+	script_run(script);
+	free(script);
+}
 
-	for (;;) {
+// Load a saved script if it was compiled from this version of the file.
+// Anybody can stat() the script to fake a matching key, so only trust a
+// saved script that nobody but us could have written.
+static struct script *script_load(char *name, struct script *key)
+{
+	struct script *script = 0;
+	int fd = open(name, O_RDONLY);
+	struct stat st;
+	long len;
+
+	if (fd == -1) return 0;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+		&& !(st.st_mode & 022) && (len = st.st_size) >= sizeof(struct script))
+	{
+		script = xmalloc(len);
+		if (len != readall(fd, script, len) || script->len != len
+			|| memcmp(script, key, offsetof(struct script, len))
+			|| !script_relocate(script))
+		{
+			free(script);
+			script = 0;
+		}
+	}
+	close(fd);
 
-		// Parse a group of connected commands
+	return script;
+}
 
-		memset(&line,0,sizeof(struct pipeline));
-		start = parse_pipeline(start, &line);
-		if (!line.cmd) break;
+// Save a compiled script (before relocating it), replacing the old one
+// atomically so other shells never see a partial file.
+static void script_save(char *name, struct script *script)
+{
+	char *temp = xmsprintf("%sXXXXXX", name);
+	int fd = mkstemp(temp), bad;
 
-		// Run those commands
+	if (fd != -1) {
+		bad = script->len != writeall(fd, script, script->len);
+		if (close(fd) || bad || rename(temp, name)) unlink(temp);
+	}
+	free(temp);
+}
 
-		run_pipeline(&line);
-		llist_free(line.cmd, free_cmd);
+// Run a script file, parsing it all up front (or using a saved copy).
+static void script_file(char *name)
+{
+	struct script *script = 0, key;
+	char *cache = CFG_TOYSH_CACHE ? getenv("TOYSH_CACHE") : 0, *saved = 0,
+		*text;
+	int fd = xopen(name, O_RDONLY);
+	struct stat st;
+
+	if (fstat(fd, &st)) perror_exit("%s", name);
+	memset(&key, 0, sizeof(key));
+	sprintf(key.magic, TOYSH_SCRIPT_MAGIC);
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	key.size = st.st_size;
+	key.mtime = st.st_mtim.tv_sec;
+	key.mnsec = st.st_mtim.tv_nsec;
+
+	// Only a regular file's size and mtime say whether it changed.
+	if (cache && *cache && S_ISREG(st.st_mode)) {
+		text = xabspath(name);
+		saved = xmsprintf("%s/%08x", cache, toy_name_hash(text, 0));
+		free(text);
+		script = script_load(saved, &key);
+	}
+	if (!script) {
+		long len = 0, size = st.st_size+1, i;
+
+		// Read to EOF: pipes and such don't have a size, and files can grow.
+		for (text = 0;; size *= 2) {
+			text = xrealloc(text, size+1);
+			if (0 > (i = readall(fd, text+len, size-len)))
+				perror_exit("%s", name);
+			if ((len += i) < size) break;
+		}
+		text[len] = 0;
+		script = script_compile(text);
+		free(text);
+		memcpy(script, &key, offsetof(struct script, len));
+		if (saved) script_save(saved, script);
+		script_relocate(script);
 	}
+	close(fd);
+	free(saved);
+
+	script_run(script);
+	free(script);
 }
 
 void cd_main(void)
@@ -354,7 +1058,26 @@ void cd_main(void)
 
 void exit_main(void)
 {
-	exit(*toys.optargs ? atoi(*toys.optargs) : 0);
+	exit(*toys.optargs ? atoi(*toys.optargs) : TT.status);
+}
+
+void hash_main(void)
+{
+	struct hashcmd *hc;
+	char **arg;
+	int i;
+
+	if (toys.optflags) hash_forget();
+	for (arg = toys.optargs; *arg; arg++) {
+		if (strchr(*arg, '/') || hash_find(*arg, 0)) continue;
+		error_msg("%s: not found", *arg);
+		toys.exitval = 1;
+	}
+	if (toys.optflags || *toys.optargs) return;
+
+	for (i = 0; i < TOYSH_HASH; i++)
+		for (hc = TT.hashcmds[i]; hc; hc = hc->next)
+			printf("%4d\t%s\n", hc->hits, hc->path);
 }
 
 void toysh_main(void)
@@ -365,18 +1088,23 @@ void toysh_main(void)
 	if (CFG_TOYSH_TTY) {
 		if (isatty(0)) toys.optflags |= 1;
 	}
-	f = *toys.optargs ? xfopen(*toys.optargs, "r") : NULL;
 	if (TT.command) handle(TT.command);
+	else if (*toys.optargs) script_file(*toys.optargs);
 	else {
 		size_t cmdlen = 0;
+
+		// Read stdin through our own FILE, so commands we fork off don't
+		// inherit what's sitting in the buffer of theirs.
+		if (!(f = fdopen(0, "r"))) perror_exit("stdin");
+		TT.input = f;
 		for (;;) {
 			char *command = 0;
-			if (!f) xputc('$');
-			if (1 > getline(&command, &cmdlen, f ? : stdin)) break;
+			xputc('$');
+			if (1 > getline(&command, &cmdlen, f)) break;
 			handle(command);
 			free(command);
 		}
 	}
 
-	toys.exitval = 1;
+	toys.exitval = TT.status;
 }